@@ -0,0 +1,198 @@
+// Consumes an xdph screencast node and measures how long frames take from the compositor to here.
+// Frame pts is the compositor's CLOCK_MONOTONIC timestamp, so dequeue time - pts is the end-to-end delay.
+// Compare with the "present -> queued" numbers xdph logs with screencopy:stats_interval to see where it goes.
+
+#include <pipewire/pipewire.h>
+#include <spa/param/video/format-utils.h>
+#include <spa/param/buffers.h>
+#include <spa/buffer/meta.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <csignal>
+#include <string>
+#include <vector>
+
+struct SProbe {
+    pw_main_loop*       loop   = nullptr;
+    pw_stream*          stream = nullptr;
+    spa_hook            listener;
+
+    std::vector<double> delaysMs;
+    uint64_t            frames     = 0;
+    uint64_t            metaOnly   = 0; // cursor updates without a new frame
+    uint64_t            corrupt    = 0;
+    uint64_t            seqSkipped = 0;
+    uint64_t            lastSeq    = 0;
+    bool                haveSeq    = false;
+
+    timespec            windowStart;
+};
+
+static uint64_t nowNs() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return SPA_TIMESPEC_TO_NSEC(&now);
+}
+
+// nearest-rank percentile, expects sorted samples
+static double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty())
+        return 0.0;
+
+    const size_t IDX = std::clamp((size_t)(p / 100.0 * sorted.size()), (size_t)0, sorted.size() - 1);
+    return sorted[IDX];
+}
+
+static void report(SProbe* probe) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const double WINDOWSEC = (SPA_TIMESPEC_TO_NSEC(&now) - SPA_TIMESPEC_TO_NSEC(&probe->windowStart)) / (double)SPA_NSEC_PER_SEC;
+
+    std::sort(probe->delaysMs.begin(), probe->delaysMs.end());
+
+    printf("%.1f fps, present -> dequeued p50 %.2fms p95 %.2fms p99 %.2fms max %.2fms, %lu metadata only, %lu corrupt, %lu skipped\n",
+           WINDOWSEC > 0 ? probe->frames / WINDOWSEC : 0.0, percentile(probe->delaysMs, 50), percentile(probe->delaysMs, 95), percentile(probe->delaysMs, 99),
+           probe->delaysMs.empty() ? 0.0 : probe->delaysMs.back(), probe->metaOnly, probe->corrupt, probe->seqSkipped);
+    fflush(stdout);
+
+    probe->windowStart = now;
+    probe->delaysMs.clear();
+    probe->frames     = 0;
+    probe->metaOnly   = 0;
+    probe->corrupt    = 0;
+    probe->seqSkipped = 0;
+}
+
+static void onProcess(void* data) {
+    const auto PROBE = (SProbe*)data;
+    const auto NOW   = nowNs();
+
+    pw_buffer* buffer = pw_stream_dequeue_buffer(PROBE->stream);
+    if (!buffer)
+        return;
+
+    spa_buffer*      spaBuf = buffer->buffer;
+    spa_meta_header* header = (spa_meta_header*)spa_buffer_find_meta_data(spaBuf, SPA_META_Header, sizeof(*header));
+
+    if (header) {
+        if (PROBE->haveSeq && header->seq > PROBE->lastSeq + 1)
+            PROBE->seqSkipped += header->seq - PROBE->lastSeq - 1;
+
+        PROBE->lastSeq = header->seq;
+        PROBE->haveSeq = true;
+    }
+
+    if (spaBuf->n_datas > 0 && spaBuf->datas[0].chunk->size == 0)
+        PROBE->metaOnly++;
+    else if (header && (header->flags & SPA_META_HEADER_FLAG_CORRUPTED))
+        PROBE->corrupt++;
+    else {
+        PROBE->frames++;
+        if (header && header->pts > 0 && NOW > (uint64_t)header->pts)
+            PROBE->delaysMs.push_back((NOW - header->pts) / 1000000.0);
+    }
+
+    pw_stream_queue_buffer(PROBE->stream, buffer);
+}
+
+static void onParamChanged(void* data, uint32_t id, const spa_pod* param) {
+    const auto PROBE = (SProbe*)data;
+
+    if (id != SPA_PARAM_Format || !param)
+        return;
+
+    spa_video_info_raw info;
+    spa_format_video_raw_parse(param, &info);
+    printf("negotiated format %u, %ux%u\n", info.format, info.size.width, info.size.height);
+
+    uint8_t         buffer[256];
+    spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+
+    const spa_pod*  params[1];
+    params[0] = (const spa_pod*)spa_pod_builder_add_object(&b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header), SPA_PARAM_META_size,
+                                                           SPA_POD_Int(sizeof(struct spa_meta_header)));
+
+    pw_stream_update_params(PROBE->stream, params, 1);
+}
+
+static void onStateChanged(void* data, pw_stream_state old, pw_stream_state state, const char* error) {
+    const auto PROBE = (SProbe*)data;
+
+    printf("stream %s\n", pw_stream_state_as_string(state));
+
+    if (state == PW_STREAM_STATE_ERROR || state == PW_STREAM_STATE_UNCONNECTED) {
+        if (error)
+            fprintf(stderr, "stream error: %s\n", error);
+        pw_main_loop_quit(PROBE->loop);
+    }
+}
+
+static const pw_stream_events streamEvents = {
+    .version       = PW_VERSION_STREAM_EVENTS,
+    .state_changed = onStateChanged,
+    .param_changed = onParamChanged,
+    .process       = onProcess,
+};
+
+static void onTimer(void* data, uint64_t expirations) {
+    report((SProbe*)data);
+}
+
+static void onQuit(void* data, int signal) {
+    pw_main_loop_quit(((SProbe*)data)->loop);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <node id> [report interval in seconds]\n", argv[0]);
+        return 1;
+    }
+
+    const std::string NODE     = argv[1];
+    const int         INTERVAL = argc > 2 ? std::max(atoi(argv[2]), 1) : 5;
+
+    pw_init(&argc, &argv);
+
+    SProbe probe;
+    probe.loop = pw_main_loop_new(nullptr);
+    clock_gettime(CLOCK_MONOTONIC, &probe.windowStart);
+
+    pw_loop* loop = pw_main_loop_get_loop(probe.loop);
+    pw_loop_add_signal(loop, SIGINT, onQuit, &probe);
+    pw_loop_add_signal(loop, SIGTERM, onQuit, &probe);
+
+    spa_source* timer    = pw_loop_add_timer(loop, onTimer, &probe);
+    timespec    interval = {.tv_sec = INTERVAL, .tv_nsec = 0};
+    pw_loop_update_timer(loop, timer, &interval, &interval, false);
+
+    probe.stream = pw_stream_new_simple(loop, "hyprland-latency-probe",
+                                        pw_properties_new(PW_KEY_MEDIA_TYPE, "Video", PW_KEY_MEDIA_CATEGORY, "Capture", PW_KEY_MEDIA_ROLE, "Screen", PW_KEY_TARGET_OBJECT,
+                                                          NODE.c_str(), nullptr),
+                                        &streamEvents, &probe);
+
+    // any raw video. Without a modifier this gets the shm path.
+    uint8_t         buffer[256];
+    spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+
+    const spa_pod*  params[1];
+    params[0] = (const spa_pod*)spa_pod_builder_add_object(&b, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat, SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+                                                           SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw));
+
+    if (pw_stream_connect(probe.stream, PW_DIRECTION_INPUT, PW_ID_ANY, PW_STREAM_FLAG_AUTOCONNECT, params, 1) < 0) {
+        fprintf(stderr, "couldn't connect to node %s\n", NODE.c_str());
+        return 1;
+    }
+
+    pw_main_loop_run(probe.loop);
+
+    report(&probe);
+
+    pw_stream_destroy(probe.stream);
+    pw_main_loop_destroy(probe.loop);
+    pw_deinit();
+
+    return 0;
+}
@@ -7,6 +7,7 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 
 #include <thread>
 
@@ -19,8 +20,13 @@ SOutput::SOutput(SP<CCWlOutput> output_) : output(output_) {
 
         Debug::log(LOG, "Found output name {}", name);
     });
-    output->setMode([this](CCWlOutput* r, uint32_t flags, int32_t width, int32_t height, int32_t refresh) { //
+    output->setMode([this](CCWlOutput* r, uint32_t flags, int32_t width_, int32_t height_, int32_t refresh) { //
+        if (!(flags & WL_OUTPUT_MODE_CURRENT))
+            return;
+
         refreshRate = refresh;
+        width       = width_;
+        height      = height_;
     });
     output->setGeometry([this](CCWlOutput* r, int32_t x, int32_t y, int32_t physical_width, int32_t physical_height, int32_t subpixel, const char* make, const char* model,
                                int32_t transform_) { //
@@ -28,6 +34,14 @@ SOutput::SOutput(SP<CCWlOutput> output_) : output(output_) {
     });
 }
 
+void SOutput::trackLogicalSize(SP<CCZxdgOutputManagerV1> mgr) {
+    xdgOutput = makeShared<CCZxdgOutputV1>(mgr->sendGetXdgOutput(output->resource()));
+    xdgOutput->setLogicalSize([this](CCZxdgOutputV1* r, int32_t width_, int32_t height_) {
+        logicalWidth  = width_;
+        logicalHeight = height_;
+    });
+}
+
 CPortalManager::CPortalManager() {
     const auto XDG_CONFIG_HOME = getenv("XDG_CONFIG_HOME");
     const auto HOME            = getenv("HOME");
@@ -41,9 +55,22 @@ CPortalManager::CPortalManager() {
     m_sConfig.config = std::make_unique<Hyprlang::CConfig>(path.c_str(), Hyprlang::SConfigOptions{.allowMissingConfig = true});
 
     m_sConfig.config->addConfigValue("general:toplevel_dynamic_bind", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("general:timer_slack", Hyprlang::INT{0L});
     m_sConfig.config->addConfigValue("screencopy:max_fps", Hyprlang::INT{120L});
     m_sConfig.config->addConfigValue("screencopy:allow_token_by_default", Hyprlang::INT{0L});
     m_sConfig.config->addConfigValue("screencopy:custom_picker_binary", Hyprlang::STRING{""});
+    m_sConfig.config->addConfigValue("screencopy:stats_interval", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:window_resize_headroom", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:explicit_sync", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:latest_frame_only", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:max_concurrent_captures", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:priority_apps", Hyprlang::STRING{""});
+    m_sConfig.config->addConfigValue("screencopy:render_node", Hyprlang::STRING{""});
+    m_sConfig.config->addConfigValue("screencopy:force_mod_linear", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:tile_damage", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:encoder", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:encoder_bitrate", Hyprlang::INT{2500L});
+    m_sConfig.config->addConfigValue("screencopy:share_region_captures", Hyprlang::INT{0L});
 
     m_sConfig.config->commence();
     m_sConfig.config->parse();
@@ -69,12 +96,52 @@ void CPortalManager::onGlobal(uint32_t name, const char* interface, uint32_t ver
             (wl_proxy*)wl_registry_bind((wl_registry*)m_sWaylandConnection.registry->resource(), name, &hyprland_toplevel_export_manager_v1_interface, version));
     }
 
+    else if (INTERFACE == ext_image_copy_capture_manager_v1_interface.name) {
+        m_sWaylandConnection.imageCopyCaptureMgr = makeShared<CCExtImageCopyCaptureManagerV1>(
+            (wl_proxy*)wl_registry_bind((wl_registry*)m_sWaylandConnection.registry->resource(), name, &ext_image_copy_capture_manager_v1_interface, version));
+    }
+
+    else if (INTERFACE == wl_seat_interface.name) {
+        // the pointer only identifies the cursor for ext cursor sessions, the first seat will do
+        if (m_sWaylandConnection.seat)
+            return;
+
+        m_sWaylandConnection.seat = makeShared<CCWlSeat>((wl_proxy*)wl_registry_bind((wl_registry*)m_sWaylandConnection.registry->resource(), name, &wl_seat_interface, version));
+
+        m_sWaylandConnection.seat->setCapabilities([this](CCWlSeat* r, auto caps) {
+            const bool HASPOINTER = (uint32_t)caps & WL_SEAT_CAPABILITY_POINTER;
+
+            if (HASPOINTER && !m_sWaylandConnection.pointer)
+                m_sWaylandConnection.pointer = makeShared<CCWlPointer>(m_sWaylandConnection.seat->sendGetPointer());
+            else if (!HASPOINTER)
+                m_sWaylandConnection.pointer.reset();
+        });
+    }
+
+    else if (INTERFACE == ext_output_image_capture_source_manager_v1_interface.name) {
+        m_sWaylandConnection.outputImageCaptureSourceMgr = makeShared<CCExtOutputImageCaptureSourceManagerV1>(
+            (wl_proxy*)wl_registry_bind((wl_registry*)m_sWaylandConnection.registry->resource(), name, &ext_output_image_capture_source_manager_v1_interface, version));
+    }
+
     else if (INTERFACE == wl_output_interface.name) {
         const auto POUTPUT = m_vOutputs
                                  .emplace_back(std::make_unique<SOutput>(makeShared<CCWlOutput>(
                                      (wl_proxy*)wl_registry_bind((wl_registry*)m_sWaylandConnection.registry->resource(), name, &wl_output_interface, version))))
                                  .get();
         POUTPUT->id = name;
+
+        if (m_sWaylandConnection.xdgOutputMgr)
+            POUTPUT->trackLogicalSize(m_sWaylandConnection.xdgOutputMgr);
+    }
+
+    else if (INTERFACE == zxdg_output_manager_v1_interface.name) {
+        m_sWaylandConnection.xdgOutputMgr = makeShared<CCZxdgOutputManagerV1>(
+            (wl_proxy*)wl_registry_bind((wl_registry*)m_sWaylandConnection.registry->resource(), name, &zxdg_output_manager_v1_interface, version));
+
+        // outputs bound before the manager
+        for (auto& o : m_vOutputs) {
+            o->trackLogicalSize(m_sWaylandConnection.xdgOutputMgr);
+        }
     }
 
     else if (INTERFACE == zwp_linux_dmabuf_v1_interface.name) {
@@ -101,11 +168,16 @@ void CPortalManager::onGlobal(uint32_t name, const char* interface, uint32_t ver
 
             drmDevice* drmDev;
             if (drmGetDeviceFromDevId(device, /* flags */ 0, &drmDev) != 0) {
-                Debug::log(WARN, "[dmabuf] unable to open main device?");
-                exit(1);
+                Debug::log(WARN, "[dmabuf] unable to open main device, screensharing will use shm");
+                return;
             }
 
-            m_sWaylandConnection.gbmDevice = createGBMDevice(drmDev);
+            const auto PDEVICE = dmabufDeviceFor(drmDev);
+
+            m_sWaylandConnection.gbmDevice = createGBMDevice(PDEVICE->drm);
+            PDEVICE->gbm                   = m_sWaylandConnection.gbmDevice;
+            if (!m_sWaylandConnection.gbmDevice)
+                Debug::log(WARN, "[dmabuf] no gbm device for the main device, screensharing will use shm");
         });
         m_sWaylandConnection.linuxDmabufFeedback->setFormatTable([this](CCZwpLinuxDmabufFeedbackV1* r, int fd, uint32_t size) {
             Debug::log(TRACE, "[core] dmabufFeedbackFormatTable");
@@ -113,7 +185,11 @@ void CPortalManager::onGlobal(uint32_t name, const char* interface, uint32_t ver
             if (m_sWaylandConnection.dma.done)
                 return;
 
-            m_vDMABUFMods.clear();
+            for (auto& d : m_sWaylandConnection.dma.devices) {
+                d->mods.clear();
+            }
+
+            m_sWaylandConnection.dma.trancheIdx = 0;
 
             m_sWaylandConnection.dma.formatTable = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
 
@@ -138,6 +214,7 @@ void CPortalManager::onGlobal(uint32_t name, const char* interface, uint32_t ver
             m_sWaylandConnection.dma.formatTable     = nullptr;
             m_sWaylandConnection.dma.formatTableSize = 0;
             m_sWaylandConnection.dma.done            = true;
+            m_sWaylandConnection.dma.generation++;
         });
         m_sWaylandConnection.linuxDmabufFeedback->setTrancheTargetDevice([this](CCZwpLinuxDmabufFeedbackV1* r, wl_array* device_arr) {
             Debug::log(TRACE, "[core] dmabufFeedbackTrancheTargetDevice");
@@ -153,13 +230,13 @@ void CPortalManager::onGlobal(uint32_t name, const char* interface, uint32_t ver
             if (drmGetDeviceFromDevId(device, /* flags */ 0, &drmDev) != 0)
                 return;
 
-            if (m_sWaylandConnection.gbmDevice) {
-                drmDevice* drmDevRenderer = NULL;
-                drmGetDevice2(gbm_device_get_fd(m_sWaylandConnection.gbmDevice), /* flags */ 0, &drmDevRenderer);
-                m_sWaylandConnection.dma.deviceUsed = drmDevicesEqual(drmDevRenderer, drmDev);
-            } else {
-                m_sWaylandConnection.gbmDevice      = createGBMDevice(drmDev);
-                m_sWaylandConnection.dma.deviceUsed = m_sWaylandConnection.gbm;
+            // formats are kept per device, so streams allocating elsewhere know what the compositor imports from there
+            m_sWaylandConnection.dma.tranche = dmabufDeviceFor(drmDev);
+
+            // no main device, take the first one we can open
+            if (!m_sWaylandConnection.gbmDevice) {
+                m_sWaylandConnection.gbmDevice        = createGBMDevice(m_sWaylandConnection.dma.tranche->drm);
+                m_sWaylandConnection.dma.tranche->gbm = m_sWaylandConnection.gbmDevice;
             }
         });
         m_sWaylandConnection.linuxDmabufFeedback->setTrancheFormats([this](CCZwpLinuxDmabufFeedbackV1* r, wl_array* indices) {
@@ -168,7 +245,7 @@ void CPortalManager::onGlobal(uint32_t name, const char* interface, uint32_t ver
             if (m_sWaylandConnection.dma.done)
                 return;
 
-            if (!m_sWaylandConnection.dma.deviceUsed || !m_sWaylandConnection.dma.formatTable)
+            if (!m_sWaylandConnection.dma.tranche || !m_sWaylandConnection.dma.formatTable)
                 return;
 
             struct fm_entry {
@@ -187,7 +264,25 @@ void CPortalManager::onGlobal(uint32_t name, const char* interface, uint32_t ver
                 if (*idx >= n_modifiers)
                     continue;
 
-                m_vDMABUFMods.push_back({(fm_entry + *idx)->format, (fm_entry + *idx)->modifier});
+                m_sWaylandConnection.dma.tranche->mods.push_back(
+                    {(fm_entry + *idx)->format, (fm_entry + *idx)->modifier, m_sWaylandConnection.dma.trancheIdx, m_sWaylandConnection.dma.trancheScanout});
+            }
+        });
+        m_sWaylandConnection.linuxDmabufFeedback->setTrancheFlags([this](CCZwpLinuxDmabufFeedbackV1* r, auto flags) {
+            Debug::log(TRACE, "[core] dmabufFeedbackTrancheFlags {}", (uint32_t)flags);
+
+            if (m_sWaylandConnection.dma.done || !((uint32_t)flags & ZWP_LINUX_DMABUF_FEEDBACK_V1_TRANCHE_FLAGS_SCANOUT))
+                return;
+
+            m_sWaylandConnection.dma.trancheScanout = true;
+
+            // may come before or after the formats
+            if (!m_sWaylandConnection.dma.tranche)
+                return;
+
+            for (auto& mod : m_sWaylandConnection.dma.tranche->mods) {
+                if (mod.tranche == m_sWaylandConnection.dma.trancheIdx)
+                    mod.scanout = true;
             }
         });
         m_sWaylandConnection.linuxDmabufFeedback->setTrancheDone([this](CCZwpLinuxDmabufFeedbackV1* r) {
@@ -196,7 +291,9 @@ void CPortalManager::onGlobal(uint32_t name, const char* interface, uint32_t ver
             if (m_sWaylandConnection.dma.done)
                 return;
 
-            m_sWaylandConnection.dma.deviceUsed = false;
+            m_sWaylandConnection.dma.tranche        = nullptr;
+            m_sWaylandConnection.dma.trancheScanout = false;
+            m_sWaylandConnection.dma.trancheIdx++;
         });
 
     }
@@ -258,20 +355,39 @@ void CPortalManager::init() {
     m_sWaylandConnection.registry->setGlobal([this](CCWlRegistry* r, uint32_t name, const char* iface, uint32_t ver) { onGlobal(name, iface, ver); });
     m_sWaylandConnection.registry->setGlobalRemove([this](CCWlRegistry* r, uint32_t name) { onGlobalRemoved(name); });
 
+    m_sMainThreadTasks.eventFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if (m_sMainThreadTasks.eventFD < 0) {
+        Debug::log(CRIT, "Couldn't create an eventfd for the event loop");
+        exit(1);
+    }
+
     pw_init(nullptr, nullptr);
-    m_sPipewire.loop = pw_loop_new(nullptr);
+    m_sPipewire.threadLoop = pw_thread_loop_new("xdph-pipewire", nullptr);
 
-    if (!m_sPipewire.loop)
+    if (!m_sPipewire.threadLoop)
         Debug::log(ERR, "Pipewire: refused to create a loop. Screensharing will not work.");
+    else
+        m_sPipewire.loop = pw_thread_loop_get_loop(m_sPipewire.threadLoop);
 
     Debug::log(LOG, "Gathering exported interfaces");
 
     wl_display_roundtrip(m_sWaylandConnection.display);
 
+    const bool HAS_EXT_CAPTURE = m_sWaylandConnection.imageCopyCaptureMgr && m_sWaylandConnection.outputImageCaptureSourceMgr;
+
+    // ext-image-copy-capture alone is enough to share outputs
+    if (!m_sPortals.screencopy && HAS_EXT_CAPTURE && m_sPipewire.loop)
+        m_sPortals.screencopy = std::make_unique<CScreencopyPortal>(nullptr);
+
     if (!m_sPortals.screencopy)
-        Debug::log(WARN, "Screencopy not started: compositor doesn't support zwlr_screencopy_v1 or pw refused a loop");
-    else if (m_sWaylandConnection.hyprlandToplevelMgr)
-        m_sPortals.screencopy->appendToplevelExport(m_sWaylandConnection.hyprlandToplevelMgr);
+        Debug::log(WARN, "Screencopy not started: compositor doesn't support zwlr_screencopy_v1 nor ext_image_copy_capture_v1, or pw refused a loop");
+    else {
+        if (m_sWaylandConnection.hyprlandToplevelMgr)
+            m_sPortals.screencopy->appendToplevelExport(m_sWaylandConnection.hyprlandToplevelMgr);
+        if (HAS_EXT_CAPTURE)
+            m_sPortals.screencopy->appendImageCopyCapture(m_sWaylandConnection.imageCopyCaptureMgr, m_sWaylandConnection.outputImageCaptureSourceMgr);
+    }
 
     if (!inShellPath("grim"))
         Debug::log(WARN, "grim not found. Screenshots will not work.");
@@ -294,6 +410,9 @@ void CPortalManager::init() {
 
 void CPortalManager::startEventLoop() {
 
+    if (m_sPipewire.threadLoop && pw_thread_loop_start(m_sPipewire.threadLoop) < 0)
+        Debug::log(ERR, "Pipewire: couldn't start the loop thread. Screensharing will not work.");
+
     pollfd pollfds[] = {
         {
             .fd     = m_pConnection->getEventLoopPollData().fd,
@@ -304,20 +423,22 @@ void CPortalManager::startEventLoop() {
             .events = POLLIN,
         },
         {
-            .fd     = pw_loop_get_fd(m_sPipewire.loop),
+            .fd     = m_sMainThreadTasks.eventFD,
             .events = POLLIN,
         },
     };
 
+    constexpr size_t POLLFD_COUNT = sizeof(pollfds) / sizeof(pollfds[0]);
+
     std::thread pollThr([this, &pollfds]() {
         while (1) {
-            int ret = poll(pollfds, 3, 5000 /* 5 seconds, reasonable. It's because we might need to terminate */);
+            int ret = poll(pollfds, POLLFD_COUNT, 5000 /* 5 seconds, reasonable. It's because we might need to terminate */);
             if (ret < 0) {
                 Debug::log(CRIT, "[core] Polling fds failed with {}", strerror(errno));
                 g_pPortalManager->terminate();
             }
 
-            for (size_t i = 0; i < 3; ++i) {
+            for (size_t i = 0; i < POLLFD_COUNT; ++i) {
                 if (pollfds[i].revents & POLLHUP) {
                     Debug::log(CRIT, "[core] Disconnected from pollfd id {}", i);
                     g_pPortalManager->terminate();
@@ -340,18 +461,34 @@ void CPortalManager::startEventLoop() {
         while (1) {
             std::unique_lock lk(m_sTimersThread.loopMutex);
 
-            // find nearest timer ms
+            static auto* const* PSLACK = (Hyprlang::INT* const*)m_sConfig.config->getConfigValuePtr("general:timer_slack")->getDataStaticPtr();
+
+            // find nearest timer ms. Passed ones were already signalled, the event loop will get to them.
             m_mEventLock.lock();
             float nearest = 60000; /* reasonable timeout */
             for (auto& t : m_sTimersThread.timers) {
                 float until = t->duration() - t->passedMs();
-                if (until < nearest)
+                if (!t->passed() && until < nearest)
                     nearest = until;
             }
+
+            // with slack, wake up for the last timer due within it instead, and fire them all together
+            float wakeup = nearest;
+            if (**PSLACK > 0) {
+                for (auto& t : m_sTimersThread.timers) {
+                    float until = t->duration() - t->passedMs();
+                    if (until > wakeup && until <= nearest + **PSLACK)
+                        wakeup = until;
+                }
+            }
+
+            const auto WAKEUP          = std::chrono::high_resolution_clock::now() + std::chrono::milliseconds((int)wakeup);
+            m_sTimersThread.nextWakeup = WAKEUP;
             m_mEventLock.unlock();
 
-            m_sTimersThread.loopSignal.wait_for(lk, std::chrono::milliseconds((int)nearest), [this] { return m_sTimersThread.shouldProcess; });
+            m_sTimersThread.loopSignal.wait_until(lk, WAKEUP, [this] { return m_sTimersThread.shouldProcess; });
             m_sTimersThread.shouldProcess = false;
+            m_sTimersThread.wakeups++;
 
             if (m_bTerminate)
                 break;
@@ -388,6 +525,7 @@ void CPortalManager::startEventLoop() {
             break;
 
         m_sEventLoopInternals.shouldProcess = false;
+        m_sEventLoopInternals.wakeups++;
 
         m_mEventLock.lock();
 
@@ -401,30 +539,31 @@ void CPortalManager::startEventLoop() {
             wl_display_flush(m_sWaylandConnection.display);
             if (wl_display_prepare_read(m_sWaylandConnection.display) == 0) {
                 wl_display_read_events(m_sWaylandConnection.display);
+                dispatchCaptureQueues();
                 wl_display_dispatch_pending(m_sWaylandConnection.display);
             } else {
                 wl_display_dispatch(m_sWaylandConnection.display);
             }
         }
 
-        if (pollfds[2].revents & POLLIN /* pw */) {
-            while (pw_loop_iterate(m_sPipewire.loop, 0) != 0) {
-                ;
-            }
-        }
+        // not gated on revents: tasks may have been queued after the last poll
+        processMainThreadTasks();
 
+        // by index: callbacks may add timers
         std::vector<CTimer*> toRemove;
-        for (auto& t : m_sTimersThread.timers) {
-            if (t->passed()) {
-                t->m_fnCallback();
-                toRemove.emplace_back(t.get());
-                Debug::log(TRACE, "[core] calling timer {}", (void*)t.get());
+        for (size_t i = 0; i < m_sTimersThread.timers.size(); ++i) {
+            const auto PTIMER = m_sTimersThread.timers[i].get();
+            if (PTIMER->passed()) {
+                PTIMER->m_fnCallback();
+                toRemove.emplace_back(PTIMER);
+                Debug::log(TRACE, "[core] calling timer {}", (void*)PTIMER);
             }
         }
 
         int ret = 0;
         do {
-            ret = wl_display_dispatch_pending(m_sWaylandConnection.display);
+            ret = dispatchCaptureQueues();
+            ret = std::max(wl_display_dispatch_pending(m_sWaylandConnection.display), ret);
             wl_display_flush(m_sWaylandConnection.display);
         } while (ret > 0);
 
@@ -437,17 +576,30 @@ void CPortalManager::startEventLoop() {
 
     Debug::log(ERR, "[core] Terminated");
 
+    if (m_sPipewire.threadLoop)
+        pw_thread_loop_stop(m_sPipewire.threadLoop);
+
     m_sPortals.globalShortcuts.reset();
     m_sPortals.screencopy.reset();
     m_sPortals.screenshot.reset();
     m_sHelpers.toplevel.reset();
 
     m_pConnection.reset();
-    pw_loop_destroy(m_sPipewire.loop);
+    if (m_sPipewire.threadLoop)
+        pw_thread_loop_destroy(m_sPipewire.threadLoop);
     wl_display_disconnect(m_sWaylandConnection.display);
 
     m_sTimersThread.thread.release();
     pollThr.join(); // wait for poll to exit
+
+    // detached picker threads may still be dispatching, see dispatchOnMainThread
+    std::vector<std::function<void()>> unrun;
+    {
+        std::lock_guard<std::mutex> lg(m_sMainThreadTasks.mutex);
+        close(m_sMainThreadTasks.eventFD);
+        m_sMainThreadTasks.eventFD = -1;
+        unrun.swap(m_sMainThreadTasks.tasks);
+    }
 }
 
 sdbus::IConnection* CPortalManager::getConnection() {
@@ -462,6 +614,19 @@ SOutput* CPortalManager::getOutputFromName(const std::string& name) {
     return nullptr;
 }
 
+void CPortalManager::getMaxOutputSize(uint32_t* w, uint32_t* h) {
+    *w = 0;
+    *h = 0;
+
+    for (auto& o : m_vOutputs) {
+        // odd transforms are rotated by 90 or 270 degrees
+        const bool ROTATED = o->transform % 2 == 1;
+
+        *w = std::max(*w, ROTATED ? o->height : o->width);
+        *h = std::max(*h, ROTATED ? o->width : o->height);
+    }
+}
+
 static char* gbm_find_render_node(drmDevice* device) {
     drmDevice* devices[64];
     char*      render_node = NULL;
@@ -504,13 +669,147 @@ gbm_device* CPortalManager::createGBMDevice(drmDevice* dev) {
     return gbm_create_device(fd);
 }
 
+SDMABUFDevice* CPortalManager::dmabufDeviceFor(drmDevice* dev) {
+    for (auto& d : m_sWaylandConnection.dma.devices) {
+        if (drmDevicesEqual(d->drm, dev)) {
+            drmFreeDevice(&dev);
+            return d.get();
+        }
+    }
+
+    const auto PDEVICE = m_sWaylandConnection.dma.devices.emplace_back(std::make_unique<SDMABUFDevice>()).get();
+    PDEVICE->drm       = dev;
+    return PDEVICE;
+}
+
+SDMABUFDevice* CPortalManager::mainDMABUFDevice() {
+    if (!m_sWaylandConnection.gbmDevice)
+        return nullptr;
+
+    for (auto& d : m_sWaylandConnection.dma.devices) {
+        if (d->gbm == m_sWaylandConnection.gbmDevice)
+            return d.get();
+    }
+
+    return nullptr;
+}
+
+SDMABUFDevice* CPortalManager::allocationDevice() {
+    static auto* const* PRENDERNODE = (Hyprlang::STRING* const)m_sConfig.config->getConfigValuePtr("screencopy:render_node")->getDataStaticPtr();
+
+    const std::string   RENDERNODE = *PRENDERNODE;
+
+    if (RENDERNODE.empty() || !m_sWaylandConnection.dma.done)
+        return mainDMABUFDevice();
+
+    if (m_sWaylandConnection.dma.allocation)
+        return m_sWaylandConnection.dma.allocation;
+
+    // whatever happens, don't try again for every stream
+    m_sWaylandConnection.dma.allocation = mainDMABUFDevice();
+
+    int        fd     = open(RENDERNODE.c_str(), O_RDWR | O_CLOEXEC);
+    drmDevice* drmDev = nullptr;
+    if (fd < 0 || drmGetDevice2(fd, /* flags */ 0, &drmDev) != 0) {
+        Debug::log(ERR, "[core] couldn't open screencopy:render_node {}, allocating on the main device", RENDERNODE);
+        if (fd >= 0)
+            close(fd);
+        return m_sWaylandConnection.dma.allocation;
+    }
+
+    const auto PDEVICE = dmabufDeviceFor(drmDev);
+
+    if (!PDEVICE->gbm)
+        PDEVICE->gbm = gbm_create_device(fd);
+    else
+        close(fd);
+
+    if (!PDEVICE->gbm) {
+        Debug::log(ERR, "[core] no gbm device for screencopy:render_node {}, allocating on the main device", RENDERNODE);
+        close(fd);
+        return m_sWaylandConnection.dma.allocation;
+    }
+
+    if (PDEVICE->mods.empty())
+        Debug::log(WARN, "[core] the compositor has no dmabuf tranche for {}, only linear buffers will be shared from it", RENDERNODE);
+    else
+        Debug::log(LOG, "[core] allocating screencopy buffers on {}", RENDERNODE);
+
+    m_sWaylandConnection.dma.allocation = PDEVICE;
+    return PDEVICE;
+}
+
 void CPortalManager::addTimer(const CTimer& timer) {
     Debug::log(TRACE, "[core] adding timer for {}ms", timer.duration());
     m_sTimersThread.timers.emplace_back(std::make_unique<CTimer>(timer));
+
+    static auto* const* PSLACK = (Hyprlang::INT* const*)m_sConfig.config->getConfigValuePtr("general:timer_slack")->getDataStaticPtr();
+
+    // the timers thread is already waking up early enough for this one
+    const auto DEADLINE = std::chrono::high_resolution_clock::now() + std::chrono::milliseconds((int64_t)timer.duration() - std::max(**PSLACK, (Hyprlang::INT)0));
+    if (DEADLINE >= m_sTimersThread.nextWakeup.load())
+        return;
+
     m_sTimersThread.shouldProcess = true;
     m_sTimersThread.loopSignal.notify_all();
 }
 
+uint64_t CPortalManager::wakeups() const {
+    return m_sTimersThread.wakeups + m_sEventLoopInternals.wakeups;
+}
+
+void CPortalManager::dispatchOnMainThread(std::function<void()> fn) {
+    // the eventfd is closed under the same lock on shutdown, so it's either still open here or gone for good
+    std::lock_guard<std::mutex> lg(m_sMainThreadTasks.mutex);
+
+    if (m_sMainThreadTasks.eventFD < 0) {
+        Debug::log(TRACE, "[core] dropping a main thread task, shutting down");
+        return;
+    }
+
+    m_sMainThreadTasks.tasks.emplace_back(std::move(fn));
+
+    // wakes up the poll thread, which in turn wakes up the event loop
+    const uint64_t ONE = 1;
+    if (write(m_sMainThreadTasks.eventFD, &ONE, sizeof(ONE)) < 0)
+        Debug::log(ERR, "[core] Couldn't signal the main thread: {}", strerror(errno));
+}
+
+void CPortalManager::processMainThreadTasks() {
+    // drain the eventfd first, so that tasks queued while we run the current batch wake us up again
+    uint64_t count = 0;
+    if (read(m_sMainThreadTasks.eventFD, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        Debug::log(ERR, "[core] Couldn't read the main thread eventfd: {}", strerror(errno));
+
+    std::vector<std::function<void()>> tasks;
+    {
+        std::lock_guard<std::mutex> lg(m_sMainThreadTasks.mutex);
+        tasks.swap(m_sMainThreadTasks.tasks);
+    }
+
+    for (auto& t : tasks) {
+        Debug::log(TRACE, "[core] running main thread task");
+        t();
+    }
+}
+
+int CPortalManager::dispatchCaptureQueues() {
+    if (!m_sPortals.screencopy)
+        return 0;
+
+    return m_sPortals.screencopy->dispatchCaptureQueues();
+}
+
+CPipewireLock::CPipewireLock() : m_pLoop(g_pPortalManager->m_sPipewire.threadLoop) {
+    if (m_pLoop)
+        pw_thread_loop_lock(m_pLoop);
+}
+
+CPipewireLock::~CPipewireLock() {
+    if (m_pLoop)
+        pw_thread_loop_unlock(m_pLoop);
+}
+
 void CPortalManager::terminate() {
     m_bTerminate = true;
 
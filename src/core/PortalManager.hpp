@@ -19,6 +19,9 @@
 #include "linux-dmabuf-v1.hpp"
 #include "wlr-foreign-toplevel-management-unstable-v1.hpp"
 #include "wlr-screencopy-unstable-v1.hpp"
+#include "ext-image-copy-capture-v1.hpp"
+#include "ext-image-capture-source-v1.hpp"
+#include "xdg-output-unstable-v1.hpp"
 
 #include "../includes.hpp"
 #include "../dbusDefines.hpp"
@@ -26,19 +29,34 @@
 #include <mutex>
 
 struct pw_loop;
+struct pw_thread_loop;
 
 struct SOutput {
     SOutput(SP<CCWlOutput>);
+    void                trackLogicalSize(SP<CCZxdgOutputManagerV1> mgr);
+
     std::string         name;
     SP<CCWlOutput>      output      = nullptr;
     uint32_t            id          = 0;
     float               refreshRate = 60.0;
     wl_output_transform transform   = WL_OUTPUT_TRANSFORM_NORMAL;
+    uint32_t            width = 0, height = 0;               // current mode
+    uint32_t            logicalWidth = 0, logicalHeight = 0; // in the compositor's layout, 0 without xdg_output
+    SP<CCZxdgOutputV1>  xdgOutput;
 };
 
 struct SDMABUFModifier {
-    uint32_t fourcc = 0;
-    uint64_t mod    = 0;
+    uint32_t fourcc  = 0;
+    uint64_t mod     = 0;
+    uint32_t tranche = 0;     // index in the feedback, the compositor sends its preferred tranches first
+    bool     scanout = false; // from a tranche the compositor can scan out directly
+};
+
+// a device from the compositor's dmabuf feedback, or the one from screencopy:render_node
+struct SDMABUFDevice {
+    drmDevice*                   drm = nullptr;
+    gbm_device*                  gbm = nullptr; // only opened for devices we allocate on
+    std::vector<SDMABUFModifier> mods;          // from the compositor's tranches for it. None means it can only import linear buffers from here.
 };
 
 class CPortalManager {
@@ -53,8 +71,13 @@ class CPortalManager {
     sdbus::IConnection* getConnection();
     SOutput*            getOutputFromName(const std::string& name);
 
+    // the largest current mode of all outputs, rotated like the output
+    void                getMaxOutputSize(uint32_t* w, uint32_t* h);
+
+    // pipewire runs on its own thread. Only code touching a pw_stream or its SPWStream takes its lock (see CPipewireLock), frames go over through readyBuffers
     struct {
-        pw_loop* loop = nullptr;
+        pw_thread_loop* threadLoop = nullptr;
+        pw_loop*        loop       = nullptr;
     } m_sPipewire;
 
     struct {
@@ -69,19 +92,30 @@ class CPortalManager {
     } m_sHelpers;
 
     struct {
-        wl_display*                           display = nullptr;
-        SP<CCWlRegistry>                      registry;
-        SP<CCHyprlandToplevelExportManagerV1> hyprlandToplevelMgr;
-        SP<CCZwpLinuxDmabufV1>                linuxDmabuf;
-        SP<CCZwpLinuxDmabufFeedbackV1>        linuxDmabufFeedback;
-        SP<CCWlShm>                           shm;
-        gbm_bo*                               gbm       = nullptr;
-        gbm_device*                           gbmDevice = nullptr;
+        wl_display*                                display = nullptr;
+        SP<CCWlRegistry>                           registry;
+        SP<CCHyprlandToplevelExportManagerV1>      hyprlandToplevelMgr;
+        SP<CCExtImageCopyCaptureManagerV1>         imageCopyCaptureMgr;
+        SP<CCExtOutputImageCaptureSourceManagerV1> outputImageCaptureSourceMgr;
+        SP<CCZxdgOutputManagerV1>                  xdgOutputMgr;
+        SP<CCZwpLinuxDmabufV1>                     linuxDmabuf;
+        SP<CCZwpLinuxDmabufFeedbackV1>             linuxDmabufFeedback;
+        SP<CCWlShm>                                shm;
+        SP<CCWlSeat>                               seat;
+        SP<CCWlPointer>                            pointer;
+        gbm_bo*                                    gbm       = nullptr;
+        gbm_device*                                gbmDevice = nullptr;
         struct {
-            void*  formatTable     = nullptr;
-            size_t formatTableSize = 0;
-            bool   deviceUsed      = false;
-            bool   done            = false;
+            void*                                       formatTable     = nullptr;
+            size_t                                      formatTableSize = 0;
+            bool                                        done            = false;
+            uint32_t                                    generation      = 0; // bumped with every complete feedback
+
+            std::vector<std::unique_ptr<SDMABUFDevice>> devices;
+            SDMABUFDevice*                              tranche        = nullptr; // device of the tranche being received
+            uint32_t                                    trancheIdx     = 0;
+            bool                                        trancheScanout = false;
+            SDMABUFDevice*                              allocation     = nullptr; // see allocationDevice
         } dma;
     } m_sWaylandConnection;
 
@@ -89,10 +123,20 @@ class CPortalManager {
         std::unique_ptr<Hyprlang::CConfig> config;
     } m_sConfig;
 
-    std::vector<SDMABUFModifier> m_vDMABUFMods;
+    // the device of m_sWaylandConnection.gbmDevice, nullptr without dma
+    SDMABUFDevice*               mainDMABUFDevice();
+
+    // where buffers for pipewire are allocated: screencopy:render_node if set, the main device otherwise
+    SDMABUFDevice*               allocationDevice();
 
     void                         addTimer(const CTimer& timer);
 
+    // wakeups of the event loop and timers threads since start
+    uint64_t                     wakeups() const;
+
+    // thread-safe. fn will be called from the event loop thread on its next iteration.
+    void                         dispatchOnMainThread(std::function<void()> fn);
+
     gbm_device*                  createGBMDevice(drmDevice* dev);
 
     // terminate after the event loop has been created. Before we can exit()
@@ -109,20 +153,50 @@ class CPortalManager {
         std::mutex              loopMutex;
         std::atomic<bool>       shouldProcess = false;
         std::mutex              loopRequestMutex;
+        std::atomic<uint64_t>   wakeups = 0;
     } m_sEventLoopInternals;
 
     struct {
-        std::condition_variable              loopSignal;
-        std::mutex                           loopMutex;
-        bool                                 shouldProcess = false;
-        std::vector<std::unique_ptr<CTimer>> timers;
-        std::unique_ptr<std::thread>         thread;
+        std::condition_variable                                     loopSignal;
+        std::mutex                                                  loopMutex;
+        bool                                                        shouldProcess = false;
+        std::vector<std::unique_ptr<CTimer>>                        timers;
+        std::unique_ptr<std::thread>                                thread;
+        std::atomic<std::chrono::high_resolution_clock::time_point> nextWakeup;
+        std::atomic<uint64_t>                                       wakeups = 0;
     } m_sTimersThread;
 
+    struct {
+        int                                eventFD = -1;
+        std::mutex                         mutex;
+        std::vector<std::function<void()>> tasks;
+    } m_sMainThreadTasks;
+
+    void                                  processMainThreadTasks();
+
+    // frame events go first, before whatever piled up on the default queue
+    int                                   dispatchCaptureQueues();
+
+    // finds or adds the device, takes ownership of dev
+    SDMABUFDevice*                        dmabufDeviceFor(drmDevice* dev);
+
     std::unique_ptr<sdbus::IConnection>   m_pConnection;
     std::vector<std::unique_ptr<SOutput>> m_vOutputs;
 
     std::mutex                            m_mEventLock;
 };
 
+// holds the pipewire thread loop lock for its lifetime. The lock is recursive, and this is a no-op if pipewire isn't up.
+class CPipewireLock {
+  public:
+    CPipewireLock();
+    ~CPipewireLock();
+
+    CPipewireLock(const CPipewireLock&)            = delete;
+    CPipewireLock& operator=(const CPipewireLock&) = delete;
+
+  private:
+    pw_thread_loop* m_pLoop = nullptr;
+};
+
 inline std::unique_ptr<CPortalManager> g_pPortalManager;
@@ -2,4 +2,5 @@
 
 #include <sdbus-c++/sdbus-c++.h>
 
-typedef std::tuple<uint32_t, std::unordered_map<std::string, sdbus::Variant>> dbUasv;
\ No newline at end of file
+typedef std::tuple<uint32_t, std::unordered_map<std::string, sdbus::Variant>> dbUasv;
+typedef sdbus::Result<uint32_t, std::unordered_map<std::string, sdbus::Variant>> dbUasvResult;
\ No newline at end of file
@@ -0,0 +1,94 @@
+#include "FrameStats.hpp"
+#include "Log.hpp"
+
+#include <algorithm>
+
+// per report window. Bounds memory when nothing reports.
+constexpr static size_t MAX_SAMPLES = 10000;
+
+// nearest-rank percentile, expects sorted samples
+static float percentile(const std::vector<float>& sorted, float p) {
+    if (sorted.empty())
+        return 0.F;
+
+    const size_t IDX = std::clamp((size_t)(p / 100.F * sorted.size()), (size_t)0, sorted.size() - 1);
+    return sorted[IDX];
+}
+
+void CFrameStats::onCaptureRequested() {
+    m_tRequested      = std::chrono::steady_clock::now();
+    m_bRequestPending = true;
+}
+
+void CFrameStats::onFrameReady() {
+    m_iFrames++;
+
+    if (!m_bRequestPending)
+        return;
+
+    m_bRequestPending = false;
+    if (m_vLatenciesMs.size() < MAX_SAMPLES)
+        m_vLatenciesMs.push_back(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_tRequested).count() / 1000.F);
+}
+
+void CFrameStats::onFrameFailed() {
+    m_iFailed++;
+    m_bRequestPending = false;
+}
+
+void CFrameStats::onFrameDropped() {
+    m_iDropped++;
+    m_bRequestPending = false;
+}
+
+// captured fine, but identical to the last frame and never sent
+void CFrameStats::onFrameUnchanged() {
+    m_iUnchanged++;
+}
+
+void CFrameStats::onRenegotiationRequested() {
+    m_iRenegRequests++;
+}
+
+void CFrameStats::onRenegotiation() {
+    m_iRenegotiations++;
+}
+
+void CFrameStats::onEnqueue(std::chrono::steady_clock::duration took) {
+    m_fEnqueueUsTotal += std::chrono::duration_cast<std::chrono::nanoseconds>(took).count() / 1000.0;
+}
+
+// sincePresent is measured from the compositor's frame timestamp
+void CFrameStats::onQueued(std::chrono::nanoseconds sincePresent) {
+    if (m_vQueueDelaysMs.size() < MAX_SAMPLES)
+        m_vQueueDelaysMs.push_back(std::chrono::duration_cast<std::chrono::microseconds>(sincePresent).count() / 1000.F);
+}
+
+uint64_t CFrameStats::frames() const {
+    return m_iFrames;
+}
+
+void CFrameStats::report(const std::string& name) {
+    const auto NOW       = std::chrono::steady_clock::now();
+    const auto WINDOWSEC = std::chrono::duration_cast<std::chrono::milliseconds>(NOW - m_tWindowStart).count() / 1000.0;
+
+    std::sort(m_vLatenciesMs.begin(), m_vLatenciesMs.end());
+    std::sort(m_vQueueDelaysMs.begin(), m_vQueueDelaysMs.end());
+
+    Debug::log(LOG, "[stats] {}: {:.1f} fps, latency p50 {:.2f}ms p95 {:.2f}ms p99 {:.2f}ms, enqueue {:.1f}us avg, {} failed, {} dropped, {} unchanged, {} renegotiations ({} requested)",
+               name, WINDOWSEC > 0 ? m_iFrames / WINDOWSEC : 0.0, percentile(m_vLatenciesMs, 50), percentile(m_vLatenciesMs, 95), percentile(m_vLatenciesMs, 99),
+               m_iFrames > 0 ? m_fEnqueueUsTotal / m_iFrames : 0.0, m_iFailed, m_iDropped, m_iUnchanged, m_iRenegotiations, m_iRenegRequests);
+    Debug::log(LOG, "[stats] {}: present -> queued p50 {:.2f}ms p95 {:.2f}ms p99 {:.2f}ms", name, percentile(m_vQueueDelaysMs, 50), percentile(m_vQueueDelaysMs, 95),
+               percentile(m_vQueueDelaysMs, 99));
+
+    m_tWindowStart = NOW;
+    m_vLatenciesMs.clear();
+    m_vQueueDelaysMs.clear();
+    m_iFrames         = 0;
+    m_iFailed         = 0;
+    m_iDropped        = 0;
+    m_iUnchanged      = 0;
+    m_iRenegotiations = 0;
+    m_iRenegRequests  = 0;
+    m_fEnqueueUsTotal = 0;
+}
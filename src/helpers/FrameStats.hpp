@@ -0,0 +1,41 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Capture pipeline statistics of a single session. Only reported when screencopy:stats_interval is set.
+class CFrameStats {
+  public:
+    void     onCaptureRequested();
+    void     onFrameReady();
+    void     onFrameFailed();
+    void     onFrameDropped();
+    void     onFrameUnchanged();
+    void     onRenegotiationRequested();
+    void     onRenegotiation();
+    void     onEnqueue(std::chrono::steady_clock::duration took);
+    void     onQueued(std::chrono::nanoseconds sincePresent);
+
+    // frames delivered since the last report
+    uint64_t frames() const;
+
+    // logs everything since the last report, then starts a new window
+    void     report(const std::string& name);
+
+  private:
+    std::chrono::steady_clock::time_point m_tWindowStart = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point m_tRequested;
+    bool                                  m_bRequestPending = false;
+
+    std::vector<float>                    m_vLatenciesMs;
+    std::vector<float>                    m_vQueueDelaysMs;
+    uint64_t                              m_iFrames         = 0;
+    uint64_t                              m_iFailed         = 0;
+    uint64_t                              m_iDropped        = 0;
+    uint64_t                              m_iUnchanged      = 0;
+    uint64_t                              m_iRenegotiations = 0;
+    uint64_t                              m_iRenegRequests  = 0;
+    double                                m_fEnqueueUsTotal = 0;
+};
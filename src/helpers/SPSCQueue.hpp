@@ -0,0 +1,47 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <optional>
+
+// Bounded, lock-free single producer single consumer ring.
+// push() may only be called from one thread, pop() only from one (other) thread.
+template <typename T, size_t N>
+class CSPSCQueue {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "CSPSCQueue size has to be a power of two");
+
+  public:
+    bool push(const T& value) {
+        const size_t HEAD = m_iHead.load(std::memory_order_relaxed);
+
+        if (HEAD - m_iTail.load(std::memory_order_acquire) >= N)
+            return false;
+
+        m_data[HEAD & (N - 1)] = value;
+        m_iHead.store(HEAD + 1, std::memory_order_release);
+        return true;
+    }
+
+    std::optional<T> pop() {
+        const size_t TAIL = m_iTail.load(std::memory_order_relaxed);
+
+        if (TAIL == m_iHead.load(std::memory_order_acquire))
+            return std::nullopt;
+
+        T value = m_data[TAIL & (N - 1)];
+        m_iTail.store(TAIL + 1, std::memory_order_release);
+        return value;
+    }
+
+    bool empty() const {
+        return m_iTail.load(std::memory_order_acquire) == m_iHead.load(std::memory_order_acquire);
+    }
+
+  private:
+    std::array<T, N> m_data = {};
+
+    // keep producer and consumer indices on separate cache lines
+    alignas(64) std::atomic<size_t> m_iHead = 0;
+    alignas(64) std::atomic<size_t> m_iTail = 0;
+};
@@ -0,0 +1,107 @@
+#include "SyncTimeline.hpp"
+#include "Log.hpp"
+
+#include <xf86drm.h>
+#include <linux/dma-buf.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+CSyncTimeline::CSyncTimeline(int drmFD) : m_iDrmFD(drmFD) {
+    if (drmSyncobjCreate(m_iDrmFD, 0, &m_iHandle)) {
+        Debug::log(ERR, "[sync] drmSyncobjCreate failed: {}", strerror(errno));
+        m_iHandle = 0;
+        return;
+    }
+
+    if (drmSyncobjHandleToFD(m_iDrmFD, m_iHandle, &m_iFD)) {
+        Debug::log(ERR, "[sync] drmSyncobjHandleToFD failed: {}", strerror(errno));
+        m_iFD = -1;
+    }
+}
+
+CSyncTimeline::~CSyncTimeline() {
+    if (m_iFD >= 0)
+        close(m_iFD);
+
+    if (m_iHandle)
+        drmSyncobjDestroy(m_iDrmFD, m_iHandle);
+}
+
+bool CSyncTimeline::supported(int drmFD) {
+    uint64_t cap = 0;
+    return drmFD >= 0 && drmGetCap(drmFD, DRM_CAP_SYNCOBJ_TIMELINE, &cap) == 0 && cap;
+}
+
+bool CSyncTimeline::good() const {
+    return m_iHandle != 0 && m_iFD >= 0;
+}
+
+int CSyncTimeline::fd() const {
+    return m_iFD;
+}
+
+bool CSyncTimeline::importImplicit(int dmabufFD, uint64_t point) {
+    dma_buf_export_sync_file request = {.flags = DMA_BUF_SYNC_READ, .fd = -1};
+    if (drmIoctl(dmabufFD, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &request)) {
+        Debug::log(TRACE, "[sync] DMA_BUF_IOCTL_EXPORT_SYNC_FILE failed: {}", strerror(errno));
+        return false;
+    }
+
+    // sync files only go into binary syncobjs, the fence is moved to the timeline from there
+    uint32_t tmp = 0;
+    if (drmSyncobjCreate(m_iDrmFD, 0, &tmp)) {
+        close(request.fd);
+        return false;
+    }
+
+    const bool OK = drmSyncobjImportSyncFile(m_iDrmFD, tmp, request.fd) == 0 && drmSyncobjTransfer(m_iDrmFD, m_iHandle, point, tmp, 0, 0) == 0;
+
+    if (!OK)
+        Debug::log(TRACE, "[sync] importing the implicit fence to point {} failed: {}", point, strerror(errno));
+
+    close(request.fd);
+    drmSyncobjDestroy(m_iDrmFD, tmp);
+    return OK;
+}
+
+bool CSyncTimeline::available(uint64_t point) {
+    // a timeout of 0 only polls
+    return drmSyncobjTimelineWait(m_iDrmFD, &m_iHandle, &point, 1, 0, DRM_SYNCOBJ_WAIT_FLAGS_WAIT_AVAILABLE, nullptr) == 0;
+}
+
+bool CSyncTimeline::exportImplicit(int dmabufFD, uint64_t point) {
+    // the consumer may not have submitted its work yet
+    if (!available(point)) {
+        Debug::log(TRACE, "[sync] point {} has no fence yet", point);
+        return false;
+    }
+
+    uint32_t tmp = 0;
+    if (drmSyncobjCreate(m_iDrmFD, 0, &tmp))
+        return false;
+
+    int  syncFD = -1;
+    bool ok     = drmSyncobjTransfer(m_iDrmFD, tmp, 0, m_iHandle, point, 0) == 0 && drmSyncobjExportSyncFile(m_iDrmFD, tmp, &syncFD) == 0;
+
+    drmSyncobjDestroy(m_iDrmFD, tmp);
+
+    if (ok) {
+        // as a write fence, so both readers and writers of the dmabuf wait for the consumer
+        dma_buf_import_sync_file request = {.flags = DMA_BUF_SYNC_WRITE, .fd = syncFD};
+        ok                               = drmIoctl(dmabufFD, DMA_BUF_IOCTL_IMPORT_SYNC_FILE, &request) == 0;
+    }
+
+    if (!ok)
+        Debug::log(TRACE, "[sync] exporting point {} as an implicit fence failed: {}", point, strerror(errno));
+
+    if (syncFD >= 0)
+        close(syncFD);
+
+    return ok;
+}
+
+bool CSyncTimeline::signal(uint64_t point) {
+    return drmSyncobjTimelineSignal(m_iDrmFD, &m_iHandle, &point, 1) == 0;
+}
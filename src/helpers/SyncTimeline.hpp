@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A timeline shared with pipewire consumers through SPA_META_SyncTimeline. Every frame on a buffer takes the next two points,
+// one the consumer waits on before reading (acquire) and one it signals when done reading (release).
+class ISyncTimeline {
+  public:
+    virtual ~ISyncTimeline() = default;
+
+    virtual bool good() const = 0;
+
+    // the syncobj as an fd, for handing out to consumers. Valid as long as the timeline.
+    virtual int  fd() const = 0;
+
+    // attaches the dmabuf's pending write fences to point, so it signals once the compositor is done writing
+    virtual bool importImplicit(int dmabufFD, uint64_t point) = 0;
+
+    // whether point has a fence yet, i.e. the consumer submitted whatever signals it. Doesn't wait.
+    virtual bool available(uint64_t point) = 0;
+
+    // makes the next implicitly synced write to the dmabuf wait for point. Fails without waiting if point has no fence yet.
+    virtual bool exportImplicit(int dmabufFD, uint64_t point) = 0;
+
+    // signals point from the cpu
+    virtual bool signal(uint64_t point) = 0;
+
+    struct SPoints {
+        uint64_t acquire = 0, release = 0;
+    };
+
+    // the points of the next frame after the one released at lastRelease, 0 for the first frame. The compositor's
+    // write becomes the acquire point, or it's signalled right away if nothing is pending on the buffer.
+    SPoints nextFrame(int dmabufFD, uint64_t lastRelease) {
+        const SPoints POINTS = {lastRelease + 1, lastRelease + 2};
+
+        if (!importImplicit(dmabufFD, POINTS.acquire))
+            signal(POINTS.acquire);
+
+        return POINTS;
+    }
+
+    // whether the next write into the dmabuf can go ahead after the frame released at lastRelease, 0 for none. Makes the
+    // write wait for the release point if so. Never true while the consumer hasn't submitted whatever signals it.
+    bool claimForWrite(int dmabufFD, uint64_t lastRelease) {
+        return lastRelease == 0 || exportImplicit(dmabufFD, lastRelease);
+    }
+};
+
+// Buffers pipewire handed back before their release point could be waited on. They stay here until it can, a consumer that
+// never submits its release keeps the buffer. T needs a timeline, its last release point as timelinePoint and its dmabuf as fd[0].
+template <typename T>
+class CReleasePending {
+  public:
+    // whether pBuffer can be written into now, it's set aside otherwise
+    bool admit(T* pBuffer) {
+        if (ready(pBuffer))
+            return true;
+
+        m_vBuffers.push_back(pBuffer);
+        return false;
+    }
+
+    // the oldest buffer set aside that can be written into now, nullptr if none
+    T* take() {
+        for (auto it = m_vBuffers.begin(); it != m_vBuffers.end(); ++it) {
+            if (!ready(*it))
+                continue;
+
+            const auto PBUFFER = *it;
+            m_vBuffers.erase(it);
+            return PBUFFER;
+        }
+
+        return nullptr;
+    }
+
+    void clear() {
+        m_vBuffers.clear();
+    }
+
+    size_t size() const {
+        return m_vBuffers.size();
+    }
+
+  private:
+    static bool ready(T* pBuffer) {
+        return !pBuffer->timeline || pBuffer->timeline->claimForWrite(pBuffer->fd[0], pBuffer->timelinePoint);
+    }
+
+    std::vector<T*> m_vBuffers;
+};
+
+// A drm timeline syncobj.
+// None of the capture protocols take a syncobj, so the compositor side is bridged through the dmabuf's implicit fences.
+class CSyncTimeline : public ISyncTimeline {
+  public:
+    CSyncTimeline(int drmFD);
+    virtual ~CSyncTimeline();
+
+    // whether drmFD can do timeline syncobjs at all
+    static bool  supported(int drmFD);
+
+    virtual bool good() const;
+    virtual int  fd() const;
+    virtual bool importImplicit(int dmabufFD, uint64_t point);
+    virtual bool available(uint64_t point);
+    virtual bool exportImplicit(int dmabufFD, uint64_t point);
+    virtual bool signal(uint64_t point);
+
+  private:
+    int      m_iDrmFD  = -1;
+    uint32_t m_iHandle = 0;
+    int      m_iFD     = -1;
+};
@@ -0,0 +1,128 @@
+#include "TileDamage.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+// in pixels, a tile is TILE x TILE
+constexpr static uint32_t TILE   = 64;
+
+constexpr static uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+constexpr static uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+
+// an xxh64 round
+static inline uint64_t round64(uint64_t acc, uint64_t word) {
+    return std::rotl(acc + word * PRIME2, 31) * PRIME1;
+}
+
+// Four independent lanes over 32 bytes at a time, so the rounds of a row don't wait on each other. Not xxh64 itself,
+// it only has to tell two versions of the same tile apart.
+static uint64_t hashTile(const uint8_t* data, uint32_t rowBytes, uint32_t rows, uint32_t stride) {
+    uint64_t lanes[4] = {PRIME1 + PRIME2, PRIME2, 0, (uint64_t)0 - PRIME1};
+
+    for (uint32_t y = 0; y < rows; ++y) {
+        const uint8_t* row = data + (size_t)y * stride;
+        uint32_t       i   = 0;
+
+        for (; i + 32 <= rowBytes; i += 32) {
+            uint64_t words[4];
+            memcpy(words, row + i, sizeof(words));
+            for (int l = 0; l < 4; ++l) {
+                lanes[l] = round64(lanes[l], words[l]);
+            }
+        }
+
+        // the rest of the row, zero padded
+        if (i < rowBytes) {
+            uint64_t words[4] = {};
+            memcpy(words, row + i, rowBytes - i);
+            for (int l = 0; l < 4; ++l) {
+                lanes[l] = round64(lanes[l], words[l]);
+            }
+        }
+    }
+
+    uint64_t hash = std::rotl(lanes[0], 1) + std::rotl(lanes[1], 7) + std::rotl(lanes[2], 12) + std::rotl(lanes[3], 18);
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+bool CTileDamage::update(const uint8_t* data, uint32_t w, uint32_t h, uint32_t stride, uint32_t bpp, std::vector<SRect>& damage, size_t maxRects) {
+    const uint32_t TILESX = (w + TILE - 1) / TILE;
+    const uint32_t TILESY = (h + TILE - 1) / TILE;
+    const bool     FULL   = w != m_iW || h != m_iH || stride != m_iStride || bpp != m_iBpp || m_vHashes.size() != (size_t)TILESX * TILESY;
+
+    if (FULL) {
+        m_vHashes.assign((size_t)TILESX * TILESY, 0);
+        m_iW      = w;
+        m_iH      = h;
+        m_iStride = stride;
+        m_iBpp    = bpp;
+    }
+
+    damage.clear();
+
+    for (uint32_t ty = 0; ty < TILESY; ++ty) {
+        const uint32_t Y    = ty * TILE;
+        const uint32_t ROWS = std::min(TILE, h - Y);
+
+        for (uint32_t tx = 0; tx < TILESX; ++tx) {
+            const uint32_t X    = tx * TILE;
+            const uint32_t COLS = std::min(TILE, w - X);
+            const uint64_t HASH = hashTile(data + (size_t)Y * stride + (size_t)X * bpp, COLS * bpp, ROWS, stride);
+            auto&          last = m_vHashes[(size_t)ty * TILESX + tx];
+
+            if (!FULL && HASH == last)
+                continue;
+
+            last = HASH;
+
+            // extend the run of the tile on the left
+            if (!damage.empty() && damage.back().y == Y && damage.back().h == ROWS && damage.back().x + damage.back().w == X) {
+                damage.back().w += COLS;
+                continue;
+            }
+
+            damage.push_back({X, Y, COLS, ROWS});
+        }
+
+        // then merge this row's runs into the ones right above them
+        for (auto it = damage.begin(); it != damage.end();) {
+            if (it->y != Y) {
+                ++it;
+                continue;
+            }
+
+            const auto ABOVE = std::find_if(damage.begin(), damage.end(), [&](const SRect& r) { return r.y + r.h == Y && r.x == it->x && r.w == it->w; });
+            if (ABOVE == damage.end()) {
+                ++it;
+                continue;
+            }
+
+            ABOVE->h += it->h;
+            it = damage.erase(it);
+        }
+    }
+
+    if (damage.size() > maxRects) {
+        SRect box = damage.front();
+        for (const auto& r : damage) {
+            const uint32_t X2 = std::max(box.x + box.w, r.x + r.w);
+            const uint32_t Y2 = std::max(box.y + box.h, r.y + r.h);
+            box.x             = std::min(box.x, r.x);
+            box.y             = std::min(box.y, r.y);
+            box.w             = X2 - box.x;
+            box.h             = Y2 - box.y;
+        }
+        damage = {box};
+    }
+
+    return !damage.empty();
+}
+
+void CTileDamage::reset() {
+    m_vHashes.clear();
+    m_iW = m_iH = m_iStride = m_iBpp = 0;
+}
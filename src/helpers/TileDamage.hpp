@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Finds what changed between two frames by hashing them in tiles, for capture sources that don't report damage.
+class CTileDamage {
+  public:
+    struct SRect {
+        uint32_t x = 0, y = 0, w = 0, h = 0;
+    };
+
+    // hashes the frame and diffs it against the last one. False if nothing changed. The first frame, and one of a different
+    // layout, is fully damaged. Beyond maxRects, damage is merged into its bounding box.
+    bool update(const uint8_t* data, uint32_t w, uint32_t h, uint32_t stride, uint32_t bpp, std::vector<SRect>& damage, size_t maxRects);
+
+    // forget the last frame, the next one is fully damaged
+    void reset();
+
+  private:
+    std::vector<uint64_t> m_vHashes;
+    uint32_t              m_iW = 0, m_iH = 0, m_iStride = 0, m_iBpp = 0;
+};
@@ -2,13 +2,63 @@
 #include "../core/PortalManager.hpp"
 #include "../helpers/Log.hpp"
 #include "../helpers/MiscFunctions.hpp"
+#include "../shared/CaptureBackend.hpp"
+#include "../shared/CaptureScheduler.hpp"
+#include "../shared/Formats.hpp"
+#ifdef XDPH_ENCODER
+#include "../shared/VideoEncoder.hpp"
+#endif
 
 #include <libdrm/drm_fourcc.h>
 #include <pipewire/pipewire.h>
 #include "linux-dmabuf-v1.hpp"
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+
+constexpr static float    START_TIMEOUT_MS        = 5000;
+constexpr static uint32_t MAX_CURSOR_SIZE         = 256;
+constexpr static float    RENEG_DEBOUNCE_MS       = 50;
+constexpr static float    RENEG_MAX_DELAY_MS      = 250;
+constexpr static double   RATE_DIFF_WEIGHT        = 0.05;
+constexpr static uint32_t MAX_ADAPTIVE_BUFFERS    = 8;
+constexpr static uint32_t BUFFERS_IN_FLIGHT       = 1; // captured into while the others are out, see sizeBufferPool
+constexpr static int64_t  BUFFER_RESIZE_MIN_MS    = 2000;
+constexpr static int64_t  BUFFER_SHRINK_WINDOW_MS = 10000;
+constexpr static float    PAUSED_TRIM_MS          = 3000;
+
+// SPA_META_Cursor with room for a w x h bitmap
+constexpr static uint32_t cursorMetaSize(uint32_t w, uint32_t h) {
+    return sizeof(spa_meta_cursor) + sizeof(spa_meta_bitmap) + w * h * 4;
+}
+
+static bool latestFrameOnly() {
+    static auto* const* PLATEST = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:latest_frame_only")->getDataStaticPtr();
+
+    return **PLATEST;
+}
+
+static bool shareRegionCaptures() {
+    static auto* const* PSHARE = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:share_region_captures")->getDataStaticPtr();
+
+    return **PSHARE;
+}
+
+static bool forceModLinear() {
+    static auto* const* PFORCELINEAR = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:force_mod_linear")->getDataStaticPtr();
 
-constexpr static int MAX_RETRIES = 10;
+    return **PFORCELINEAR;
+}
+
+static bool explicitSyncAvailable(CPipewireConnection::SPWStream* pStream) {
+    static auto* const* PEXPLICITSYNC = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:explicit_sync")->getDataStaticPtr();
+
+    return **PEXPLICITSYNC && pStream->device && pStream->device->gbm && CSyncTimeline::supported(gbm_device_get_fd(pStream->device->gbm));
+}
 
 //
 static sdbus::Struct<std::string, uint32_t, sdbus::Variant> getFullRestoreStruct(const SSelectionData& data, uint32_t cursor) {
@@ -45,12 +95,26 @@ dbUasv CScreencopyPortal::onCreateSession(sdbus::ObjectPath requestHandle, sdbus
     PSESSION->self                                           = PSESSION;
 
     // create objects
+    PSESSION->eventQueue = wl_display_create_queue(g_pPortalManager->m_sWaylandConnection.display);
+    if (!PSESSION->eventQueue)
+        Debug::log(WARN, "[screencopy] Couldn't create an event queue for the session, frames will go through the default one");
+
     PSESSION->session            = createDBusSession(sessionHandle);
     PSESSION->session->onDestroy = [PSESSION, this]() {
+        // replies to a pending Start, if any
+        finishStart(PSESSION.get(), false);
+
         if (PSESSION->sharingData.active) {
             m_pPipewire->destroyStream(PSESSION.get());
             Debug::log(LOG, "[screencopy] Stream destroyed");
         }
+
+        PSESSION->backend.reset();
+        if (PSESSION->eventQueue) {
+            wl_event_queue_destroy(PSESSION->eventQueue);
+            PSESSION->eventQueue = nullptr;
+        }
+
         PSESSION->session.release();
         Debug::log(LOG, "[screencopy] Session destroyed");
 
@@ -63,8 +127,8 @@ dbUasv CScreencopyPortal::onCreateSession(sdbus::ObjectPath requestHandle, sdbus
     return {0, {}};
 }
 
-dbUasv CScreencopyPortal::onSelectSources(sdbus::ObjectPath requestHandle, sdbus::ObjectPath sessionHandle, std::string appID,
-                                          std::unordered_map<std::string, sdbus::Variant> options) {
+void CScreencopyPortal::onSelectSources(dbUasvResult result, sdbus::ObjectPath requestHandle, sdbus::ObjectPath sessionHandle, std::string appID,
+                                        std::unordered_map<std::string, sdbus::Variant> options) {
     Debug::log(LOG, "[screencopy] SelectSources:");
     Debug::log(LOG, "[screencopy]  | {}", requestHandle.c_str());
     Debug::log(LOG, "[screencopy]  | {}", sessionHandle.c_str());
@@ -74,8 +138,8 @@ dbUasv CScreencopyPortal::onSelectSources(sdbus::ObjectPath requestHandle, sdbus
 
     if (!PSESSION) {
         Debug::log(ERR, "[screencopy] SelectSources: no session found??");
-        throw sdbus::Error{sdbus::Error::Name{"NOSESSION"}, "No session found"};
-        return {1, {}};
+        result.returnError(sdbus::Error{sdbus::Error::Name{"NOSESSION"}, "No session found"});
+        return;
     }
 
     struct {
@@ -172,25 +236,41 @@ dbUasv CScreencopyPortal::onSelectSources(sdbus::ObjectPath requestHandle, sdbus
     );
     // clang-format on
 
-    SSelectionData SHAREDATA;
     if (RESTOREDATAVALID) {
         Debug::log(LOG, "[screencopy] restore data valid, not prompting");
 
         const bool WINDOW      = !restoreData.windowClass.empty();
         const auto HANDLEMATCH = WINDOW && restoreData.windowHandle != 0 ? g_pPortalManager->m_sHelpers.toplevel->handleFromHandleFull(restoreData.windowHandle) : nullptr;
 
+        SSelectionData SHAREDATA;
         SHAREDATA.output       = restoreData.output;
         SHAREDATA.type         = WINDOW ? TYPE_WINDOW : TYPE_OUTPUT;
         SHAREDATA.windowHandle = WINDOW ? (HANDLEMATCH ? HANDLEMATCH->handle : g_pPortalManager->m_sHelpers.toplevel->handleFromClass(restoreData.windowClass)->handle) : nullptr;
         SHAREDATA.windowClass  = restoreData.windowClass;
         SHAREDATA.allowToken   = true; // user allowed token before
         PSESSION->cursorMode   = restoreData.withCursor ? EMBEDDED : HIDDEN;
-    } else {
-        Debug::log(LOG, "[screencopy] restore data invalid / missing, prompting");
 
-        SHAREDATA = promptForScreencopySelection();
+        result.returnResults(applySelection(PSESSION, SHAREDATA), {});
+        return;
     }
 
+    Debug::log(LOG, "[screencopy] restore data invalid / missing, prompting");
+
+    // the picker runs in the background, we reply once it's done. Results are move-only, hence the shared ptr.
+    const auto PRESULT = std::make_shared<dbUasvResult>(std::move(result));
+
+    promptForScreencopySelection([this, PRESULT, PSESSION = PSESSION->self](SSelectionData data) {
+        if (!PSESSION || !PSESSION->session) {
+            Debug::log(LOG, "[screencopy] SelectSources: session gone before the picker returned");
+            PRESULT->returnResults(1, {});
+            return;
+        }
+
+        PRESULT->returnResults(applySelection(PSESSION.get(), data), {});
+    });
+}
+
+uint32_t CScreencopyPortal::applySelection(SSession* pSession, SSelectionData SHAREDATA) {
     Debug::log(LOG, "[screencopy] SHAREDATA returned selection {}", (int)SHAREDATA.type);
 
     if (SHAREDATA.type == TYPE_WINDOW && !m_sState.toplevel) {
@@ -203,19 +283,19 @@ dbUasv CScreencopyPortal::onSelectSources(sdbus::ObjectPath requestHandle, sdbus
             static auto* const* PFPS = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:max_fps")->getDataStaticPtr();
 
             if (**PFPS <= 0)
-                PSESSION->sharingData.framerate = POUTPUT->refreshRate;
+                pSession->sharingData.framerate = POUTPUT->refreshRate;
             else
-                PSESSION->sharingData.framerate = std::clamp(POUTPUT->refreshRate, 1.F, (float)**PFPS);
+                pSession->sharingData.framerate = std::clamp(POUTPUT->refreshRate, 1.F, (float)**PFPS);
         }
     }
 
-    PSESSION->selection = SHAREDATA;
+    pSession->selection = SHAREDATA;
 
-    return {SHAREDATA.type == TYPE_INVALID ? 1 : 0, {}};
+    return SHAREDATA.type == TYPE_INVALID ? 1 : 0;
 }
 
-dbUasv CScreencopyPortal::onStart(sdbus::ObjectPath requestHandle, sdbus::ObjectPath sessionHandle, std::string appID, std::string parentWindow,
-                                  std::unordered_map<std::string, sdbus::Variant> opts) {
+void CScreencopyPortal::onStart(dbUasvResult result, sdbus::ObjectPath requestHandle, sdbus::ObjectPath sessionHandle, std::string appID, std::string parentWindow,
+                                std::unordered_map<std::string, sdbus::Variant> opts) {
     Debug::log(LOG, "[screencopy] Start:");
     Debug::log(LOG, "[screencopy]  | {}", requestHandle.c_str());
     Debug::log(LOG, "[screencopy]  | {}", sessionHandle.c_str());
@@ -226,71 +306,126 @@ dbUasv CScreencopyPortal::onStart(sdbus::ObjectPath requestHandle, sdbus::Object
 
     if (!PSESSION) {
         Debug::log(ERR, "[screencopy] Start: no session found??");
-        throw sdbus::Error{sdbus::Error::Name{"NOSESSION"}, "No session found"};
-        return {1, {}};
+        result.returnError(sdbus::Error{sdbus::Error::Name{"NOSESSION"}, "No session found"});
+        return;
     }
 
-    startSharing(PSESSION);
+    if (PSESSION->startResult) {
+        Debug::log(ERR, "[screencopy] Start: session is already starting");
+        result.returnError(sdbus::Error{sdbus::Error::Name{"ALREADYSTARTING"}, "Session is already starting"});
+        return;
+    }
+
+    // we reply in finishStart, once pipewire gave us a node
+    PSESSION->startResult.emplace(std::move(result));
 
-    std::unordered_map<std::string, sdbus::Variant> options;
+    startSharing(PSESSION);
+}
 
-    if (PSESSION->selection.allowToken) {
-        // give them a token :)
-        options["restore_data"] = sdbus::Variant{getFullRestoreStruct(PSESSION->selection, PSESSION->cursorMode)};
-        options["persist_mode"] = sdbus::Variant{uint32_t{2}};
+void CScreencopyPortal::startSharing(CScreencopyPortal::SSession* pSession) {
+    pSession->sharingData.active      = true;
+    pSession->sharingData.startStatus = START_PROBING;
 
-        Debug::log(LOG, "[screencopy] Sent restore token to {}", PSESSION->sessionHandle.c_str());
+    // the first frame tells us the buffer constraints, the stream gets created once they're done (see continueSharing)
+    if (!pSession->startCopy()) {
+        Debug::log(ERR, "[screencopy] Couldn't request the first frame");
+        finishStart(pSession, false);
+        return;
     }
 
-    uint32_t type = 0;
-    switch (PSESSION->selection.type) {
-        case TYPE_OUTPUT: type = 1 << MONITOR; break;
-        case TYPE_WINDOW: type = 1 << WINDOW; break;
-        case TYPE_GEOMETRY:
-        case TYPE_WORKSPACE: type = 1 << VIRTUAL; break;
-        default: type = 0; break;
+    g_pPortalManager->addTimer({START_TIMEOUT_MS, [self = pSession->self]() {
+                                    if (!self || (self->sharingData.startStatus != START_PROBING && self->sharingData.startStatus != START_CONNECTING))
+                                        return;
+
+                                    Debug::log(ERR, "[screencopy] Starting the stream timed out after {}ms in state {}", START_TIMEOUT_MS, (int)self->sharingData.startStatus);
+                                    g_pPortalManager->m_sPortals.screencopy->finishStart(self.get(), false);
+                                }});
+}
+
+void CScreencopyPortal::continueSharing(CScreencopyPortal::SSession* pSession) {
+    if (pSession->sharingData.startStatus != START_PROBING)
+        return;
+
+    if (pSession->sharingData.frameInfoSHM.size == 0 || pSession->sharingData.frameInfoSHM.fmt == DRM_FORMAT_INVALID) {
+        Debug::log(ERR, "[screencopy] Couldn't obtain a buffer format");
+        finishStart(pSession, false);
+        return;
     }
-    options["source_type"] = sdbus::Variant{type};
 
-    std::vector<sdbus::Struct<uint32_t, std::unordered_map<std::string, sdbus::Variant>>> streams;
+    if (pSession->sharingData.frameInfoDMA.fmt == DRM_FORMAT_INVALID || !g_pPortalManager->m_sWaylandConnection.gbmDevice)
+        Debug::log(LOG, "[screencopy] dmabuf unavailable, sharing through shm only");
 
-    std::unordered_map<std::string, sdbus::Variant>                                       streamData;
-    streamData["position"]    = sdbus::Variant{sdbus::Struct<int32_t, int32_t>{0, 0}};
-    streamData["size"]        = sdbus::Variant{sdbus::Struct<int32_t, int32_t>{PSESSION->sharingData.frameInfoSHM.w, PSESSION->sharingData.frameInfoSHM.h}};
-    streamData["source_type"] = sdbus::Variant{uint32_t{type}};
-    streams.emplace_back(sdbus::Struct<uint32_t, std::unordered_map<std::string, sdbus::Variant>>{PSESSION->sharingData.nodeID, streamData});
+    pSession->sharingData.startStatus = START_CONNECTING;
 
-    options["streams"] = sdbus::Variant{streams};
+    m_pPipewire->createStream(pSession);
 
-    return {0, options};
+    // unlikely, but pipewire might've been quick enough
+    if (pSession->sharingData.nodeID != SPA_ID_INVALID)
+        finishStart(pSession, true);
 }
 
-void CScreencopyPortal::startSharing(CScreencopyPortal::SSession* pSession) {
-    pSession->sharingData.active = true;
+void CScreencopyPortal::finishStart(CScreencopyPortal::SSession* pSession, bool success) {
+    if (pSession->sharingData.startStatus != START_PROBING && pSession->sharingData.startStatus != START_CONNECTING)
+        return;
 
-    startFrameCopy(pSession);
+    if (!success) {
+        pSession->sharingData.startStatus = START_FAILED;
 
-    wl_display_dispatch(g_pPortalManager->m_sWaylandConnection.display);
-    wl_display_roundtrip(g_pPortalManager->m_sWaylandConnection.display);
+        m_pPipewire->removeSessionFrameCallbacks(pSession);
+        if (m_pPipewire->streamFromSession(pSession))
+            m_pPipewire->destroyStream(pSession);
+        pSession->sharingData.active = false;
+
+        if (pSession->startResult) {
+            pSession->startResult->returnResults(1, {});
+            pSession->startResult.reset();
+        }
 
-    if (pSession->sharingData.frameInfoDMA.fmt == DRM_FORMAT_INVALID) {
-        Debug::log(ERR, "[screencopy] Couldn't obtain a format from dma"); // todo: blocks shm
         return;
     }
 
-    m_pPipewire->createStream(pSession);
+    pSession->sharingData.startStatus = START_DONE;
 
-    while (pSession->sharingData.nodeID == SPA_ID_INVALID) {
-        int ret = pw_loop_iterate(g_pPortalManager->m_sPipewire.loop, 0);
-        if (ret < 0) {
-            Debug::log(ERR, "[pipewire] pw_loop_iterate failed with {}", spa_strerror(ret));
-            return;
+    Debug::log(LOG, "[screencopy] Sharing initialized");
+
+    armStatsTimer();
+
+    if (pSession->startResult) {
+        std::unordered_map<std::string, sdbus::Variant> options;
+
+        if (pSession->selection.allowToken) {
+            // give them a token :)
+            options["restore_data"] = sdbus::Variant{getFullRestoreStruct(pSession->selection, pSession->cursorMode)};
+            options["persist_mode"] = sdbus::Variant{uint32_t{2}};
+
+            Debug::log(LOG, "[screencopy] Sent restore token to {}", pSession->sessionHandle.c_str());
         }
-    }
 
-    Debug::log(LOG, "[screencopy] Sharing initialized");
+        uint32_t type = 0;
+        switch (pSession->selection.type) {
+            case TYPE_OUTPUT: type = 1 << MONITOR; break;
+            case TYPE_WINDOW: type = 1 << WINDOW; break;
+            case TYPE_GEOMETRY:
+            case TYPE_WORKSPACE: type = 1 << VIRTUAL; break;
+            default: type = 0; break;
+        }
+        options["source_type"] = sdbus::Variant{type};
+
+        std::vector<sdbus::Struct<uint32_t, std::unordered_map<std::string, sdbus::Variant>>> streams;
+
+        std::unordered_map<std::string, sdbus::Variant>                                       streamData;
+        streamData["position"]    = sdbus::Variant{sdbus::Struct<int32_t, int32_t>{0, 0}};
+        streamData["size"]        = sdbus::Variant{sdbus::Struct<int32_t, int32_t>{pSession->sharingData.frameInfoSHM.w, pSession->sharingData.frameInfoSHM.h}};
+        streamData["source_type"] = sdbus::Variant{uint32_t{type}};
+        streams.emplace_back(sdbus::Struct<uint32_t, std::unordered_map<std::string, sdbus::Variant>>{pSession->sharingData.nodeID, streamData});
 
-    g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(pSession);
+        options["streams"] = sdbus::Variant{streams};
+
+        pSession->startResult->returnResults(0, options);
+        pSession->startResult.reset();
+    }
+
+    queueNextShareFrame(pSession);
 
     Debug::log(TRACE, "[sc] queued frame in {}ms", 1000.0 / pSession->sharingData.framerate);
 }
@@ -301,290 +436,285 @@ void CScreencopyPortal::startFrameCopy(CScreencopyPortal::SSession* pSession) {
     Debug::log(TRACE, "[screencopy] frame callbacks initialized");
 }
 
-void CScreencopyPortal::SSession::startCopy() {
-    const auto     POUTPUT       = g_pPortalManager->getOutputFromName(selection.output);
-    const uint32_t OVERLAYCURSOR = cursorMode == EMBEDDED ? 1 : 0;
-
+bool CScreencopyPortal::SSession::startCopy() {
     if (!sharingData.active) {
         Debug::log(TRACE, "[sc] startFrameCopy: not copying, inactive session");
-        return;
+        return false;
     }
 
-    if (!POUTPUT && (selection.type == TYPE_GEOMETRY || selection.type == TYPE_OUTPUT)) {
-        Debug::log(ERR, "[screencopy] Output {} not found??", selection.output);
-        return;
+    if (!backend)
+        backend = g_pPortalManager->m_sPortals.screencopy->createBackend(this);
+
+    if (!backend) {
+        Debug::log(ERR, "[screencopy] No capture backend for selection {}", (int)selection.type);
+        return false;
+    }
+
+    // paused by the consumer. Resuming starts capturing again.
+    const auto PPAUSEDSTREAM = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(this);
+    if (PPAUSEDSTREAM && PPAUSEDSTREAM->paused.active) {
+        Debug::log(TRACE, "[sc] startFrameCopy: not copying, stream paused");
+        return false;
     }
 
-    if ((sharingData.frameCallback && (selection.type == TYPE_GEOMETRY || selection.type == TYPE_OUTPUT)) || (sharingData.windowFrameCallback && selection.type == TYPE_WINDOW)) {
+    if (backend->framePending()) {
         Debug::log(ERR, "[screencopy] tried scheduling on already scheduled cb (type {})", (int)selection.type);
-        return;
+        return false;
     }
 
-    if (selection.type == TYPE_GEOMETRY) {
-        sharingData.frameCallback = makeShared<CCZwlrScreencopyFrameV1>(g_pPortalManager->m_sPortals.screencopy->m_sState.screencopy->sendCaptureOutputRegion(
-            OVERLAYCURSOR, POUTPUT->output->resource(), selection.x, selection.y, selection.w, selection.h));
-        sharingData.transform     = POUTPUT->transform;
-    } else if (selection.type == TYPE_OUTPUT) {
-        sharingData.frameCallback =
-            makeShared<CCZwlrScreencopyFrameV1>(g_pPortalManager->m_sPortals.screencopy->m_sState.screencopy->sendCaptureOutput(OVERLAYCURSOR, POUTPUT->output->resource()));
-        sharingData.transform = POUTPUT->transform;
-    } else if (selection.type == TYPE_WINDOW) {
-        if (!selection.windowHandle) {
-            Debug::log(ERR, "[screencopy] selected invalid window?");
-            return;
+    // with latest_frame_only, only capture with a buffer in hand. Otherwise we'd find out there's none after the capture.
+    if (latestFrameOnly()) {
+        const auto    PPORTAL = g_pPortalManager->m_sPortals.screencopy.get();
+        const auto    PSTREAM = PPORTAL->m_pPipewire->streamFromSession(this);
+
+        CPipewireLock lock;
+
+        if (PSTREAM && !PSTREAM->currentPWBuffer)
+            PPORTAL->m_pPipewire->dequeue(this);
+
+        if (PSTREAM && !PSTREAM->currentPWBuffer) {
+            Debug::log(TRACE, "[sc] no free buffer, not capturing");
+            stats.onFrameDropped();
+            PPORTAL->queueNextShareFrame(this);
+            return false;
         }
-        sharingData.windowFrameCallback = makeShared<CCHyprlandToplevelExportFrameV1>(
-            g_pPortalManager->m_sPortals.screencopy->m_sState.toplevel->sendCaptureToplevelWithWlrToplevelHandle(OVERLAYCURSOR, selection.windowHandle->resource()));
-        sharingData.transform = WL_OUTPUT_TRANSFORM_NORMAL;
-    } else {
-        Debug::log(ERR, "[screencopy] Unsupported selection {}", (int)selection.type);
+    }
+
+    sharingData.damageCount = 0;
+    sharingData.status      = FRAME_QUEUED;
+    stats.onCaptureRequested();
+
+    if (!backend->startFrame()) {
+        sharingData.status = FRAME_NONE;
+        return false;
+    }
+
+    return true;
+}
+
+CScreencopyPortal::SSession::~SSession() {
+    // null while the portal itself goes away
+    if (const auto PSCREENCOPY = g_pPortalManager->m_sPortals.screencopy.get(); PSCREENCOPY && PSCREENCOPY->m_pScheduler)
+        PSCREENCOPY->m_pScheduler->remove(this);
+
+    backend.reset();
+
+    if (eventQueue)
+        wl_event_queue_destroy(eventQueue);
+}
+
+void CScreencopyPortal::SSession::addDamage(uint32_t x, uint32_t y, uint32_t w, uint32_t h) {
+    if (sharingData.damageCount > 3) {
+        sharingData.damage[0]   = {0, 0, sharingData.frameInfoSHM.w, sharingData.frameInfoSHM.h};
+        sharingData.damageCount = 1;
         return;
     }
 
-    sharingData.status = FRAME_QUEUED;
+    sharingData.damage[sharingData.damageCount++] = {x, y, w, h};
 
-    initCallbacks();
+    Debug::log(TRACE, "[sc] damage: {} {} {} {}", x, y, w, h);
 }
 
-void CScreencopyPortal::SSession::initCallbacks() {
-    if (sharingData.frameCallback) {
-        sharingData.frameCallback->setBuffer([this, self = self](CCZwlrScreencopyFrameV1* r, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
-            Debug::log(TRACE, "[sc] wlrOnBuffer for {}", (void*)self.get());
-            if (!self)
-                return;
+void CScreencopyPortal::SSession::onBufferDone() {
+    const auto PPORTAL = g_pPortalManager->m_sPortals.screencopy.get();
+    const auto PSTREAM = PPORTAL->m_pPipewire->streamFromSession(this);
 
-            sharingData.frameInfoSHM.w      = width;
-            sharingData.frameInfoSHM.h      = height;
-            sharingData.frameInfoSHM.fmt    = drmFourccFromSHM((wl_shm_format)format);
-            sharingData.frameInfoSHM.size   = stride * height;
-            sharingData.frameInfoSHM.stride = stride;
+    if (!PSTREAM) {
+        Debug::log(TRACE, "[sc] onBufferDone: no stream");
+        sharingData.status = FRAME_NONE;
+        backend->dropFrame();
+        PPORTAL->continueSharing(this);
+        return;
+    }
 
-            // todo: done if ver < 3
-        });
-        sharingData.frameCallback->setReady([this, self = self](CCZwlrScreencopyFrameV1* r, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
-            Debug::log(TRACE, "[sc] wlrOnReady for {}", (void*)self.get());
-            if (!self)
-                return;
+    // the format and the buffers change on the pipewire thread
+    CPipewireLock lock;
 
-            sharingData.status = FRAME_READY;
+    Debug::log(TRACE, "[sc] pw format {} size {}x{}", (int)PSTREAM->pwVideoInfo.format, PSTREAM->pwVideoInfo.size.width, PSTREAM->pwVideoInfo.size.height);
+    Debug::log(TRACE, "[sc] capture format {} size {}x{}", (int)sharingData.frameInfoSHM.fmt, sharingData.frameInfoSHM.w, sharingData.frameInfoSHM.h);
+    Debug::log(TRACE, "[sc] capture format dma {} size {}x{}", (int)sharingData.frameInfoDMA.fmt, sharingData.frameInfoDMA.w, sharingData.frameInfoDMA.h);
 
-            sharingData.tvSec         = ((((uint64_t)tv_sec_hi) << 32) + (uint64_t)tv_sec_lo);
-            sharingData.tvNsec        = tv_nsec;
-            sharingData.tvTimestampNs = sharingData.tvSec * SPA_NSEC_PER_SEC + sharingData.tvNsec;
+    const auto FMT = PSTREAM->isDMA ? sharingData.frameInfoDMA.fmt : sharingData.frameInfoSHM.fmt;
+    const auto W   = PSTREAM->isDMA ? sharingData.frameInfoDMA.w : sharingData.frameInfoSHM.w;
+    const auto H   = PSTREAM->isDMA ? sharingData.frameInfoDMA.h : sharingData.frameInfoSHM.h;
 
-            Debug::log(TRACE, "[sc] frame timestamp sec: {} nsec: {} combined: {}ns", sharingData.tvSec, sharingData.tvNsec, sharingData.tvTimestampNs);
+    // nothing pipewire can carry. Keep the stream as it is, the compositor may switch back to something we know.
+    if (pwFromDrmFourcc(FMT) == SPA_VIDEO_FORMAT_UNKNOWN) {
+        Debug::log(TRACE, "[sc] onBufferDone: unknown format {}, dropping the frame", FMT);
+        sharingData.status = FRAME_NONE;
+        backend->dropFrame();
+        stats.onFrameDropped();
+        PPORTAL->queueNextShareFrame(this);
+        return;
+    }
 
-            g_pPortalManager->m_sPortals.screencopy->m_pPipewire->enqueue(this);
+    // with headroom, anything that fits is cropped out of the buffer
+    const bool SIZEOK = PSTREAM->isDMA && PSTREAM->headroom ? W <= PSTREAM->pwVideoInfo.size.width && H <= PSTREAM->pwVideoInfo.size.height :
+                                                              PSTREAM->pwVideoInfo.size.width == W && PSTREAM->pwVideoInfo.size.height == H;
+    if ((PSTREAM->pwVideoInfo.format != pwFromDrmFourcc(FMT) && PSTREAM->pwVideoInfo.format != pwStripAlpha(pwFromDrmFourcc(FMT))) || !SIZEOK) {
+        Debug::log(TRACE, "[sc] Incompatible formats, renegotiate stream");
+        sharingData.status = FRAME_RENEG;
+        PPORTAL->m_pPipewire->scheduleParamUpdate(PSTREAM, FMT, W, H);
+        PPORTAL->queueNextShareFrame(this);
+        sharingData.status = FRAME_NONE;
+        backend->dropFrame();
+        return;
+    }
 
-            if (g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(this))
-                g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(this);
+    // whatever changed changed back, the buffers we have are fine
+    PPORTAL->m_pPipewire->cancelParamUpdate(PSTREAM);
 
-            sharingData.frameCallback.reset();
-        });
-        sharingData.frameCallback->setFailed([this, self = self](CCZwlrScreencopyFrameV1* r) {
-            Debug::log(TRACE, "[sc] wlrOnFailed for {}", (void*)self.get());
-            if (!self)
-                return;
-            sharingData.status = FRAME_FAILED;
-        });
-        sharingData.frameCallback->setDamage([this, self = self](CCZwlrScreencopyFrameV1* r, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
-            Debug::log(TRACE, "[sc] wlrOnDamage for {}", (void*)self.get());
-            if (!self)
-                return;
-
-            if (sharingData.damageCount > 3) {
-                sharingData.damage[0] = {0, 0, sharingData.frameInfoDMA.w, sharingData.frameInfoDMA.h};
-                return;
-            }
+    if (!PSTREAM->currentPWBuffer) {
+        Debug::log(TRACE, "[sc] onBufferDone: dequeue, no current buffer");
+        PPORTAL->m_pPipewire->dequeue(this);
+    }
 
-            sharingData.damage[sharingData.damageCount++] = {x, y, width, height};
+    if (!PSTREAM->currentPWBuffer) {
+        // the consumer holds on to all of them. New params wouldn't help, so wait for it to give some back.
+        if (sharingData.copyRetries++ == 0)
+            Debug::log(LOG, "[screencopy/pipewire] Out of buffers, skipping frames");
+        else
+            Debug::log(TRACE, "[screencopy/pipewire] Out of buffers, skipped {} frames", sharingData.copyRetries);
+
+        sharingData.status = FRAME_NONE;
+        stats.onFrameDropped();
+        PPORTAL->queueNextShareFrame(this);
+        backend->dropFrame();
+        return;
+    }
 
-            Debug::log(TRACE, "[sc] wlr damage: {} {} {} {}", x, y, width, height);
-        });
-        sharingData.frameCallback->setLinuxDmabuf([this, self = self](CCZwlrScreencopyFrameV1* r, uint32_t format, uint32_t width, uint32_t height) {
-            Debug::log(TRACE, "[sc] wlrOnDmabuf for {}", (void*)self.get());
-            if (!self)
-                return;
-
-            sharingData.frameInfoDMA.w   = width;
-            sharingData.frameInfoDMA.h   = height;
-            sharingData.frameInfoDMA.fmt = format;
-        });
-        sharingData.frameCallback->setBufferDone([this, self = self](CCZwlrScreencopyFrameV1* r) {
-            Debug::log(TRACE, "[sc] wlrOnBufferDone for {}", (void*)self.get());
-            if (!self)
-                return;
-
-            const auto PSTREAM = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(this);
-
-            if (!PSTREAM) {
-                Debug::log(TRACE, "[sc] wlrOnBufferDone: no stream");
-                sharingData.status = FRAME_NONE;
-                sharingData.frameCallback.reset();
-                return;
-            }
+    const auto TARGET = PPORTAL->m_pPipewire->captureTarget(PSTREAM->currentPWBuffer, W, H);
+    if (!TARGET) {
+        sharingData.status = FRAME_NONE;
+        stats.onFrameDropped();
+        PPORTAL->queueNextShareFrame(this);
+        backend->dropFrame();
+        return;
+    }
 
-            Debug::log(TRACE, "[sc] pw format {} size {}x{}", (int)PSTREAM->pwVideoInfo.format, PSTREAM->pwVideoInfo.size.width, PSTREAM->pwVideoInfo.size.height);
-            Debug::log(TRACE, "[sc] wlr format {} size {}x{}", (int)sharingData.frameInfoSHM.fmt, sharingData.frameInfoSHM.w, sharingData.frameInfoSHM.h);
-            Debug::log(TRACE, "[sc] wlr format dma {} size {}x{}", (int)sharingData.frameInfoDMA.fmt, sharingData.frameInfoDMA.w, sharingData.frameInfoDMA.h);
-
-            const auto FMT = PSTREAM->isDMA ? sharingData.frameInfoDMA.fmt : sharingData.frameInfoSHM.fmt;
-            if ((PSTREAM->pwVideoInfo.format != pwFromDrmFourcc(FMT) && PSTREAM->pwVideoInfo.format != pwStripAlpha(pwFromDrmFourcc(FMT))) ||
-                (PSTREAM->pwVideoInfo.size.width != sharingData.frameInfoDMA.w || PSTREAM->pwVideoInfo.size.height != sharingData.frameInfoDMA.h)) {
-                Debug::log(LOG, "[sc] Incompatible formats, renegotiate stream");
-                sharingData.status = FRAME_RENEG;
-                g_pPortalManager->m_sPortals.screencopy->m_pPipewire->updateStreamParam(PSTREAM);
-                g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(this);
-                sharingData.status = FRAME_NONE;
-                sharingData.frameCallback.reset();
-                return;
-            }
+    backend->copyTo(PSTREAM->currentPWBuffer, TARGET);
+    sharingData.copyRetries = 0;
 
-            if (!PSTREAM->currentPWBuffer) {
-                Debug::log(TRACE, "[sc] wlrOnBufferDone: dequeue, no current buffer");
-                g_pPortalManager->m_sPortals.screencopy->m_pPipewire->dequeue(this);
-            }
+    Debug::log(TRACE, "[sc] frame copied");
+}
 
-            if (!PSTREAM->currentPWBuffer) {
-                Debug::log(LOG, "[screencopy/pipewire] Out of buffers");
-                sharingData.status = FRAME_NONE;
-                if (sharingData.copyRetries++ < MAX_RETRIES) {
-                    Debug::log(LOG, "[sc] Retrying screencopy ({}/{})", sharingData.copyRetries, MAX_RETRIES);
-                    g_pPortalManager->m_sPortals.screencopy->m_pPipewire->updateStreamParam(PSTREAM);
-                    g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(this);
-                }
-                sharingData.frameCallback.reset();
-                return;
-            }
+void CScreencopyPortal::SSession::onFrameReady(bool unchanged) {
+    const auto PPORTAL = g_pPortalManager->m_sPortals.screencopy.get();
 
-            sharingData.frameCallback->sendCopyWithDamage(PSTREAM->currentPWBuffer->wlBuffer->resource());
-            sharingData.copyRetries = 0;
+    sharingData.status        = FRAME_READY;
+    sharingData.tvTimestampNs = sharingData.tvSec * SPA_NSEC_PER_SEC + sharingData.tvNsec;
 
-            Debug::log(TRACE, "[sc] wlr frame copied");
-        });
-    } else if (sharingData.windowFrameCallback) {
-        sharingData.windowFrameCallback->setBuffer([this, self = self](CCHyprlandToplevelExportFrameV1* r, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
-            Debug::log(TRACE, "[sc] hlOnBuffer for {}", (void*)self.get());
-            if (!self)
-                return;
-
-            sharingData.frameInfoSHM.w      = width;
-            sharingData.frameInfoSHM.h      = height;
-            sharingData.frameInfoSHM.fmt    = drmFourccFromSHM((wl_shm_format)format);
-            sharingData.frameInfoSHM.size   = stride * height;
-            sharingData.frameInfoSHM.stride = stride;
-
-            // todo: done if ver < 3
-        });
-        sharingData.windowFrameCallback->setReady([this, self = self](CCHyprlandToplevelExportFrameV1* r, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
-            Debug::log(TRACE, "[sc] hlOnReady for {}", (void*)self.get());
-            if (!self)
-                return;
+    Debug::log(TRACE, "[sc] frame timestamp sec: {} nsec: {} combined: {}ns", sharingData.tvSec, sharingData.tvNsec, sharingData.tvTimestampNs);
 
-            sharingData.status = FRAME_READY;
+    stats.onFrameReady();
 
-            sharingData.tvSec         = ((((uint64_t)tv_sec_hi) << 32) + (uint64_t)tv_sec_lo);
-            sharingData.tvNsec        = tv_nsec;
-            sharingData.tvTimestampNs = sharingData.tvSec * SPA_NSEC_PER_SEC + sharingData.tvNsec;
+    const auto PSTREAM = PPORTAL->m_pPipewire->streamFromSession(this);
 
-            Debug::log(TRACE, "[sc] frame timestamp sec: {} nsec: {} combined: {}ns", sharingData.tvSec, sharingData.tvNsec, sharingData.tvTimestampNs);
+    // nothing new for the consumer. The buffer stays ours, the next capture goes into it again.
+    if (unchanged || (PSTREAM && !PPORTAL->m_pPipewire->updateTileDamage(PSTREAM))) {
+        Debug::log(TRACE, "[sc] frame unchanged, not sending it");
+        sharingData.status = FRAME_NONE;
+        stats.onFrameUnchanged();
+        PPORTAL->queueNextShareFrame(this);
+        return;
+    }
 
-            g_pPortalManager->m_sPortals.screencopy->m_pPipewire->enqueue(this);
+    PPORTAL->m_pPipewire->enqueue(this);
 
-            if (g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(this))
-                g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(this);
+    if (PPORTAL->m_pPipewire->streamFromSession(this))
+        PPORTAL->queueNextShareFrame(this);
+}
 
-            sharingData.windowFrameCallback.reset();
-        });
-        sharingData.windowFrameCallback->setFailed([this, self = self](CCHyprlandToplevelExportFrameV1* r) {
-            Debug::log(TRACE, "[sc] hlOnFailed for {}", (void*)self.get());
-            if (!self)
-                return;
-            sharingData.status = FRAME_FAILED;
-        });
-        sharingData.windowFrameCallback->setDamage([this, self = self](CCHyprlandToplevelExportFrameV1* r, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
-            Debug::log(TRACE, "[sc] hlOnDamage for {}", (void*)self.get());
-            if (!self)
-                return;
-
-            if (sharingData.damageCount > 3) {
-                sharingData.damage[0] = {0, 0, sharingData.frameInfoDMA.w, sharingData.frameInfoDMA.h};
-                return;
-            }
+void CScreencopyPortal::SSession::onFrameFailed(bool fatal) {
+    const auto PPORTAL = g_pPortalManager->m_sPortals.screencopy.get();
 
-            sharingData.damage[sharingData.damageCount++] = {x, y, width, height};
+    stats.onFrameFailed();
 
-            Debug::log(TRACE, "[sc] hl damage: {} {} {} {}", x, y, width, height);
-        });
-        sharingData.windowFrameCallback->setLinuxDmabuf([this, self = self](CCHyprlandToplevelExportFrameV1* r, uint32_t format, uint32_t width, uint32_t height) {
-            Debug::log(TRACE, "[sc] hlOnDmabuf for {}", (void*)self.get());
-            if (!self)
-                return;
-
-            sharingData.frameInfoDMA.w   = width;
-            sharingData.frameInfoDMA.h   = height;
-            sharingData.frameInfoDMA.fmt = format;
-        });
-        sharingData.windowFrameCallback->setBufferDone([this, self = self](CCHyprlandToplevelExportFrameV1* r) {
-            Debug::log(TRACE, "[sc] hlOnBufferDone for {}", (void*)self.get());
-            if (!self)
-                return;
-
-            const auto PSTREAM = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(this);
-
-            if (!PSTREAM) {
-                Debug::log(TRACE, "[sc] hlOnBufferDone: no stream");
-                sharingData.status = FRAME_NONE;
-                sharingData.windowFrameCallback.reset();
-                return;
-            }
+    if (!fatal) {
+        // new constraints are on their way, the next frame will pick them up
+        sharingData.status = FRAME_NONE;
+        if (PPORTAL->m_pPipewire->streamFromSession(this))
+            PPORTAL->queueNextShareFrame(this);
+        return;
+    }
 
-            Debug::log(TRACE, "[sc] pw format {} size {}x{}", (int)PSTREAM->pwVideoInfo.format, PSTREAM->pwVideoInfo.size.width, PSTREAM->pwVideoInfo.size.height);
-            Debug::log(TRACE, "[sc] hl format {} size {}x{}", (int)sharingData.frameInfoSHM.fmt, sharingData.frameInfoSHM.w, sharingData.frameInfoSHM.h);
-            Debug::log(TRACE, "[sc] hl format dma {} size {}x{}", (int)sharingData.frameInfoDMA.fmt, sharingData.frameInfoDMA.w, sharingData.frameInfoDMA.h);
-
-            const auto FMT = PSTREAM->isDMA ? sharingData.frameInfoDMA.fmt : sharingData.frameInfoSHM.fmt;
-            if ((PSTREAM->pwVideoInfo.format != pwFromDrmFourcc(FMT) && PSTREAM->pwVideoInfo.format != pwStripAlpha(pwFromDrmFourcc(FMT))) ||
-                (PSTREAM->pwVideoInfo.size.width != sharingData.frameInfoDMA.w || PSTREAM->pwVideoInfo.size.height != sharingData.frameInfoDMA.h)) {
-                Debug::log(LOG, "[sc] Incompatible formats, renegotiate stream");
-                sharingData.status = FRAME_RENEG;
-                g_pPortalManager->m_sPortals.screencopy->m_pPipewire->updateStreamParam(PSTREAM);
-                g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(this);
-                sharingData.status = FRAME_NONE;
-                sharingData.windowFrameCallback.reset();
-                return;
-            }
+    sharingData.status = FRAME_FAILED;
+    PPORTAL->finishStart(this, false);
+}
 
-            if (!PSTREAM->currentPWBuffer) {
-                Debug::log(TRACE, "[sc] hlOnBufferDone: dequeue, no current buffer");
-                g_pPortalManager->m_sPortals.screencopy->m_pPipewire->dequeue(this);
-            }
+void CScreencopyPortal::SSession::onCursorChanged() {
+    cursor.dirty = true;
 
-            if (!PSTREAM->currentPWBuffer) {
-                Debug::log(LOG, "[screencopy/pipewire] Out of buffers");
-                sharingData.status = FRAME_NONE;
-                if (sharingData.copyRetries++ < MAX_RETRIES) {
-                    Debug::log(LOG, "[sc] Retrying screencopy ({}/{})", sharingData.copyRetries, MAX_RETRIES);
-                    g_pPortalManager->m_sPortals.screencopy->m_pPipewire->updateStreamParam(PSTREAM);
-                    g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(this);
-                }
-                sharingData.windowFrameCallback.reset();
-                return;
-            }
+    if (cursor.flushQueued)
+        return;
 
-            sharingData.windowFrameCallback->sendCopy(PSTREAM->currentPWBuffer->wlBuffer->resource(), false);
-            sharingData.copyRetries = 0;
+    // frames carry the cursor with them, so lone cursor updates only go out at the frame rate
+    cursor.flushQueued = true;
+    g_pPortalManager->addTimer({1000.F / sharingData.framerate, [self = self]() {
+                                    if (!self)
+                                        return;
 
-            Debug::log(TRACE, "[sc] hl frame copied");
-        });
+                                    self->cursor.flushQueued = false;
+                                    if (self->cursor.dirty)
+                                        g_pPortalManager->m_sPortals.screencopy->m_pPipewire->enqueueCursor(self.get());
+                                }});
+}
+
+std::unique_ptr<ICaptureBackend> CScreencopyPortal::createBackend(SSession* pSession) {
+    const bool HAS_EXT = hasExtCapture();
+
+    // cursor metadata comes from an ext cursor session, which only exists for outputs
+    if (pSession->cursorMode == METADATA && (pSession->selection.type != TYPE_OUTPUT || !hasCursorMetadata())) {
+        Debug::log(LOG, "[screencopy] Cursor metadata unavailable for selection {}, embedding the cursor instead", (int)pSession->selection.type);
+        pSession->cursorMode = EMBEDDED;
+    }
+
+    switch (pSession->selection.type) {
+        case TYPE_OUTPUT:
+            // ext keeps one session per share, prefer it when the compositor has it
+            if (HAS_EXT)
+                return std::make_unique<CExtCaptureBackend>(pSession, m_sState.imageCopyCapture, m_sState.outputSourceManager);
+            [[fallthrough]];
+        case TYPE_GEOMETRY:
+            // regions of the same output all come out of one capture of it. Needs the logical size of the output to find them in it.
+            if (pSession->selection.type == TYPE_GEOMETRY && m_sState.screencopy && shareRegionCaptures() && g_pPortalManager->m_sWaylandConnection.xdgOutputMgr)
+                return std::make_unique<CRegionCaptureBackend>(pSession, outputCapture(pSession->selection.output, pSession->cursorMode == EMBEDDED));
+            if (m_sState.screencopy)
+                return std::make_unique<CWlrCaptureBackend>(pSession, m_sState.screencopy);
+            break;
+        case TYPE_WINDOW:
+            if (m_sState.toplevel)
+                return std::make_unique<CToplevelExportCaptureBackend>(pSession, m_sState.toplevel);
+            break;
+        default: break;
+    }
+
+    return nullptr;
+}
+
+SP<COutputCapture> CScreencopyPortal::outputCapture(const std::string& output, bool overlayCursor) {
+    std::erase_if(m_vOutputCaptures, [](const auto& c) { return !c; });
+
+    for (const auto& c : m_vOutputCaptures) {
+        if (c->m_sOutput == output && c->m_bOverlayCursor == overlayCursor)
+            return c.lock();
     }
+
+    const auto CAPTURE = makeShared<COutputCapture>(output, overlayCursor, m_sState.screencopy);
+    CAPTURE->m_pSelf   = CAPTURE;
+    m_vOutputCaptures.emplace_back(CAPTURE);
+
+    return CAPTURE;
 }
 
 void CScreencopyPortal::queueNextShareFrame(CScreencopyPortal::SSession* pSession) {
     const auto PSTREAM = m_pPipewire->streamFromSession(pSession);
 
-    if (PSTREAM && !PSTREAM->streamState)
-        return;
+    if (PSTREAM) {
+        CPipewireLock lock;
+        if (!PSTREAM->streamState)
+            return;
+    }
 
     // calculate frame delta and queue next frame
     const auto FRAMETOOKMS           = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - pSession->sharingData.begunFrame).count() / 1000.0;
@@ -594,13 +724,99 @@ void CScreencopyPortal::queueNextShareFrame(CScreencopyPortal::SSession* pSessio
     Debug::log(TRACE, "[screencopy] set fps {}, frame took {:.2f}ms, ms till next refresh {:.2f}, estimated actual fps: {:.2f}", pSession->sharingData.framerate, FRAMETOOKMS,
                MSTILNEXTREFRESH, std::clamp(1000.0 / FRAMETOOKMS, 1.0, (double)pSession->sharingData.framerate));
 
-    g_pPortalManager->addTimer(
-        {std::clamp(MSTILNEXTREFRESH - 1.0 /* safezone */, 6.0, 1000.0), [pSession]() { g_pPortalManager->m_sPortals.screencopy->startFrameCopy(pSession); }});
+    m_pScheduler->schedule(pSession, std::clamp(MSTILNEXTREFRESH - 1.0 /* safezone */, 6.0, 1000.0));
 }
 bool CScreencopyPortal::hasToplevelCapabilities() {
     return m_sState.toplevel;
 }
 
+bool CScreencopyPortal::hasExtCapture() {
+    return m_sState.imageCopyCapture && m_sState.outputSourceManager;
+}
+
+bool CScreencopyPortal::hasCursorMetadata() {
+    return hasExtCapture() && g_pPortalManager->m_sWaylandConnection.pointer;
+}
+
+void CScreencopyPortal::armStatsTimer() {
+    static auto* const* PINTERVAL = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:stats_interval")->getDataStaticPtr();
+
+    if (**PINTERVAL <= 0 || m_sStats.armed)
+        return;
+
+    m_sStats.armed = true;
+
+    timespec cpu;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    m_sStats.lastCPUNs   = cpu.tv_sec * SPA_NSEC_PER_SEC + cpu.tv_nsec;
+    m_sStats.lastWakeups = g_pPortalManager->wakeups();
+    m_sStats.lastReport  = std::chrono::steady_clock::now();
+
+    g_pPortalManager->addTimer({**PINTERVAL * 1000.F, [this]() { reportStats(); }});
+}
+
+void CScreencopyPortal::reportStats() {
+    m_sStats.armed = false;
+
+    timespec cpu;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    const uint64_t CPUNS = cpu.tv_sec * SPA_NSEC_PER_SEC + cpu.tv_nsec;
+
+    uint64_t       frames = 0;
+    bool           active = false;
+    for (auto& s : m_vSessions) {
+        if (!s->sharingData.active)
+            continue;
+
+        const auto PSTREAM = m_pPipewire->streamFromSession(s.get());
+
+        active = true;
+        frames += s->stats.frames();
+        s->stats.report(PSTREAM && PSTREAM->paused.active ? s->sessionHandle + " (paused)" : std::string{s->sessionHandle});
+    }
+
+    if (frames > 0)
+        Debug::log(LOG, "[stats] process: {:.3f}ms of cpu per frame over {} frames", (CPUNS - m_sStats.lastCPUNs) / 1000000.0 / frames, frames);
+
+    const auto WINDOWSEC = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_sStats.lastReport).count() / 1000.0;
+    if (WINDOWSEC > 0)
+        Debug::log(LOG, "[stats] process: {:.1f} wakeups/s", (g_pPortalManager->wakeups() - m_sStats.lastWakeups) / WINDOWSEC);
+
+    // stop reporting once nothing is shared anymore, finishStart re-arms us
+    if (active)
+        armStatsTimer();
+}
+
+int CScreencopyPortal::dispatchCaptureQueues() {
+    int dispatched = 0;
+
+    for (auto& s : m_vSessions) {
+        if (!s->eventQueue)
+            continue;
+
+        const int RET = wl_display_dispatch_queue_pending(g_pPortalManager->m_sWaylandConnection.display, s->eventQueue);
+        if (RET < 0)
+            return -1;
+
+        dispatched += RET;
+    }
+
+    // shared output captures. Dispatching may end the last region of one, and with it the capture.
+    for (const auto& c : std::vector{m_vOutputCaptures}) {
+        const auto CAPTURE = c.lock();
+        if (!CAPTURE || !CAPTURE->m_pEventQueue)
+            continue;
+
+        const int RET = wl_display_dispatch_queue_pending(g_pPortalManager->m_sWaylandConnection.display, CAPTURE->m_pEventQueue);
+        if (RET < 0)
+            return -1;
+
+        dispatched += RET;
+    }
+
+    return dispatched;
+}
+
 CScreencopyPortal::SSession* CScreencopyPortal::getSession(sdbus::ObjectPath& path) {
     for (auto& s : m_vSessions) {
         if (s->sessionHandle == path)
@@ -619,18 +835,24 @@ CScreencopyPortal::CScreencopyPortal(SP<CCZwlrScreencopyManagerV1> mgr) {
                             return onCreateSession(o1, o2, s1, m1);
                         }),
                     sdbus::registerMethod("SelectSources")
-                        .implementedAs([this](sdbus::ObjectPath o1, sdbus::ObjectPath o2, std::string s1, std::unordered_map<std::string, sdbus::Variant> m1) {
-                            return onSelectSources(o1, o2, s1, m1);
+                        .implementedAs([this](dbUasvResult&& result, sdbus::ObjectPath o1, sdbus::ObjectPath o2, std::string s1, std::unordered_map<std::string, sdbus::Variant> m1) {
+                            onSelectSources(std::move(result), o1, o2, s1, m1);
                         }),
-                    sdbus::registerMethod("Start").implementedAs([this](sdbus::ObjectPath o1, sdbus::ObjectPath o2, std::string s1, std::string s2,
-                                                                        std::unordered_map<std::string, sdbus::Variant> m1) { return onStart(o1, o2, s1, s2, m1); }),
-                    sdbus::registerProperty("AvailableSourceTypes").withGetter([]() { return uint32_t{VIRTUAL | MONITOR | WINDOW}; }),
-                    sdbus::registerProperty("AvailableCursorModes").withGetter([]() { return uint32_t{HIDDEN | EMBEDDED}; }),
+                    sdbus::registerMethod("Start").implementedAs([this](dbUasvResult&& result, sdbus::ObjectPath o1, sdbus::ObjectPath o2, std::string s1, std::string s2,
+                                                                        std::unordered_map<std::string, sdbus::Variant> m1) { onStart(std::move(result), o1, o2, s1, s2, m1); }),
+                    sdbus::registerProperty("AvailableSourceTypes").withGetter([this]() {
+                        // regions need wlr screencopy, ext only does whole outputs
+                        return (uint32_t)(MONITOR | WINDOW | (m_sState.screencopy ? VIRTUAL : 0));
+                    }),
+                    sdbus::registerProperty("AvailableCursorModes").withGetter([this]() {
+                        return (uint32_t)(HIDDEN | EMBEDDED | (hasCursorMetadata() ? METADATA : 0));
+                    }),
                     sdbus::registerProperty("version").withGetter([]() { return uint32_t{3}; }))
         .forInterface(INTERFACE_NAME);
 
     m_sState.screencopy = mgr;
     m_pPipewire         = std::make_unique<CPipewireConnection>();
+    m_pScheduler        = std::make_unique<CCaptureScheduler>();
 
     Debug::log(LOG, "[screencopy] init successful");
 }
@@ -641,6 +863,13 @@ void CScreencopyPortal::appendToplevelExport(SP<CCHyprlandToplevelExportManagerV
     Debug::log(LOG, "[screencopy] Registered for toplevel export");
 }
 
+void CScreencopyPortal::appendImageCopyCapture(SP<CCExtImageCopyCaptureManagerV1> proto, SP<CCExtOutputImageCaptureSourceManagerV1> outputSourceMgr) {
+    m_sState.imageCopyCapture    = proto;
+    m_sState.outputSourceManager = outputSourceMgr;
+
+    Debug::log(LOG, "[screencopy] Registered for ext image copy capture");
+}
+
 bool CPipewireConnection::good() {
     return m_pContext && m_pCore;
 }
@@ -660,22 +889,24 @@ CPipewireConnection::CPipewireConnection() {
         return;
     }
 
+    m_pQueueEvent = pw_loop_add_event(
+        g_pPortalManager->m_sPipewire.loop, [](void* data, uint64_t count) { ((CPipewireConnection*)data)->queueReadyBuffers(); }, this);
+
     Debug::log(LOG, "[pipewire] connected");
 }
 
 void CPipewireConnection::removeSessionFrameCallbacks(CScreencopyPortal::SSession* pSession) {
     Debug::log(TRACE, "[pipewire] removeSessionFrameCallbacks called");
 
-    pSession->sharingData.frameCallback.reset();
-    pSession->sharingData.windowFrameCallback.reset();
-
-    pSession->sharingData.windowFrameCallback = nullptr;
-    pSession->sharingData.frameCallback       = nullptr;
+    if (pSession->backend)
+        pSession->backend->dropFrame();
 
     pSession->sharingData.status = FRAME_NONE;
 }
 
 CPipewireConnection::~CPipewireConnection() {
+    if (m_pQueueEvent)
+        pw_loop_destroy_source(g_pPortalManager->m_sPipewire.loop, m_pQueueEvent);
     if (m_pCore)
         pw_core_disconnect(m_pCore);
     if (m_pContext)
@@ -684,84 +915,116 @@ CPipewireConnection::~CPipewireConnection() {
 
 // --------------- Pipewire Stream Handlers --------------- //
 
-static void pwStreamStateChange(void* data, pw_stream_state old, pw_stream_state state, const char* error) {
-    const auto PSTREAM = (CPipewireConnection::SPWStream*)data;
+// runs on the main thread, pwStreamStateChange only records the new state
+static void onStreamStateChange(CScreencopyPortal::SSession* pSession, pw_stream_state state, const std::string& error) {
+    const auto PSCREENCOPY = g_pPortalManager->m_sPortals.screencopy.get();
+    const auto PSTREAM     = PSCREENCOPY->m_pPipewire->streamFromSession(pSession);
 
-    PSTREAM->pSession->sharingData.nodeID = pw_stream_get_node_id(PSTREAM->stream);
+    if (!PSTREAM) {
+        Debug::log(TRACE, "[pw] state change for a stream that's already gone");
+        return;
+    }
 
-    Debug::log(TRACE, "[pw] pwStreamStateChange on {} from {} to {}, node id {}", (void*)PSTREAM, pw_stream_state_as_string(old), pw_stream_state_as_string(state),
-               PSTREAM->pSession->sharingData.nodeID);
+    bool streaming = false;
+    {
+        CPipewireLock lock;
+        streaming = PSTREAM->streamState;
+    }
 
     switch (state) {
         case PW_STREAM_STATE_STREAMING:
-            PSTREAM->streamState = true;
-            if (PSTREAM->pSession->sharingData.status == FRAME_NONE)
-                g_pPortalManager->m_sPortals.screencopy->startFrameCopy(PSTREAM->pSession);
-            else {
-                g_pPortalManager->m_sPortals.screencopy->m_pPipewire->removeSessionFrameCallbacks(PSTREAM->pSession);
-                g_pPortalManager->m_sPortals.screencopy->startFrameCopy(PSTREAM->pSession);
-            }
+            // might've been paused again in the meantime, that change is queued after us
+            if (!streaming)
+                break;
+            if (pSession->sharingData.status != FRAME_NONE)
+                PSCREENCOPY->m_pPipewire->removeSessionFrameCallbacks(pSession);
+            PSCREENCOPY->m_pPipewire->resumeStream(PSTREAM);
+            PSCREENCOPY->startFrameCopy(pSession);
             break;
-        default: {
-            PSTREAM->streamState = false;
-            g_pPortalManager->m_sPortals.screencopy->m_pPipewire->removeSessionFrameCallbacks(PSTREAM->pSession);
+        case PW_STREAM_STATE_PAUSED:
+            // same as above, might've been resumed already
+            if (streaming)
+                break;
+            PSCREENCOPY->m_pPipewire->pauseStream(PSTREAM);
             break;
-        }
+        default: PSCREENCOPY->m_pPipewire->removeSessionFrameCallbacks(pSession); break;
     }
 
-    if (state == PW_STREAM_STATE_UNCONNECTED) {
-        g_pPortalManager->m_sPortals.screencopy->m_pPipewire->removeSessionFrameCallbacks(PSTREAM->pSession);
-        g_pPortalManager->m_sPortals.screencopy->m_pPipewire->destroyStream(PSTREAM->pSession);
+    if (pSession->sharingData.startStatus == START_CONNECTING) {
+        if (pSession->sharingData.nodeID != SPA_ID_INVALID)
+            PSCREENCOPY->finishStart(pSession, true);
+        else if (state == PW_STREAM_STATE_ERROR || state == PW_STREAM_STATE_UNCONNECTED) {
+            Debug::log(ERR, "[pw] stream failed before getting a node: {}", error.empty() ? "unknown error" : error);
+            PSCREENCOPY->finishStart(pSession, false);
+            return;
+        }
     }
+
+    if (state == PW_STREAM_STATE_UNCONNECTED)
+        PSCREENCOPY->m_pPipewire->destroyStream(pSession);
 }
 
-static void pwStreamParamChanged(void* data, uint32_t id, const spa_pod* param) {
-    const auto PSTREAM = (CPipewireConnection::SPWStream*)data;
+static void pwStreamStateChange(void* data, pw_stream_state old, pw_stream_state state, const char* error) {
+    const auto     PSTREAM = (CPipewireConnection::SPWStream*)data;
+    const uint32_t NODEID  = pw_stream_get_node_id(PSTREAM->stream);
 
-    Debug::log(TRACE, "[pw] pwStreamParamChanged on {}", (void*)PSTREAM);
+    // ours, read under the lock. The node id is the session's, that's the main thread's.
+    PSTREAM->streamState = state == PW_STREAM_STATE_STREAMING;
 
-    if (id != SPA_PARAM_Format || !param) {
-        Debug::log(TRACE, "[pw] invalid call in pwStreamParamChanged");
-        return;
-    }
+    Debug::log(TRACE, "[pw] pwStreamStateChange on {} from {} to {}, node id {}", (void*)PSTREAM, pw_stream_state_as_string(old), pw_stream_state_as_string(state), NODEID);
 
-    spa_pod_dynamic_builder dynBuilder[3];
-    const spa_pod*          params[4];
-    uint8_t                 params_buffer[3][1024];
+    // most likely on the pipewire thread. Frame callbacks are wayland objects, and the stream can't be destroyed from within its own callback anyways.
+    g_pPortalManager->dispatchOnMainThread([self = PSTREAM->pSession->self, state, NODEID, error = std::string{error ? error : ""}]() {
+        if (!self)
+            return;
 
-    spa_pod_dynamic_builder_init(&dynBuilder[0], params_buffer[0], sizeof(params_buffer[0]), 2048);
-    spa_pod_dynamic_builder_init(&dynBuilder[1], params_buffer[1], sizeof(params_buffer[1]), 2048);
-    spa_pod_dynamic_builder_init(&dynBuilder[2], params_buffer[2], sizeof(params_buffer[2]), 2048);
+        self->sharingData.nodeID = NODEID;
+        onStreamStateChange(self.get(), state, error);
+    });
+}
 
-    spa_format_video_raw_parse(param, &PSTREAM->pwVideoInfo);
-    Debug::log(TRACE, "[pw] Framerate: {}/{}", PSTREAM->pwVideoInfo.max_framerate.num, PSTREAM->pwVideoInfo.max_framerate.denom);
-    PSTREAM->pSession->sharingData.framerate = PSTREAM->pwVideoInfo.max_framerate.num / PSTREAM->pwVideoInfo.max_framerate.denom;
+// The main thread's part of a format change: the framerate, and the params, which are built from the outputs and the capture
+// formats. unfixated has the modifiers the consumer offers if it left picking one to us.
+static void applyStreamFormat(CScreencopyPortal::SSession* pSession, uint64_t formatSeq, const std::optional<std::vector<uint64_t>>& unfixated) {
+    CPipewireLock lock;
 
-    uint32_t                   data_type = 1 << SPA_DATA_MemFd;
+    const auto    PSTREAM = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(pSession);
 
-    const struct spa_pod_prop* prop_modifier;
-    if ((prop_modifier = spa_pod_find_prop(param, nullptr, SPA_FORMAT_VIDEO_modifier))) {
+    // a newer format is on its way here as well
+    if (!PSTREAM || PSTREAM->formatSeq != formatSeq)
+        return;
+
+    PSTREAM->pSession->sharingData.framerate = PSTREAM->pwVideoInfo.max_framerate.num / PSTREAM->pwVideoInfo.max_framerate.denom;
+    Debug::log(TRACE, "[pw] Framerate: {}/{}", PSTREAM->pwVideoInfo.max_framerate.num, PSTREAM->pwVideoInfo.max_framerate.denom);
+
+    if (PSTREAM->isDMA) {
         Debug::log(TRACE, "[pipewire] pw requested dmabuf");
-        PSTREAM->isDMA = true;
-        data_type      = 1 << SPA_DATA_DmaBuf;
 
         RASSERT(PSTREAM->pwVideoInfo.format == pwFromDrmFourcc(PSTREAM->pSession->sharingData.frameInfoDMA.fmt), "invalid format in dma pw param change");
 
-        if ((prop_modifier->flags & SPA_POD_PROP_FLAG_DONT_FIXATE) > 0) {
+        if (unfixated) {
             Debug::log(TRACE, "[pw] don't fixate");
-            const spa_pod* pod_modifier = &prop_modifier->value;
-
-            uint32_t       n_modifiers = SPA_POD_CHOICE_N_VALUES(pod_modifier) - 1;
-            uint64_t*      modifiers   = (uint64_t*)SPA_POD_CHOICE_VALUES(pod_modifier);
-            modifiers++;
-            uint32_t         flags = GBM_BO_USE_RENDERING;
-            uint64_t         modifier;
-            uint32_t         n_params;
-            spa_pod_builder* builder[2] = {&dynBuilder[0].b, &dynBuilder[1].b};
-
-            gbm_bo*          bo =
-                gbm_bo_create_with_modifiers2(g_pPortalManager->m_sWaylandConnection.gbmDevice, PSTREAM->pSession->sharingData.frameInfoDMA.w,
-                                              PSTREAM->pSession->sharingData.frameInfoDMA.h, PSTREAM->pSession->sharingData.frameInfoDMA.fmt, modifiers, n_modifiers, flags);
+
+            uint32_t flags = GBM_BO_USE_RENDERING;
+            uint64_t modifier;
+            uint32_t n_params;
+
+            // the consumer's order, but a cheaper class first. gbm picks freely within the list it gets, so it's asked one class at a time.
+            std::vector<uint64_t> ranked = *unfixated;
+            std::stable_sort(ranked.begin(), ranked.end(), [](uint64_t a, uint64_t b) { return modifierClass(a) < modifierClass(b); });
+
+            gbm_bo* bo = nullptr;
+            for (auto it = ranked.begin(); it != ranked.end() && !bo;) {
+                const auto CLASS = modifierClass(*it);
+                const auto END   = std::find_if(it, ranked.end(), [CLASS](uint64_t mod) { return modifierClass(mod) != CLASS; });
+
+                if (CLASS != MODIFIER_IMPLICIT)
+                    bo = gbm_bo_create_with_modifiers2(PSTREAM->device->gbm, PSTREAM->dmaSize.w, PSTREAM->dmaSize.h, PSTREAM->pSession->sharingData.frameInfoDMA.fmt, &*it,
+                                                       END - it, flags);
+
+                it = END;
+            }
+
             if (bo) {
                 modifier = gbm_bo_get_modifier(bo);
                 gbm_bo_destroy(bo);
@@ -769,17 +1032,14 @@ static void pwStreamParamChanged(void* data, uint32_t id, const spa_pod* param)
             }
 
             Debug::log(TRACE, "[pw] unable to allocate a dmabuf with modifiers. Falling back to the old api");
-            for (uint32_t i = 0; i < n_modifiers; i++) {
-                switch (modifiers[i]) {
-                    case DRM_FORMAT_MOD_INVALID:
-                        flags =
-                            GBM_BO_USE_RENDERING; // ;cast->ctx->state->config->screencast_conf.force_mod_linear ? GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR : GBM_BO_USE_RENDERING;
-                        break;
+            for (const auto& mod : ranked) {
+                switch (mod) {
+                    // the driver picks the layout. Some consumers can't import what it picks, screencopy:force_mod_linear is for them.
+                    case DRM_FORMAT_MOD_INVALID: flags = forceModLinear() ? GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR : GBM_BO_USE_RENDERING; break;
                     case DRM_FORMAT_MOD_LINEAR: flags = GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR; break;
                     default: continue;
                 }
-                bo = gbm_bo_create(g_pPortalManager->m_sWaylandConnection.gbmDevice, PSTREAM->pSession->sharingData.frameInfoDMA.w, PSTREAM->pSession->sharingData.frameInfoDMA.h,
-                                   PSTREAM->pSession->sharingData.frameInfoDMA.fmt, flags);
+                bo = gbm_bo_create(PSTREAM->device->gbm, PSTREAM->dmaSize.w, PSTREAM->dmaSize.h, PSTREAM->pSession->sharingData.frameInfoDMA.fmt, flags);
                 if (bo) {
                     modifier = gbm_bo_get_modifier(bo);
                     gbm_bo_destroy(bo);
@@ -791,16 +1051,19 @@ static void pwStreamParamChanged(void* data, uint32_t id, const spa_pod* param)
             return;
 
         fixate_format:
-            params[0] = fixate_format(&dynBuilder[2].b, pwFromDrmFourcc(PSTREAM->pSession->sharingData.frameInfoDMA.fmt), PSTREAM->pSession->sharingData.frameInfoDMA.w,
-                                      PSTREAM->pSession->sharingData.frameInfoDMA.h, PSTREAM->pSession->sharingData.framerate, &modifier);
+            const spa_pod*          params[3];
+            uint8_t                 params_buffer[1024];
+            spa_pod_dynamic_builder dynBuilder;
+            spa_pod_dynamic_builder_init(&dynBuilder, params_buffer, sizeof(params_buffer), 2048);
 
-            n_params = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->buildFormatsFor(builder, &params[1], PSTREAM);
+            params[0] = fixate_format(&dynBuilder.b, pwFromDrmFourcc(PSTREAM->pSession->sharingData.frameInfoDMA.fmt), PSTREAM->dmaSize.w, PSTREAM->dmaSize.h,
+                                      PSTREAM->pSession->sharingData.framerate, &modifier);
+
+            n_params = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->buildFormatsFor(&params[1], PSTREAM);
             n_params++;
 
             pw_stream_update_params(PSTREAM->stream, params, n_params);
-            spa_pod_dynamic_builder_clean(&dynBuilder[0]);
-            spa_pod_dynamic_builder_clean(&dynBuilder[1]);
-            spa_pod_dynamic_builder_clean(&dynBuilder[2]);
+            spa_pod_dynamic_builder_clean(&dynBuilder);
 
             Debug::log(TRACE, "[pw] Format fixated:");
             Debug::log(TRACE, "[pw]  | buffer_type {}", "DMA (No fixate)");
@@ -820,37 +1083,96 @@ static void pwStreamParamChanged(void* data, uint32_t id, const spa_pod* param)
     Debug::log(TRACE, "[pw]  | size: {}x{}", PSTREAM->pwVideoInfo.size.width, PSTREAM->pwVideoInfo.size.height);
     Debug::log(TRACE, "[pw]  | framerate {}", PSTREAM->pSession->sharingData.framerate);
 
-    uint32_t blocks = 1;
+    g_pPortalManager->m_sPortals.screencopy->m_pPipewire->updateBufferParams(PSTREAM);
+}
 
-    params[0] = build_buffer(&dynBuilder[0].b, blocks, PSTREAM->pSession->sharingData.frameInfoSHM.size, PSTREAM->pSession->sharingData.frameInfoSHM.stride, data_type);
+static void pwStreamParamChanged(void* data, uint32_t id, const spa_pod* param) {
+    const auto PSTREAM = (CPipewireConnection::SPWStream*)data;
 
-    params[1] = (const spa_pod*)spa_pod_builder_add_object(&dynBuilder[1].b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
-                                                           SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header)));
+    Debug::log(TRACE, "[pw] pwStreamParamChanged on {}", (void*)PSTREAM);
 
-    params[2] = (const spa_pod*)spa_pod_builder_add_object(&dynBuilder[1].b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoTransform),
-                                                           SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_videotransform)));
+    if (id != SPA_PARAM_Format || !param) {
+        Debug::log(TRACE, "[pw] invalid call in pwStreamParamChanged");
+        return;
+    }
 
-    params[3] = (const spa_pod*)spa_pod_builder_add_object(
-        &dynBuilder[2].b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage), SPA_PARAM_META_size,
-        SPA_POD_CHOICE_RANGE_Int(sizeof(struct spa_meta_region) * 4, sizeof(struct spa_meta_region) * 1, sizeof(struct spa_meta_region) * 4));
+    // what buffers get allocated with is ours, set under the lock. The rest is up to applyStreamFormat.
+    spa_format_video_raw_parse(param, &PSTREAM->pwVideoInfo);
+    PSTREAM->tileDamage.reset();
+    PSTREAM->formatSeq++;
 
-    pw_stream_update_params(PSTREAM->stream, params, 4);
-    spa_pod_dynamic_builder_clean(&dynBuilder[0]);
-    spa_pod_dynamic_builder_clean(&dynBuilder[1]);
-    spa_pod_dynamic_builder_clean(&dynBuilder[2]);
-}
+    const spa_pod_prop*                  prop_modifier = spa_pod_find_prop(param, nullptr, SPA_FORMAT_VIDEO_modifier);
+    std::optional<std::vector<uint64_t>> unfixated;
 
-static void pwStreamAddBuffer(void* data, pw_buffer* buffer) {
-    const auto PSTREAM = (CPipewireConnection::SPWStream*)data;
+    PSTREAM->isDMA = prop_modifier;
 
-    Debug::log(TRACE, "[pw] pwStreamAddBuffer with {} on {}", (void*)buffer, (void*)PSTREAM);
+    if (prop_modifier && (prop_modifier->flags & SPA_POD_PROP_FLAG_DONT_FIXATE) > 0) {
+        const spa_pod*  pod_modifier = &prop_modifier->value;
+        const uint32_t  N_MODIFIERS  = SPA_POD_CHOICE_N_VALUES(pod_modifier) - 1;
+        const uint64_t* PMODIFIERS   = (const uint64_t*)SPA_POD_CHOICE_VALUES(pod_modifier) + 1;
 
-    spa_data*     spaData = buffer->buffer->datas;
-    spa_data_type type;
+        unfixated.emplace(PMODIFIERS, PMODIFIERS + N_MODIFIERS);
+    }
 
-    if ((spaData[0].type & (1u << SPA_DATA_MemFd)) > 0) {
-        type = SPA_DATA_MemFd;
-        Debug::log(WARN, "[pipewire] Asked for a wl_shm buffer which is legacy.");
+    g_pPortalManager->dispatchOnMainThread([self = PSTREAM->pSession->self, seq = PSTREAM->formatSeq, unfixated = std::move(unfixated)]() {
+        if (self)
+            applyStreamFormat(self.get(), seq, unfixated);
+    });
+}
+
+static void resetChunkSize(SBuffer* pBuffer, spa_data* spaData, uint32_t plane) {
+    spaData[plane].chunk->size = pBuffer->size[plane];
+    // clients have implemented to check chunk->size if the buffer is valid instead
+    // of using the flags. Until they are patched we should use some arbitrary value.
+    if (pBuffer->isDMABUF && spaData[plane].chunk->size == 0) {
+        spaData[plane].chunk->size = 9; // This was choosen by a fair d20.
+    }
+}
+
+// whether the buffer's last two datas are for the acquire and release syncobj, i.e. explicit sync was negotiated for it
+static bool hasSyncDatas(spa_buffer* spaBuf) {
+    return spaBuf->n_datas > 2 && (spaBuf->datas[0].type & (1u << SPA_DATA_DmaBuf)) && spa_buffer_find_meta(spaBuf, SPA_META_SyncTimeline);
+}
+
+// the image planes of a buffer, without the syncobj blocks
+static uint32_t imageDatas(SBuffer* pBuffer, spa_buffer* spaBuf) {
+    return pBuffer && pBuffer->isDMABUF && hasSyncDatas(spaBuf) ? spaBuf->n_datas - 2 : spaBuf->n_datas;
+}
+
+// The consumer side of readyBuffers, which only the pipewire thread may pop. Anywhere else it's left for queueReadyBuffers,
+// or pwStreamAddBuffer if new buffers come first.
+static void dropReadyBuffers(CPipewireConnection::SPWStream* pStream) {
+    if (!pw_thread_loop_in_thread(g_pPortalManager->m_sPipewire.threadLoop)) {
+        pStream->readyStale = true;
+        return;
+    }
+
+    pStream->readyStale = false;
+
+    size_t dropped = 0;
+    while (pStream->readyBuffers.pop()) {
+        dropped++;
+    }
+
+    if (dropped > 0)
+        Debug::log(TRACE, "[pw] dropped {} ready buffers on {}", dropped, (void*)pStream);
+}
+
+static void pwStreamAddBuffer(void* data, pw_buffer* buffer) {
+    const auto PSTREAM = (CPipewireConnection::SPWStream*)data;
+
+    Debug::log(TRACE, "[pw] pwStreamAddBuffer with {} on {}", (void*)buffer, (void*)PSTREAM);
+
+    // nothing in readyBuffers can be one of these
+    if (PSTREAM->readyStale)
+        dropReadyBuffers(PSTREAM);
+
+    spa_data*     spaData = buffer->buffer->datas;
+    spa_data_type type;
+
+    if ((spaData[0].type & (1u << SPA_DATA_MemFd)) > 0) {
+        type = SPA_DATA_MemFd;
+        Debug::log(WARN, "[pipewire] Asked for a wl_shm buffer which is legacy.");
     } else if ((spaData[0].type & (1u << SPA_DATA_DmaBuf)) > 0) {
         type = SPA_DATA_DmaBuf;
     } else {
@@ -858,31 +1180,63 @@ static void pwStreamAddBuffer(void* data, pw_buffer* buffer) {
         return;
     }
 
-    const auto PBUFFER = PSTREAM->buffers.emplace_back(g_pPortalManager->m_sPortals.screencopy->m_pPipewire->createBuffer(PSTREAM, type == SPA_DATA_DmaBuf)).get();
+    auto buf = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->createBuffer(PSTREAM, type == SPA_DATA_DmaBuf);
+
+    if (!buf) {
+        Debug::log(ERR, "[pipewire] couldn't create a buffer");
+        return;
+    }
+
+    const auto PBUFFER = PSTREAM->buffers.emplace_back(std::move(buf)).get();
 
     PBUFFER->pwBuffer = buffer;
     buffer->user_data = PBUFFER;
 
     Debug::log(TRACE, "[pw] buffer datas {}", buffer->buffer->n_datas);
 
-    for (uint32_t plane = 0; plane < buffer->buffer->n_datas; plane++) {
+    // negotiated explicit sync, the last two datas are for the acquire and release syncobj
+    if (type == SPA_DATA_DmaBuf && hasSyncDatas(buffer->buffer)) {
+        PBUFFER->timeline = std::make_unique<CSyncTimeline>(gbm_device_get_fd(PSTREAM->device->gbm));
+
+        // without one there's nothing to hand out, the sync meta stays empty and both sides fall back to the dmabuf's implicit fences
+        if (!PBUFFER->timeline->good()) {
+            Debug::log(ERR, "[pipewire] couldn't create a timeline, buffer {} is synced implicitly", (void*)PBUFFER);
+            PBUFFER->timeline.reset();
+        }
+
+        for (uint32_t i = buffer->buffer->n_datas - 2; i < buffer->buffer->n_datas; i++) {
+            spaData[i].type    = SPA_DATA_SyncObj;
+            spaData[i].flags   = SPA_DATA_FLAG_READABLE;
+            spaData[i].fd      = PBUFFER->timeline ? PBUFFER->timeline->fd() : -1;
+            spaData[i].maxsize = 0;
+            spaData[i].data    = NULL;
+        }
+    }
+
+    for (uint32_t plane = 0; plane < imageDatas(PBUFFER, buffer->buffer); plane++) {
         spaData[plane].type          = type;
         spaData[plane].maxsize       = PBUFFER->size[plane];
-        spaData[plane].mapoffset     = 0;
-        spaData[plane].chunk->size   = PBUFFER->size[plane];
+        spaData[plane].mapoffset     = PBUFFER->mapOffset;
         spaData[plane].chunk->stride = PBUFFER->stride[plane];
         spaData[plane].chunk->offset = PBUFFER->offset[plane];
         spaData[plane].flags         = 0;
         spaData[plane].fd            = PBUFFER->fd[plane];
         spaData[plane].data          = NULL;
-        // clients have implemented to check chunk->size if the buffer is valid instead
-        // of using the flags. Until they are patched we should use some arbitrary value.
-        if (PBUFFER->isDMABUF && spaData[plane].chunk->size == 0) {
-            spaData[plane].chunk->size = 9; // This was choosen by a fair d20.
-        }
+        resetChunkSize(PBUFFER, spaData, plane);
     }
 }
 
+static void resetShmPool(CPipewireConnection::SPWStream* pStream) {
+    pStream->shmPool.pool.reset();
+
+    if (pStream->shmPool.fd >= 0)
+        close(pStream->shmPool.fd);
+
+    pStream->shmPool.fd       = -1;
+    pStream->shmPool.slotSize = 0;
+    pStream->shmPool.slots    = 0;
+}
+
 static void pwStreamRemoveBuffer(void* data, pw_buffer* buffer) {
     const auto PSTREAM = (CPipewireConnection::SPWStream*)data;
     const auto PBUFFER = (SBuffer*)buffer->user_data;
@@ -892,12 +1246,26 @@ static void pwStreamRemoveBuffer(void* data, pw_buffer* buffer) {
     if (!PBUFFER)
         return;
 
+#ifdef XDPH_ENCODER
+    // the encoder may be reading the current one back, see enqueue
+    std::lock_guard<std::mutex> guard(PSTREAM->encoderRead);
+#endif
+
+    // buffers are always removed all at once, so whatever's pending is stale
+    dropReadyBuffers(PSTREAM);
+    PSTREAM->spareBuffers.clear();
+    PSTREAM->releasePending.clear();
+
     if (PSTREAM->currentPWBuffer == PBUFFER)
         PSTREAM->currentPWBuffer = nullptr;
 
     if (PBUFFER->isDMABUF)
         gbm_bo_destroy(PBUFFER->bo);
 
+    if (PBUFFER->shmData)
+        munmap(PBUFFER->shmData, PBUFFER->size[0]);
+
+    PBUFFER->view.reset();
     PBUFFER->wlBuffer.reset();
     for (int plane = 0; plane < PBUFFER->planeCount; plane++) {
         close(PBUFFER->fd[plane]);
@@ -909,12 +1277,30 @@ static void pwStreamRemoveBuffer(void* data, pw_buffer* buffer) {
 
     std::erase_if(PSTREAM->buffers, [&](const auto& other) { return other.get() == PBUFFER; });
 
+    if (PSTREAM->buffers.empty()) {
+        resetShmPool(PSTREAM);
+        // new buffers, new consumer state. Resend the bitmap.
+        PSTREAM->cursorSerial = 0;
+    }
+
     buffer->user_data = nullptr;
 }
 
+static void pwStreamIOChanged(void* data, uint32_t id, void* area, uint32_t size) {
+    const auto PSTREAM = (CPipewireConnection::SPWStream*)data;
+
+    if (id != SPA_IO_Clock)
+        return;
+
+    Debug::log(TRACE, "[pw] clock io {} on {}", area, (void*)PSTREAM);
+
+    PSTREAM->driver.clock = area && size >= sizeof(spa_io_clock) ? (spa_io_clock*)area : nullptr;
+}
+
 static const pw_stream_events pwStreamEvents = {
     .version       = PW_VERSION_STREAM_EVENTS,
     .state_changed = pwStreamStateChange,
+    .io_changed    = pwStreamIOChanged,
     .param_changed = pwStreamParamChanged,
     .add_buffer    = pwStreamAddBuffer,
     .remove_buffer = pwStreamRemoveBuffer,
@@ -923,14 +1309,9 @@ static const pw_stream_events pwStreamEvents = {
 // ------------------------------------------------------- //
 
 void CPipewireConnection::createStream(CScreencopyPortal::SSession* pSession) {
-    const auto PSTREAM = m_vStreams.emplace_back(std::make_unique<SPWStream>(pSession)).get();
+    CPipewireLock lock;
 
-    pw_loop_enter(g_pPortalManager->m_sPipewire.loop);
-
-    uint8_t                 buffer[2][1024];
-    spa_pod_dynamic_builder dynBuilder[2];
-    spa_pod_dynamic_builder_init(&dynBuilder[0], buffer[0], sizeof(buffer[0]), 2048);
-    spa_pod_dynamic_builder_init(&dynBuilder[1], buffer[1], sizeof(buffer[1]), 2048);
+    const auto    PSTREAM = m_vStreams.emplace_back(std::make_unique<SPWStream>(pSession)).get();
 
     const std::string NAME = getRandName("xdph-streaming-");
 
@@ -944,12 +1325,10 @@ void CPipewireConnection::createStream(CScreencopyPortal::SSession* pSession) {
         return;
     }
 
-    spa_pod_builder* builder[2] = {&dynBuilder[0].b, &dynBuilder[1].b};
-    const spa_pod*   params[2];
-    const auto       PARAMCOUNT = buildFormatsFor(builder, params, PSTREAM);
+    PSTREAM->device = g_pPortalManager->allocationDevice();
 
-    spa_pod_dynamic_builder_clean(&dynBuilder[0]);
-    spa_pod_dynamic_builder_clean(&dynBuilder[1]);
+    const spa_pod* params[2];
+    const auto     PARAMCOUNT = buildFormatsFor(params, PSTREAM);
 
     pw_stream_add_listener(PSTREAM->stream, &PSTREAM->streamListener, &pwStreamEvents, PSTREAM);
 
@@ -958,6 +1337,18 @@ void CPipewireConnection::createStream(CScreencopyPortal::SSession* pSession) {
     pSession->sharingData.nodeID = pw_stream_get_node_id(PSTREAM->stream);
 
     Debug::log(TRACE, "[pw] Stream got nodeid {}", pSession->sharingData.nodeID);
+
+    static auto* const* PENCODER = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:encoder")->getDataStaticPtr();
+    if (**PENCODER) {
+#ifdef XDPH_ENCODER
+        PSTREAM->encoder = std::make_unique<CVideoEncoder>(m_pCore, NAME);
+#else
+        static bool warned = false;
+        if (!warned)
+            Debug::log(WARN, "[pw] screencopy:encoder is set, but xdph was built without the encoder option");
+        warned = true;
+#endif
+    }
 }
 
 void CPipewireConnection::destroyStream(CScreencopyPortal::SSession* pSession) {
@@ -971,6 +1362,8 @@ void CPipewireConnection::destroyStream(CScreencopyPortal::SSession* pSession) {
     if (!PSTREAM || !PSTREAM->stream)
         return;
 
+    CPipewireLock lock;
+
     if (!PSTREAM->buffers.empty()) {
         std::vector<SBuffer*> bufs;
 
@@ -990,80 +1383,145 @@ void CPipewireConnection::destroyStream(CScreencopyPortal::SSession* pSession) {
     std::erase_if(m_vStreams, [&](const auto& other) { return other.get() == PSTREAM; });
 }
 
-static bool wlr_query_dmabuf_modifiers(uint32_t drm_format, uint32_t num_modifiers, uint64_t* modifiers, uint32_t* max_modifiers) {
-    if (g_pPortalManager->m_vDMABUFMods.empty())
-        return false;
-
-    if (num_modifiers == 0) {
-        *max_modifiers = 0;
-        for (auto& mod : g_pPortalManager->m_vDMABUFMods) {
-            if (mod.fourcc == drm_format &&
-                (mod.mod == DRM_FORMAT_MOD_INVALID || gbm_device_get_format_modifier_plane_count(g_pPortalManager->m_sWaylandConnection.gbmDevice, mod.fourcc, mod.mod) > 0))
-                (*max_modifiers)++;
-        }
+// whether an ext capture source wants its buffers from the device the stream allocates on
+static bool sourceDeviceMatches(CPipewireConnection::SPWStream* stream) {
+    const auto& DEVICE = stream->pSession->sharingData.frameInfoDMA.device;
+    if (!DEVICE)
         return true;
-    }
 
-    size_t i = 0;
-    for (const auto& mod : g_pPortalManager->m_vDMABUFMods) {
-        if (i >= num_modifiers)
-            break;
+    drmDevice* drmDev = nullptr;
+    if (drmGetDeviceFromDevId(*DEVICE, /* flags */ 0, &drmDev) != 0)
+        return false;
 
-        if (mod.fourcc == drm_format &&
-            (mod.mod == DRM_FORMAT_MOD_INVALID || gbm_device_get_format_modifier_plane_count(g_pPortalManager->m_sWaylandConnection.gbmDevice, mod.fourcc, mod.mod) > 0)) {
-            modifiers[i] = mod.mod;
-            ++i;
-        }
-    }
+    const bool MATCHES = drmDevicesEqual(drmDev, stream->device->drm);
+    drmFreeDevice(&drmDev);
 
-    *max_modifiers = num_modifiers;
-    return true;
+    return MATCHES;
 }
 
-static bool build_modifierlist(CPipewireConnection::SPWStream* stream, uint32_t drm_format, uint64_t** modifiers, uint32_t* modifier_count) {
-    if (!wlr_query_dmabuf_modifiers(drm_format, 0, nullptr, modifier_count)) {
-        *modifiers      = NULL;
-        *modifier_count = 0;
+// Modifiers the compositor imports drm_format with, that the stream's device can allocate. A device the compositor has no
+// tranche for only gets linear buffers from the main device's list, those import anywhere. The same goes for an ext capture
+// source that wants buffers from another device, and only modifiers it advertised for the format are kept.
+// Ranked by bandwidth (see modifierClass), then by the compositor's tranche order. The first one is the pod's default.
+static bool build_modifierlist(CPipewireConnection::SPWStream* stream, uint32_t drm_format, std::vector<uint64_t>& modifiers) {
+    if (!stream->device || !stream->device->gbm)
+        return false;
+
+    const bool  CROSSDEVICE = stream->device->mods.empty();
+    const auto  PSOURCE     = CROSSDEVICE ? g_pPortalManager->mainDMABUFDevice() : stream->device;
+    const bool  LINEARONLY  = CROSSDEVICE || !sourceDeviceMatches(stream);
+    const auto& SOURCEMODS  = stream->pSession->sharingData.frameInfoDMA.modifiers;
+
+    if (!PSOURCE || PSOURCE->mods.empty())
         return false;
+
+    if (LINEARONLY && !CROSSDEVICE)
+        Debug::log(LOG, "[pw] build_modifierlist: the capture source wants buffers from another device, linear only");
+
+    std::vector<const SDMABUFModifier*> candidates;
+    for (const auto& mod : PSOURCE->mods) {
+        if (mod.fourcc != drm_format || (LINEARONLY && mod.mod != DRM_FORMAT_MOD_LINEAR))
+            continue;
+
+        if (SOURCEMODS && std::find(SOURCEMODS->begin(), SOURCEMODS->end(), mod.mod) == SOURCEMODS->end())
+            continue;
+
+        if (mod.mod != DRM_FORMAT_MOD_INVALID && gbm_device_get_format_modifier_plane_count(stream->device->gbm, mod.fourcc, mod.mod) <= 0)
+            continue;
+
+        candidates.push_back(&mod);
     }
-    if (*modifier_count == 0) {
-        Debug::log(ERR, "[pw] build_modifierlist: no mods");
-        *modifiers = NULL;
-        return true;
+
+    std::stable_sort(candidates.begin(), candidates.end(), [](const SDMABUFModifier* a, const SDMABUFModifier* b) {
+        return modifierClass(a->mod) != modifierClass(b->mod) ? modifierClass(a->mod) < modifierClass(b->mod) : a->tranche < b->tranche;
+    });
+
+    for (const auto& mod : candidates) {
+        // tranches may repeat a modifier, the best ranked one counts
+        if (std::find(modifiers.begin(), modifiers.end(), mod->mod) != modifiers.end())
+            continue;
+
+        modifiers.push_back(mod->mod);
+        Debug::log(TRACE, "[pw] build_modifierlist: {:x} class {} tranche {}{}", mod->mod, (int)modifierClass(mod->mod), mod->tranche, mod->scanout ? " (scanout)" : "");
     }
-    *modifiers = (uint64_t*)calloc(*modifier_count, sizeof(uint64_t));
-    bool ret   = wlr_query_dmabuf_modifiers(drm_format, *modifier_count, *modifiers, modifier_count);
-    Debug::log(TRACE, "[pw] build_modifierlist: count {}", *modifier_count);
-    return ret;
+
+    if (modifiers.empty())
+        Debug::log(ERR, "[pw] build_modifierlist: no mods");
+
+    return true;
 }
 
-uint32_t CPipewireConnection::buildFormatsFor(spa_pod_builder* b[2], const spa_pod* params[2], CPipewireConnection::SPWStream* stream) {
-    uint32_t  paramCount = 0;
-    uint32_t  modCount   = 0;
-    uint64_t* modifiers  = nullptr;
+// The EnumFormat pods only depend on the formats, sizes, framerate and the modifiers the device and its feedback allow, so
+// they're kept serialized per stream and only rebuilt, modifiers included, when one of those changes. params point into
+// the cache, valid until the next call.
+uint32_t CPipewireConnection::buildFormatsFor(const spa_pod* params[2], CPipewireConnection::SPWStream* stream) {
+    const bool DMAVALID = stream->pSession->sharingData.frameInfoDMA.fmt != DRM_FORMAT_INVALID && stream->device && stream->device->gbm &&
+        pwFromDrmFourcc(stream->pSession->sharingData.frameInfoDMA.fmt) != SPA_VIDEO_FORMAT_UNKNOWN;
 
-    if (build_modifierlist(stream, stream->pSession->sharingData.frameInfoDMA.fmt, &modifiers, &modCount) && modCount > 0) {
-        Debug::log(LOG, "[pw] Building modifiers for dma");
+    static auto* const* PHEADROOM = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:window_resize_headroom")->getDataStaticPtr();
 
-        paramCount = 2;
-        params[0]  = build_format(b[0], pwFromDrmFourcc(stream->pSession->sharingData.frameInfoDMA.fmt), stream->pSession->sharingData.frameInfoDMA.w,
-                                  stream->pSession->sharingData.frameInfoDMA.h, stream->pSession->sharingData.framerate, modifiers, modCount);
-        assert(params[0] != NULL);
-        params[1] = build_format(b[1], pwFromDrmFourcc(stream->pSession->sharingData.frameInfoSHM.fmt), stream->pSession->sharingData.frameInfoSHM.w,
-                                 stream->pSession->sharingData.frameInfoSHM.h, stream->pSession->sharingData.framerate, NULL, 0);
-        assert(params[1] != NULL);
-    } else {
-        Debug::log(LOG, "[pw] Building modifiers for shm");
+    stream->dmaSize  = {stream->pSession->sharingData.frameInfoDMA.w, stream->pSession->sharingData.frameInfoDMA.h};
+    stream->headroom = **PHEADROOM && stream->pSession->selection.type == TYPE_WINDOW;
 
-        paramCount = 1;
-        params[0]  = build_format(b[0], pwFromDrmFourcc(stream->pSession->sharingData.frameInfoSHM.fmt), stream->pSession->sharingData.frameInfoSHM.w,
-                                  stream->pSession->sharingData.frameInfoSHM.h, stream->pSession->sharingData.framerate, NULL, 0);
+    if (stream->headroom) {
+        // windows rarely outgrow the largest output, so buffers that big survive any resize
+        uint32_t maxW = 0, maxH = 0;
+        g_pPortalManager->getMaxOutputSize(&maxW, &maxH);
+
+        stream->dmaSize.w = std::max(stream->dmaSize.w, maxW);
+        stream->dmaSize.h = std::max(stream->dmaSize.h, maxH);
     }
 
-    if (modifiers)
-        free(modifiers);
+    SPWStream::SFormatKey key = {
+        .dmaFmt          = DMAVALID ? stream->pSession->sharingData.frameInfoDMA.fmt : DRM_FORMAT_INVALID,
+        .dmaW            = DMAVALID ? stream->dmaSize.w : 0,
+        .dmaH            = DMAVALID ? stream->dmaSize.h : 0,
+        .shmFmt          = stream->pSession->sharingData.frameInfoSHM.fmt,
+        .shmW            = stream->pSession->sharingData.frameInfoSHM.w,
+        .shmH            = stream->pSession->sharingData.frameInfoSHM.h,
+        .framerate       = stream->pSession->sharingData.framerate,
+        .device          = stream->device,
+        .feedback        = g_pPortalManager->m_sWaylandConnection.dma.generation,
+        .sourceModifiers = DMAVALID ? stream->pSession->sharingData.frameInfoDMA.modifiers : std::nullopt,
+        .sourceDevice    = DMAVALID ? stream->pSession->sharingData.frameInfoDMA.device : std::nullopt,
+    };
+
+    auto& cache = stream->formatCache;
+
+    if (cache.pods.empty() || cache.key != key) {
+        cache.key = key;
+        cache.pods.clear();
+
+        // no modifiers, no dma
+        std::vector<uint64_t> modifiers;
+        const bool            DMA = key.dmaFmt != DRM_FORMAT_INVALID && build_modifierlist(stream, key.dmaFmt, modifiers) && !modifiers.empty();
+
+        Debug::log(LOG, "[pw] Building modifiers for {}", DMA ? "dma" : "shm");
 
-    return paramCount;
+        uint8_t                 buffer[1024];
+        spa_pod_dynamic_builder dynBuilder;
+
+        // builds a param and keeps a copy of it
+        const auto addPod = [&](uint32_t fmt, uint32_t w, uint32_t h, uint64_t* mods, int modCount) {
+            spa_pod_dynamic_builder_init(&dynBuilder, buffer, sizeof(buffer), 2048);
+            const auto POD = build_format(&dynBuilder.b, pwFromDrmFourcc(fmt), w, h, key.framerate, mods, modCount);
+            assert(POD != NULL);
+            cache.pods.emplace_back((uint8_t*)POD, (uint8_t*)POD + SPA_POD_SIZE(POD));
+            spa_pod_dynamic_builder_clean(&dynBuilder);
+        };
+
+        if (DMA)
+            addPod(key.dmaFmt, key.dmaW, key.dmaH, modifiers.data(), modifiers.size());
+        if (pwFromDrmFourcc(key.shmFmt) != SPA_VIDEO_FORMAT_UNKNOWN)
+            addPod(key.shmFmt, key.shmW, key.shmH, NULL, 0);
+    } else
+        Debug::log(TRACE, "[pw] Reusing {} cached format params", cache.pods.size());
+
+    for (size_t i = 0; i < cache.pods.size(); ++i) {
+        params[i] = (const spa_pod*)cache.pods[i].data();
+    }
+
+    return cache.pods.size();
 }
 
 bool CPipewireConnection::buildModListFor(CPipewireConnection::SPWStream* stream, uint32_t drmFmt, uint64_t** mods, uint32_t* modCount) {
@@ -1078,7 +1536,189 @@ CPipewireConnection::SPWStream* CPipewireConnection::streamFromSession(CScreenco
     return nullptr;
 }
 
+static void writeCursorBitmap(spa_meta_cursor* cursor, spa_video_format format, uint32_t w, uint32_t h, const uint8_t* pixels) {
+    cursor->bitmap_offset = sizeof(spa_meta_cursor);
+
+    spa_meta_bitmap* bitmap = SPA_PTROFF(cursor, cursor->bitmap_offset, spa_meta_bitmap);
+    bitmap->format          = format;
+    bitmap->size.width      = w;
+    bitmap->size.height     = h;
+    bitmap->stride          = w * 4;
+    bitmap->offset          = sizeof(spa_meta_bitmap);
+
+    if (pixels)
+        memcpy(SPA_PTROFF(bitmap, bitmap->offset, void), pixels, w * h * 4);
+}
+
+// fills SPA_META_Cursor. The bitmap only goes out when it changed since the last one pipewire saw.
+static void fillCursorMeta(CPipewireConnection::SPWStream* pStream, spa_buffer* spaBuf) {
+    spa_meta* meta = spa_buffer_find_meta(spaBuf, SPA_META_Cursor);
+
+    if (!meta || meta->size < cursorMetaSize(0, 0))
+        return;
+
+    auto&            cursor = pStream->pSession->cursor;
+    spa_meta_cursor* pc     = (spa_meta_cursor*)meta->data;
+
+    cursor.dirty = false;
+
+    pc->id            = 1;
+    pc->flags         = 0;
+    pc->position.x    = cursor.x;
+    pc->position.y    = cursor.y;
+    pc->hotspot.x     = cursor.hotspotX;
+    pc->hotspot.y     = cursor.hotspotY;
+    pc->bitmap_offset = 0;
+
+    if (!cursor.visible) {
+        // an empty bitmap hides the cursor, the real one has to be resent once it's back
+        writeCursorBitmap(pc, SPA_VIDEO_FORMAT_BGRA, 0, 0, nullptr);
+        pStream->cursorSerial = 0;
+        return;
+    }
+
+    if (cursor.serial == pStream->cursorSerial || cursor.bitmap.empty())
+        return;
+
+    if (meta->size < cursorMetaSize(cursor.w, cursor.h)) {
+        Debug::log(TRACE, "[pw] cursor bitmap {}x{} doesn't fit the meta, skipping it", cursor.w, cursor.h);
+        return;
+    }
+
+    writeCursorBitmap(pc, pwFromDrmFourcc(cursor.fmt), cursor.w, cursor.h, cursor.bitmap.data());
+    pStream->cursorSerial = cursor.serial;
+}
+
+// hands the compositor's write fence to the consumer as the acquire point, and reserves the release point after it
+static void fillSyncMeta(SBuffer* pBuffer, spa_buffer* spaBuf) {
+    spa_meta_sync_timeline* sync = (spa_meta_sync_timeline*)spa_buffer_find_meta_data(spaBuf, SPA_META_SyncTimeline, sizeof(*sync));
+    if (!sync || !pBuffer)
+        return;
+
+    // no timeline to point into, see pwStreamAddBuffer
+    if (!pBuffer->timeline) {
+        *sync = {};
+        return;
+    }
+
+    const auto POINTS = pBuffer->timeline->nextFrame(pBuffer->fd[0], pBuffer->timelinePoint);
+
+    sync->acquire_point    = POINTS.acquire;
+    sync->release_point    = POINTS.release;
+    pBuffer->timelinePoint = POINTS.release;
+
+    Debug::log(TRACE, "[pw]  | sync acquire {} release {}", sync->acquire_point, sync->release_point);
+}
+
+bool CPipewireConnection::mapSHM(SBuffer* pBuffer) {
+    if (pBuffer->shmData)
+        return true;
+
+    pBuffer->shmData = mmap(nullptr, pBuffer->size[0], PROT_READ | PROT_WRITE, MAP_SHARED, pBuffer->fd[0], pBuffer->mapOffset);
+
+    if (pBuffer->shmData == MAP_FAILED) {
+        Debug::log(ERR, "[pw] couldn't map an shm buffer: {}", strerror(errno));
+        pBuffer->shmData = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+bool CPipewireConnection::updateTileDamage(SPWStream* pStream) {
+    static auto* const* PTILEDAMAGE = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:tile_damage")->getDataStaticPtr();
+
+    CPipewireLock       lock;
+
+    const auto          PSESSION = pStream->pSession;
+    const auto          PBUFFER  = pStream->currentPWBuffer;
+
+    // 1 for sources without damage of their own, 2 for every shm frame
+    if (**PTILEDAMAGE <= 0 || (**PTILEDAMAGE == 1 && PSESSION->backend->reportsDamage()))
+        return true;
+
+    if (!PBUFFER || PBUFFER->isDMABUF || PSESSION->sharingData.status != FRAME_READY)
+        return true;
+
+    const auto& SHM     = PSESSION->sharingData.frameInfoSHM;
+    const auto  PFORMAT = formatFromDrm(SHM.fmt);
+    if (!PFORMAT || PFORMAT->planes != 1 || SHM.stride * SHM.h > PBUFFER->size[0])
+        return true;
+
+    if (!mapSHM(PBUFFER))
+        return true;
+
+    std::vector<CTileDamage::SRect> damage;
+    if (!pStream->tileDamage.update((const uint8_t*)PBUFFER->shmData, SHM.w, SHM.h, SHM.stride, PFORMAT->bpp, damage, std::size(PSESSION->sharingData.damage)))
+        return false;
+
+    PSESSION->sharingData.damageCount = 0;
+    for (const auto& r : damage) {
+        PSESSION->sharingData.damage[PSESSION->sharingData.damageCount++] = {r.x, r.y, r.w, r.h};
+    }
+
+    Debug::log(TRACE, "[pw] tile damage: {} rects, first {}x{} at {},{}", damage.size(), damage[0].w, damage[0].h, damage[0].x, damage[0].y);
+
+    return true;
+}
+
+#ifdef XDPH_ENCODER
+void CPipewireConnection::feedEncoder(SPWStream* pStream, SBuffer* pBuffer) {
+    static auto* const* PBITRATE = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:encoder_bitrate")->getDataStaticPtr();
+
+    const auto          PSESSION = pStream->pSession;
+    const auto          PBUFFER  = pBuffer;
+    const auto&         DATA     = PSESSION->sharingData;
+
+    const uint32_t      W   = PBUFFER->isDMABUF ? DATA.frameInfoDMA.w : DATA.frameInfoSHM.w;
+    const uint32_t      H   = PBUFFER->isDMABUF ? DATA.frameInfoDMA.h : DATA.frameInfoSHM.h;
+    const uint32_t      FMT = PBUFFER->isDMABUF ? DATA.frameInfoDMA.fmt : DATA.frameInfoSHM.fmt;
+
+    // nobody is watching the encoded node, don't read the frame back
+    if (!pStream->encoder->wanted(W, H, DATA.framerate))
+        return;
+
+    std::vector<CVideoEncoder::SRect> damage;
+    for (uint32_t i = 0; i < DATA.damageCount; ++i) {
+        damage.push_back({DATA.damage[i].x, DATA.damage[i].y, DATA.damage[i].w, DATA.damage[i].h});
+    }
+
+    const auto BITRATE = (uint32_t)std::max(**PBITRATE, (Hyprlang::INT)100);
+
+    // pipewire can't free the buffer while this runs, so only the damaged rows are read. The conversion happens on the encoder's thread.
+    const auto [Y1, Y2] = pStream->encoder->rowsToRead(W, H, FMT, damage);
+    if (Y1 >= Y2)
+        return;
+
+    if (!PBUFFER->isDMABUF) {
+        if (DATA.frameInfoSHM.stride * H > PBUFFER->size[0] || !mapSHM(PBUFFER)) {
+            pStream->encoder->dropFrame();
+            return;
+        }
+
+        pStream->encoder->submit({(const uint8_t*)PBUFFER->shmData, DATA.frameInfoSHM.stride, 0, H}, W, H, FMT, damage, DATA.tvTimestampNs, DATA.framerate, BITRATE);
+        return;
+    }
+
+    // the driver detiles into a staging copy for us, only of the rows we ask for
+    uint32_t stride  = 0;
+    void*    mapData = nullptr;
+    void*    data    = PBUFFER->bo ? gbm_bo_map(PBUFFER->bo, 0, Y1, W, Y2 - Y1, GBM_BO_TRANSFER_READ, &stride, &mapData) : nullptr;
+
+    if (!data) {
+        Debug::log(TRACE, "[pw] couldn't map a dma buffer for the encoder");
+        pStream->encoder->dropFrame();
+        return;
+    }
+
+    pStream->encoder->submit({(const uint8_t*)data, stride, Y1, Y2}, W, H, FMT, damage, DATA.tvTimestampNs, DATA.framerate, BITRATE);
+
+    gbm_bo_unmap(PBUFFER->bo, mapData);
+}
+#endif
+
 void CPipewireConnection::enqueue(CScreencopyPortal::SSession* pSession) {
+    const auto BEGIN   = std::chrono::steady_clock::now();
     const auto PSTREAM = streamFromSession(pSession);
 
     if (!PSTREAM) {
@@ -1086,6 +1726,10 @@ void CPipewireConnection::enqueue(CScreencopyPortal::SSession* pSession) {
         return;
     }
 
+    // the metadata goes in under the lock, the encoder reads the frame back without it
+    std::optional<CPipewireLock> lock;
+    lock.emplace();
+
     Debug::log(TRACE, "[pw] enqueue on {}", (void*)PSTREAM);
 
     if (!PSTREAM->currentPWBuffer) {
@@ -1116,6 +1760,12 @@ void CPipewireConnection::enqueue(CScreencopyPortal::SSession* pSession) {
         Debug::log(TRACE, "[pw]  | meta transform {}", vt->transform);
     }
 
+    spa_meta_region* crop = (spa_meta_region*)spa_buffer_find_meta_data(spaBuf, SPA_META_VideoCrop, sizeof(*crop));
+    if (crop) {
+        crop->region = SPA_REGION(0, 0, pSession->sharingData.frameInfoDMA.w, pSession->sharingData.frameInfoDMA.h);
+        Debug::log(TRACE, "[pw]  | meta crop {}x{}", crop->region.size.width, crop->region.size.height);
+    }
+
     spa_meta* damage = spa_buffer_find_meta(spaBuf, SPA_META_VideoDamage);
     if (damage) {
         Debug::log(TRACE, "[pw]  | meta has damage");
@@ -1139,17 +1789,21 @@ void CPipewireConnection::enqueue(CScreencopyPortal::SSession* pSession) {
 
         if (damageCounter < pSession->sharingData.damageCount) {
             // TODO: merge damage properly
-            *damageRegion = SPA_REGION(0, 0, pSession->sharingData.frameInfoDMA.w, pSession->sharingData.frameInfoDMA.h);
+            *damageRegion = SPA_REGION(0, 0, pSession->sharingData.frameInfoSHM.w, pSession->sharingData.frameInfoSHM.h);
             Debug::log(TRACE, "[pw]  | damage overflow, damaged whole");
         }
     }
 
+    fillCursorMeta(PSTREAM, spaBuf);
+    fillSyncMeta(PSTREAM->currentPWBuffer, spaBuf);
+
     spa_data* datas = spaBuf->datas;
 
-    Debug::log(TRACE, "[pw]  | size {}x{}", PSTREAM->pSession->sharingData.frameInfoDMA.w, PSTREAM->pSession->sharingData.frameInfoDMA.h);
+    Debug::log(TRACE, "[pw]  | size {}x{}", PSTREAM->pSession->sharingData.frameInfoSHM.w, PSTREAM->pSession->sharingData.frameInfoSHM.h);
 
-    for (uint32_t plane = 0; plane < spaBuf->n_datas; plane++) {
+    for (uint32_t plane = 0; plane < imageDatas(PSTREAM->currentPWBuffer, spaBuf); plane++) {
         datas[plane].chunk->flags = CORRUPT ? SPA_CHUNK_FLAG_CORRUPTED : SPA_CHUNK_FLAG_NONE;
+        resetChunkSize(PSTREAM->currentPWBuffer, datas, plane);
 
         Debug::log(TRACE, "[pw]  | plane {}", plane);
         Debug::log(TRACE, "[pw]     | fd {}", datas[plane].fd);
@@ -1162,13 +1816,243 @@ void CPipewireConnection::enqueue(CScreencopyPortal::SSession* pSession) {
 
     Debug::log(TRACE, "[pw] --------------------------------- End enqueue");
 
-    pw_stream_queue_buffer(PSTREAM->stream, PSTREAM->currentPWBuffer->pwBuffer);
+#ifdef XDPH_ENCODER
+    if (PSTREAM->encoder) {
+        const auto PBUFFER = PSTREAM->currentPWBuffer;
+
+        lock.reset();
+
+        // only pwStreamRemoveBuffer takes it away from us, and it waits for this
+        std::lock_guard<std::mutex> guard(PSTREAM->encoderRead);
+
+        if (PSTREAM->currentPWBuffer == PBUFFER && !CORRUPT)
+            feedEncoder(PSTREAM, PBUFFER);
+        else
+            PSTREAM->encoder->dropFrame();
+    }
+
+    if (!lock)
+        lock.emplace();
+
+    if (!PSTREAM->currentPWBuffer) {
+        Debug::log(TRACE, "[pw] buffers were removed while the encoder read the frame");
+        return;
+    }
+#endif
+
+    queueReady(PSTREAM, PSTREAM->currentPWBuffer);
 
     PSTREAM->currentPWBuffer = nullptr;
+
+    pSession->stats.onEnqueue(std::chrono::steady_clock::now() - BEGIN);
+
+    sizeBufferPool(PSTREAM);
+}
+
+void CPipewireConnection::enqueueCursor(CScreencopyPortal::SSession* pSession) {
+    CPipewireLock lock;
+
+    const auto    PSTREAM = streamFromSession(pSession);
+
+    if (!PSTREAM || !PSTREAM->streamState)
+        return;
+
+    const auto PWBUF = pw_stream_dequeue_buffer(PSTREAM->stream);
+
+    if (!PWBUF) {
+        Debug::log(TRACE, "[pw] no buffer for a cursor update on {}", (void*)PSTREAM);
+        return;
+    }
+
+    Debug::log(TRACE, "[pw] cursor update on {}", (void*)PSTREAM);
+
+    spa_buffer*      spaBuf = PWBUF->buffer;
+
+    spa_meta_header* header = (spa_meta_header*)spa_buffer_find_meta_data(spaBuf, SPA_META_Header, sizeof(*header));
+    if (header) {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        header->pts        = now.tv_sec * SPA_NSEC_PER_SEC + now.tv_nsec;
+        header->flags      = 0;
+        header->seq        = PSTREAM->seq++;
+        header->dts_offset = 0;
+    }
+
+    spa_meta* damage = spa_buffer_find_meta(spaBuf, SPA_META_VideoDamage);
+    if (damage)
+        *(spa_region*)spa_meta_first(damage) = SPA_REGION(0, 0, 0, 0);
+
+    fillCursorMeta(PSTREAM, spaBuf);
+    fillSyncMeta((SBuffer*)PWBUF->user_data, spaBuf);
+
+    // an empty chunk tells the consumer there's no new frame, only metadata
+    for (uint32_t plane = 0; plane < imageDatas((SBuffer*)PWBUF->user_data, spaBuf); plane++) {
+        spaBuf->datas[plane].chunk->size  = 0;
+        spaBuf->datas[plane].chunk->flags = SPA_CHUNK_FLAG_NONE;
+    }
+
+    queueReady(PSTREAM, (SBuffer*)PWBUF->user_data);
+}
+
+void CPipewireConnection::queueReady(SPWStream* pStream, SBuffer* pBuffer) {
+    // the pipewire thread picks it up in queueReadyBuffers
+    if (pStream->readyBuffers.push(pBuffer))
+        pw_loop_signal_event(g_pPortalManager->m_sPipewire.loop, m_pQueueEvent);
+    else {
+        Debug::log(ERR, "[pw] ready queue full, queueing directly");
+        pw_stream_queue_buffer(pStream->stream, pBuffer->pwBuffer);
+        pw_stream_trigger_process(pStream->stream);
+    }
+}
+
+// Advances our clock to the frame in buffer. The graph schedules on it when we're the driver, so it has to follow the
+// compositor's cadence: the position is the frame's timestamp, and rate_diff tracks how far the actual frame intervals
+// are off from the nominal ones, i.e. the output's real refresh rate against the negotiated one.
+static void updateDriverClock(CPipewireConnection::SPWStream* pStream, spa_buffer* spaBuf) {
+    spa_io_clock* clock = pStream->driver.clock;
+
+    if (!clock || !pw_stream_is_driving(pStream->stream))
+        return;
+
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    const uint64_t   NOW     = SPA_TIMESPEC_TO_NSEC(&now);
+    spa_meta_header* header  = (spa_meta_header*)spa_buffer_find_meta_data(spaBuf, SPA_META_Header, sizeof(*header));
+    const uint64_t   PTS     = header && header->pts > 0 ? header->pts : NOW;
+    const uint64_t   NOMINAL = SPA_NSEC_PER_SEC / std::max(pStream->pSession->sharingData.framerate, 1u);
+
+    if (pStream->driver.lastPts > 0 && PTS > pStream->driver.lastPts) {
+        const uint64_t INTERVAL = PTS - pStream->driver.lastPts;
+
+        // only a steady cadence says something about the output's clock, idle gaps and dropped frames don't
+        if (INTERVAL > NOMINAL / 2 && INTERVAL < NOMINAL * 3 / 2)
+            pStream->driver.rateDiff = pStream->driver.rateDiff * (1.0 - RATE_DIFF_WEIGHT) + ((double)NOMINAL / INTERVAL) * RATE_DIFF_WEIGHT;
+    }
+
+    pStream->driver.lastPts = PTS;
+
+    clock->nsec      = NOW;
+    clock->rate      = SPA_FRACTION(1, SPA_NSEC_PER_SEC);
+    clock->position  = PTS;
+    clock->duration  = NOMINAL;
+    clock->delay     = NOW > PTS ? NOW - PTS : 0;
+    clock->rate_diff = pStream->driver.rateDiff;
+    clock->next_nsec = NOW + (uint64_t)(NOMINAL / pStream->driver.rateDiff);
+}
+
+// how long a frame took from the compositor to pipewire. The other end of it is measured by hyprland-latency-probe.
+static void recordQueueDelay(CPipewireConnection::SPWStream* pStream, spa_buffer* spaBuf) {
+    spa_meta_header* header = (spa_meta_header*)spa_buffer_find_meta_data(spaBuf, SPA_META_Header, sizeof(*header));
+
+    // cursor-only updates have no frame behind them
+    if (!header || header->pts <= 0 || spaBuf->n_datas == 0 || spaBuf->datas[0].chunk->size == 0)
+        return;
+
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const int64_t NOW = SPA_TIMESPEC_TO_NSEC(&now);
+
+    if (NOW > header->pts)
+        pStream->pSession->stats.onQueued(std::chrono::nanoseconds(NOW - header->pts));
+}
+
+static bool hasFrame(SBuffer* pBuffer) {
+    const auto SPABUF = pBuffer->pwBuffer->buffer;
+    return SPABUF->n_datas > 0 && SPABUF->datas[0].chunk->size > 0;
+}
+
+// a buffer the consumer will never see. Nobody else will signal its release point.
+static void releaseUnconsumed(CPipewireConnection::SPWStream* pStream, SBuffer* pBuffer) {
+    if (pBuffer->timeline && pBuffer->timelinePoint > 0)
+        pBuffer->timeline->signal(pBuffer->timelinePoint);
+
+    // it might have carried the cursor bitmap
+    pStream->cursorSerial = 0;
+}
+
+static void queueBuffer(CPipewireConnection::SPWStream* pStream, SBuffer* pBuffer) {
+    Debug::log(TRACE, "[pw] queueing buffer {} on {}", (void*)pBuffer, (void*)pStream);
+    recordQueueDelay(pStream, pBuffer->pwBuffer->buffer);
+    pBuffer->queueSeq = ++pStream->queueSeq;
+    pBuffer->queuedAt = std::chrono::steady_clock::now();
+    pw_stream_queue_buffer(pStream->stream, pBuffer->pwBuffer);
+}
+
+// drops the frames pipewire still has queued for the consumer, a newer one replaces them
+static void flushStaleBuffers(CPipewireConnection::SPWStream* pStream) {
+    pw_time time = {};
+    if (pw_stream_get_time_n(pStream->stream, &time, sizeof(time)) != 0 || time.queued_buffers == 0)
+        return;
+
+    Debug::log(TRACE, "[pw] dropping {} stale frames on {}", time.queued_buffers, (void*)pStream);
+
+    // the queue holds the most recently queued ones
+    for (auto& b : pStream->buffers) {
+        if (b->queueSeq > pStream->queueSeq - time.queued_buffers)
+            releaseUnconsumed(pStream, b.get());
+    }
+
+    pw_stream_flush(pStream->stream, false);
+    pStream->pSession->stats.onFrameDropped();
+}
+
+void CPipewireConnection::queueReadyBuffers() {
+    const bool LATEST = latestFrameOnly();
+
+    for (auto& s : m_vStreams) {
+        SBuffer* last = nullptr;
+
+        if (s->readyStale)
+            dropReadyBuffers(s.get());
+
+        while (const auto PBUFFER = s->readyBuffers.pop()) {
+            if (!LATEST) {
+                queueBuffer(s.get(), *PBUFFER);
+                last = *PBUFFER;
+                continue;
+            }
+
+            // only the newest frame goes out. Cursor-only buffers never replace a frame.
+            if (last && hasFrame(last) && !hasFrame(*PBUFFER))
+                queueBuffer(s.get(), last);
+            else if (last) {
+                releaseUnconsumed(s.get(), last);
+                s->spareBuffers.push_back(last);
+            }
+
+            last = *PBUFFER;
+        }
+
+        if (!last)
+            continue;
+
+        if (LATEST) {
+            if (hasFrame(last))
+                flushStaleBuffers(s.get());
+            queueBuffer(s.get(), last);
+        }
+
+        // one cycle for everything that was ready, on the newest frame's timing
+        updateDriverClock(s.get(), last->pwBuffer->buffer);
+        pw_stream_trigger_process(s->stream);
+    }
+}
+
+// how long the buffer was gone, from queueing it until it can be captured into again. See sizeBufferPool.
+static void recordHoldTime(CPipewireConnection::SPWStream* pStream, SBuffer* pBuffer) {
+    if (!pBuffer || pBuffer->queuedAt == std::chrono::steady_clock::time_point{})
+        return;
+
+    pStream->sizing.maxHold = std::max(pStream->sizing.maxHold, std::chrono::steady_clock::now() - pBuffer->queuedAt);
+    pBuffer->queuedAt       = {};
 }
 
 void CPipewireConnection::dequeue(CScreencopyPortal::SSession* pSession) {
-    const auto PSTREAM = streamFromSession(pSession);
+    CPipewireLock lock;
+
+    const auto    PSTREAM = streamFromSession(pSession);
 
     if (!PSTREAM) {
         Debug::log(ERR, "[pw] Attempted dequeue on invalid session??");
@@ -1177,17 +2061,37 @@ void CPipewireConnection::dequeue(CScreencopyPortal::SSession* pSession) {
 
     Debug::log(TRACE, "[pw] dequeue on {}", (void*)PSTREAM);
 
-    const auto PWBUF = pw_stream_dequeue_buffer(PSTREAM->stream);
+    // frames that were replaced before pipewire got them, see queueReadyBuffers
+    if (!PSTREAM->spareBuffers.empty()) {
+        PSTREAM->currentPWBuffer = PSTREAM->spareBuffers.back();
+        PSTREAM->spareBuffers.pop_back();
+        return;
+    }
 
-    if (!PWBUF) {
-        Debug::log(TRACE, "[pw] dequeue failed");
-        PSTREAM->currentPWBuffer = nullptr;
+    // set aside by an earlier dequeue, the consumer may have caught up since
+    if (const auto PREADY = PSTREAM->releasePending.take()) {
+        recordHoldTime(PSTREAM, PREADY);
+        PSTREAM->currentPWBuffer = PREADY;
         return;
     }
 
-    const auto PBUF = (SBuffer*)PWBUF->user_data;
+    // a buffer whose release can't be waited on yet is set aside, another free one may be usable right away. Capturing into
+    // it anyway would race the consumer, so if none is, the frame is skipped.
+    while (const auto PWBUF = pw_stream_dequeue_buffer(PSTREAM->stream)) {
+        const auto PBUF = (SBuffer*)PWBUF->user_data;
+
+        if (!PBUF || PSTREAM->releasePending.admit(PBUF)) {
+            recordHoldTime(PSTREAM, PBUF);
+            PSTREAM->currentPWBuffer = PBUF;
+            return;
+        }
 
-    PSTREAM->currentPWBuffer = PBUF;
+        Debug::log(TRACE, "[pw] release point {} can't be waited on yet, setting the buffer aside", PBUF->timelinePoint);
+    }
+
+    Debug::log(TRACE, "[pw] dequeue failed, {} buffers wait for their release", PSTREAM->releasePending.size());
+    PSTREAM->sizing.starved++;
+    PSTREAM->currentPWBuffer = nullptr;
 }
 
 std::unique_ptr<SBuffer> CPipewireConnection::createBuffer(CPipewireConnection::SPWStream* pStream, bool dmabuf) {
@@ -1198,17 +2102,17 @@ std::unique_ptr<SBuffer> CPipewireConnection::createBuffer(CPipewireConnection::
     Debug::log(TRACE, "[pw] createBuffer: type {}", dmabuf ? "dma" : "shm");
 
     if (dmabuf) {
-        pBuffer->w   = pStream->pSession->sharingData.frameInfoDMA.w;
-        pBuffer->h   = pStream->pSession->sharingData.frameInfoDMA.h;
+        pBuffer->w   = pStream->dmaSize.w;
+        pBuffer->h   = pStream->dmaSize.h;
         pBuffer->fmt = pStream->pSession->sharingData.frameInfoDMA.fmt;
 
         uint32_t flags = GBM_BO_USE_RENDERING;
 
         if (pStream->pwVideoInfo.modifier != DRM_FORMAT_MOD_INVALID) {
             uint64_t* mods = (uint64_t*)&pStream->pwVideoInfo.modifier;
-            pBuffer->bo    = gbm_bo_create_with_modifiers2(g_pPortalManager->m_sWaylandConnection.gbmDevice, pBuffer->w, pBuffer->h, pBuffer->fmt, mods, 1, flags);
+            pBuffer->bo    = gbm_bo_create_with_modifiers2(pStream->device->gbm, pBuffer->w, pBuffer->h, pBuffer->fmt, mods, 1, flags);
         } else {
-            pBuffer->bo = gbm_bo_create(g_pPortalManager->m_sWaylandConnection.gbmDevice, pBuffer->w, pBuffer->h, pBuffer->fmt, flags);
+            pBuffer->bo = gbm_bo_create(pStream->device->gbm, pBuffer->w, pBuffer->h, pBuffer->fmt, flags);
         }
 
         if (!pBuffer->bo) {
@@ -1258,31 +2162,68 @@ std::unique_ptr<SBuffer> CPipewireConnection::createBuffer(CPipewireConnection::
             return nullptr;
         }
     } else {
+        const auto& SHM  = pStream->pSession->sharingData.frameInfoSHM;
+        auto&       POOL = pStream->shmPool;
 
-        pBuffer->w   = pStream->pSession->sharingData.frameInfoSHM.w;
-        pBuffer->h   = pStream->pSession->sharingData.frameInfoSHM.h;
-        pBuffer->fmt = pStream->pSession->sharingData.frameInfoSHM.fmt;
+        pBuffer->w   = SHM.w;
+        pBuffer->h   = SHM.h;
+        pBuffer->fmt = SHM.fmt;
 
-        pBuffer->planeCount = 1;
-        pBuffer->size[0]    = pStream->pSession->sharingData.frameInfoSHM.size;
-        pBuffer->stride[0]  = pStream->pSession->sharingData.frameInfoSHM.stride;
-        pBuffer->offset[0]  = 0;
-        pBuffer->fd[0]      = anonymous_shm_open();
+        // all shm buffers of a stream are page aligned slots of one memfd, behind a single wl_shm_pool
+        const size_t PAGESIZE = sysconf(_SC_PAGESIZE);
+        const size_t SLOTSIZE = (SHM.size + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
 
-        if (pBuffer->fd[0] == -1) {
-            Debug::log(ERR, "[screencopy] anonymous_shm_open failed");
-            return nullptr;
+        if (POOL.fd >= 0 && POOL.slotSize != SLOTSIZE) {
+            if (!pStream->buffers.empty()) {
+                Debug::log(ERR, "[screencopy] shm buffer size changed with buffers still alive");
+                return nullptr;
+            }
+
+            resetShmPool(pStream);
+        }
+
+        if (POOL.fd < 0) {
+            POOL.fd = anonymous_shm_open();
+
+            if (POOL.fd < 0) {
+                Debug::log(ERR, "[screencopy] anonymous_shm_open failed");
+                return nullptr;
+            }
+
+            POOL.slotSize = SLOTSIZE;
         }
 
-        if (ftruncate(pBuffer->fd[0], pBuffer->size[0]) < 0) {
+        const size_t OFFSET   = POOL.slots * SLOTSIZE;
+        const size_t POOLSIZE = OFFSET + SLOTSIZE;
+
+        if (ftruncate(POOL.fd, POOLSIZE) < 0) {
             Debug::log(ERR, "[screencopy] ftruncate failed");
             return nullptr;
         }
 
-        pBuffer->wlBuffer = import_wl_shm_buffer(pBuffer->fd[0], wlSHMFromDrmFourcc(pStream->pSession->sharingData.frameInfoSHM.fmt), pStream->pSession->sharingData.frameInfoSHM.w,
-                                                 pStream->pSession->sharingData.frameInfoSHM.h, pStream->pSession->sharingData.frameInfoSHM.stride);
+        if (!POOL.pool)
+            POOL.pool = makeShared<CCWlShmPool>(g_pPortalManager->m_sWaylandConnection.shm->sendCreatePool(POOL.fd, POOLSIZE));
+        else
+            POOL.pool->sendResize(POOLSIZE);
+
+        pBuffer->planeCount = 1;
+        pBuffer->size[0]    = SHM.size;
+        pBuffer->stride[0]  = SHM.stride;
+        pBuffer->offset[0]  = 0;
+        pBuffer->mapOffset  = OFFSET;
+        pBuffer->fd[0]      = fcntl(POOL.fd, F_DUPFD_CLOEXEC, 0);
+
+        if (pBuffer->fd[0] < 0) {
+            Debug::log(ERR, "[screencopy] couldn't dup the shm pool fd");
+            return nullptr;
+        }
+
+        POOL.slots++;
+
+        pBuffer->wlBuffer = makeShared<CCWlBuffer>(POOL.pool->sendCreateBuffer(OFFSET, SHM.w, SHM.h, SHM.stride, wlSHMFromDrmFourcc(SHM.fmt)));
         if (!pBuffer->wlBuffer) {
-            Debug::log(ERR, "[screencopy] import_wl_shm_buffer failed");
+            Debug::log(ERR, "[screencopy] wl_shm_pool.create_buffer failed");
+            close(pBuffer->fd[0]);
             return nullptr;
         }
     }
@@ -1290,19 +2231,297 @@ std::unique_ptr<SBuffer> CPipewireConnection::createBuffer(CPipewireConnection::
     return pBuffer;
 }
 
+SP<CCWlBuffer> CPipewireConnection::captureTarget(SBuffer* pBuffer, uint32_t w, uint32_t h) {
+    if (w == pBuffer->w && h == pBuffer->h)
+        return pBuffer->wlBuffer;
+
+    if (pBuffer->view && pBuffer->viewW == w && pBuffer->viewH == h)
+        return pBuffer->view;
+
+    // only dma buffers get headroom, see buildFormatsFor
+    if (!pBuffer->isDMABUF || w > pBuffer->w || h > pBuffer->h) {
+        Debug::log(ERR, "[pw] can't capture {}x{} into a {}x{} buffer", w, h, pBuffer->w, pBuffer->h);
+        return nullptr;
+    }
+
+    Debug::log(TRACE, "[pw] new {}x{} view into {}x{} buffer {}", w, h, pBuffer->w, pBuffer->h, (void*)pBuffer);
+
+    // same memory and strides, the compositor only sees the top-left w x h of it
+    auto           params = makeShared<CCZwpLinuxBufferParamsV1>(g_pPortalManager->m_sWaylandConnection.linuxDmabuf->sendCreateParams());
+    const uint64_t MOD    = gbm_bo_get_modifier(pBuffer->bo);
+
+    for (int plane = 0; plane < pBuffer->planeCount; plane++) {
+        params->sendAdd(pBuffer->fd[plane], plane, pBuffer->offset[plane], pBuffer->stride[plane], MOD >> 32, MOD & 0xffffffff);
+    }
+
+    pBuffer->view  = makeShared<CCWlBuffer>(params->sendCreateImmed(w, h, pBuffer->fmt, /* flags */ (zwpLinuxBufferParamsV1Flags)0));
+    pBuffer->viewW = w;
+    pBuffer->viewH = h;
+
+    return pBuffer->view;
+}
+
+void CPipewireConnection::scheduleParamUpdate(SPWStream* pStream, uint32_t fmt, uint32_t w, uint32_t h) {
+    auto&      reneg = pStream->reneg;
+    const auto NOW   = std::chrono::steady_clock::now();
+
+    if (!reneg.needed) {
+        reneg.needed = true;
+        reneg.first  = NOW;
+        reneg.last   = NOW;
+        pStream->pSession->stats.onRenegotiationRequested();
+    } else if (reneg.fmt != fmt || reneg.w != w || reneg.h != h)
+        reneg.last = NOW;
+
+    reneg.fmt = fmt;
+    reneg.w   = w;
+    reneg.h   = h;
+
+    if (reneg.armed)
+        return;
+
+    reneg.armed = true;
+    g_pPortalManager->addTimer({RENEG_DEBOUNCE_MS, [self = pStream->pSession->self]() {
+                                    if (self)
+                                        g_pPortalManager->m_sPortals.screencopy->m_pPipewire->flushParamUpdate(self.get());
+                                }});
+}
+
+void CPipewireConnection::cancelParamUpdate(SPWStream* pStream) {
+    if (!pStream->reneg.needed)
+        return;
+
+    Debug::log(TRACE, "[pw] param update on {} not needed anymore", (void*)pStream);
+    pStream->reneg.needed = false;
+}
+
+void CPipewireConnection::flushParamUpdate(CScreencopyPortal::SSession* pSession) {
+    const auto PSTREAM = streamFromSession(pSession);
+
+    if (!PSTREAM)
+        return;
+
+    auto& reneg = PSTREAM->reneg;
+    reneg.armed = false;
+
+    if (!reneg.needed)
+        return;
+
+    const auto NOW     = std::chrono::steady_clock::now();
+    const auto QUIETMS = std::chrono::duration_cast<std::chrono::microseconds>(NOW - reneg.last).count() / 1000.F;
+    const auto WAITMS  = std::chrono::duration_cast<std::chrono::microseconds>(NOW - reneg.first).count() / 1000.F;
+
+    // still changing, wait for it to settle. But not forever, a continuous resize still has to show up.
+    if (QUIETMS < RENEG_DEBOUNCE_MS && WAITMS < RENEG_MAX_DELAY_MS) {
+        reneg.armed = true;
+        g_pPortalManager->addTimer({std::min(RENEG_DEBOUNCE_MS - QUIETMS, RENEG_MAX_DELAY_MS - WAITMS), [self = pSession->self]() {
+                                        if (self)
+                                            g_pPortalManager->m_sPortals.screencopy->m_pPipewire->flushParamUpdate(self.get());
+                                    }});
+        return;
+    }
+
+    Debug::log(LOG, "[pw] Renegotiating stream {} after {:.1f}ms", (void*)PSTREAM, WAITMS);
+
+    reneg.needed = false;
+    pSession->stats.onRenegotiation();
+    updateStreamParam(PSTREAM);
+}
+
+// Like the formats, the params are kept serialized and only rebuilt when what they're built from changes
+void CPipewireConnection::updateBufferParams(SPWStream* pStream) {
+    CPipewireLock lock;
+
+    Debug::log(TRACE, "[pw] update buffer params, {} buffers", pStream->sizing.wanted);
+
+    const SPWStream::SBufferKey KEY = {
+        .dma      = pStream->isDMA,
+        .sync     = pStream->isDMA && explicitSyncAvailable(pStream),
+        .headroom = pStream->isDMA && pStream->headroom,
+        .cursor   = pStream->pSession->cursorMode == METADATA,
+        .size     = pStream->pSession->sharingData.frameInfoSHM.size,
+        .stride   = pStream->pSession->sharingData.frameInfoSHM.stride,
+        .buffers  = pStream->sizing.wanted,
+    };
+
+    auto& cache = pStream->bufferCache;
+
+    if (cache.pods.empty() || cache.key != KEY) {
+        cache.key = KEY;
+        cache.pods.clear();
+
+        spa_pod_dynamic_builder dynBuilder;
+        uint8_t                 params_buffer[1024];
+
+        // builds a param and keeps a copy of it
+        const auto addPod = [&](const auto& build) {
+            spa_pod_dynamic_builder_init(&dynBuilder, params_buffer, sizeof(params_buffer), 2048);
+            const auto POD = (const spa_pod*)build(&dynBuilder.b);
+            assert(POD != NULL);
+            cache.pods.emplace_back((uint8_t*)POD, (uint8_t*)POD + SPA_POD_SIZE(POD));
+            spa_pod_dynamic_builder_clean(&dynBuilder);
+        };
+
+        uint32_t blocks    = 1;
+        uint32_t data_type = KEY.dma ? 1 << SPA_DATA_DmaBuf : 1 << SPA_DATA_MemFd;
+
+        // with explicit sync, two extra blocks carry the acquire and release syncobj. Consumers without it take the plain one.
+        if (KEY.sync)
+            addPod([&](spa_pod_builder* b) { return build_buffer(b, blocks + 2, KEY.size, KEY.stride, data_type, 1 << SPA_META_SyncTimeline, KEY.buffers); });
+
+        addPod([&](spa_pod_builder* b) { return build_buffer(b, blocks, KEY.size, KEY.stride, data_type, 0, KEY.buffers); });
+
+        addPod([](spa_pod_builder* b) {
+            return spa_pod_builder_add_object(b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header), SPA_PARAM_META_size,
+                                              SPA_POD_Int(sizeof(struct spa_meta_header)));
+        });
+
+        addPod([](spa_pod_builder* b) {
+            return spa_pod_builder_add_object(b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoTransform), SPA_PARAM_META_size,
+                                              SPA_POD_Int(sizeof(struct spa_meta_videotransform)));
+        });
+
+        addPod([](spa_pod_builder* b) {
+            return spa_pod_builder_add_object(b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage), SPA_PARAM_META_size,
+                                              SPA_POD_CHOICE_RANGE_Int(sizeof(struct spa_meta_region) * 4, sizeof(struct spa_meta_region) * 1, sizeof(struct spa_meta_region) * 4));
+        });
+
+        if (KEY.sync)
+            addPod([](spa_pod_builder* b) {
+                return spa_pod_builder_add_object(b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_SyncTimeline), SPA_PARAM_META_size,
+                                                  SPA_POD_Int(sizeof(struct spa_meta_sync_timeline)));
+            });
+
+        if (KEY.headroom)
+            addPod([](spa_pod_builder* b) {
+                return spa_pod_builder_add_object(b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoCrop), SPA_PARAM_META_size,
+                                                  SPA_POD_Int(sizeof(struct spa_meta_region)));
+            });
+
+        if (KEY.cursor)
+            addPod([](spa_pod_builder* b) {
+                return spa_pod_builder_add_object(b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Cursor), SPA_PARAM_META_size,
+                                                  SPA_POD_CHOICE_RANGE_Int(cursorMetaSize(64, 64), cursorMetaSize(1, 1), cursorMetaSize(MAX_CURSOR_SIZE, MAX_CURSOR_SIZE)));
+            });
+    } else
+        Debug::log(TRACE, "[pw] Reusing {} cached buffer params", cache.pods.size());
+
+    const spa_pod* params[8];
+    for (size_t i = 0; i < cache.pods.size(); ++i) {
+        params[i] = (const spa_pod*)cache.pods[i].data();
+    }
+
+    pw_stream_update_params(pStream->stream, params, cache.pods.size());
+}
+
+// Sizes the buffer pool from how long the consumer holds on to a buffer, as seen by dequeue: at the framerate, that many
+// frames go out before one comes back, plus the one being captured into. Growing reacts to the first starved frame,
+// shrinking waits for a whole window where fewer would have done, so a consumer hovering around a boundary doesn't make
+// us reallocate all the time. Called after enqueue, when we hold no buffer.
+void CPipewireConnection::sizeBufferPool(SPWStream* pStream) {
+    auto&          sizing = pStream->sizing;
+    const auto     NOW    = std::chrono::steady_clock::now();
+    const uint32_t TOTAL  = pStream->buffers.size();
+    const uint32_t MAX    = std::max(MAX_ADAPTIVE_BUFFERS, (uint32_t)XDPH_PWR_BUFFERS);
+    const double   HOLDS  = std::chrono::duration<double>(sizing.maxHold).count() * std::max(pStream->pSession->sharingData.framerate, 1u);
+    const uint32_t TARGET = std::clamp((uint32_t)std::ceil(HOLDS) + BUFFERS_IN_FLIGHT, (uint32_t)XDPH_PWR_BUFFERS_MIN, MAX);
+
+    // the consumer picked its own count, nothing to adapt
+    if (TOTAL != sizing.wanted || pStream->reneg.needed)
+        return;
+
+    if (sizing.windowStart == std::chrono::steady_clock::time_point{})
+        sizing.windowStart = NOW;
+
+    if (std::chrono::duration_cast<std::chrono::milliseconds>(NOW - sizing.lastChange).count() < BUFFER_RESIZE_MIN_MS)
+        return;
+
+    uint32_t wanted = TOTAL;
+
+    // a starved frame means the hold time grew past what we have, at least one more
+    if (sizing.starved > 0)
+        wanted = std::min(std::max(TOTAL + 1, TARGET), MAX);
+    else if (std::chrono::duration_cast<std::chrono::milliseconds>(NOW - sizing.windowStart).count() >= BUFFER_SHRINK_WINDOW_MS) {
+        wanted             = std::min(TARGET, TOTAL);
+        sizing.maxHold     = {};
+        sizing.windowStart = NOW;
+    }
+
+    if (wanted == TOTAL)
+        return;
+
+    Debug::log(LOG, "[pw] Resizing the buffer pool of {} from {} to {}, buffers were held for up to {}ms, {} frames starved", (void*)pStream, TOTAL, wanted,
+               std::chrono::duration_cast<std::chrono::milliseconds>(sizing.maxHold).count(), sizing.starved);
+
+    sizing.wanted      = wanted;
+    sizing.lastChange  = NOW;
+    sizing.windowStart = NOW;
+    sizing.maxHold     = {};
+    sizing.starved     = 0;
+
+    pStream->pSession->stats.onRenegotiation();
+    updateBufferParams(pStream);
+}
+
+// The consumer paused us. Nothing is captured until it resumes, and after a grace period the pool is trimmed to the minimum,
+// so a preview that's hidden for long doesn't keep a full set of buffers around. The format stays negotiated, resuming
+// only has to bring the buffers back.
+void CPipewireConnection::pauseStream(SPWStream* pStream) {
+    if (pStream->paused.active)
+        return;
+
+    Debug::log(TRACE, "[pw] Stream {} paused", (void*)pStream);
+
+    pStream->paused.active = true;
+    pStream->paused.seq++;
+
+    removeSessionFrameCallbacks(pStream->pSession);
+    g_pPortalManager->m_sPortals.screencopy->m_pScheduler->remove(pStream->pSession);
+
+    g_pPortalManager->addTimer({PAUSED_TRIM_MS, [self = pStream->pSession->self, SEQ = pStream->paused.seq]() {
+                                    if (!self)
+                                        return;
+
+                                    const auto PPIPEWIRE = g_pPortalManager->m_sPortals.screencopy->m_pPipewire.get();
+                                    const auto PSTREAM   = PPIPEWIRE->streamFromSession(self.get());
+
+                                    if (!PSTREAM || !PSTREAM->paused.active || PSTREAM->paused.seq != SEQ || PSTREAM->buffers.size() <= XDPH_PWR_BUFFERS_MIN)
+                                        return;
+
+                                    Debug::log(LOG, "[pw] Stream {} paused for {}ms, trimming {} buffers to {}", (void*)PSTREAM, PAUSED_TRIM_MS, PSTREAM->buffers.size(),
+                                               XDPH_PWR_BUFFERS_MIN);
+
+                                    PSTREAM->paused.trimmed       = true;
+                                    PSTREAM->paused.buffersBefore = PSTREAM->sizing.wanted;
+                                    PSTREAM->sizing.wanted        = XDPH_PWR_BUFFERS_MIN;
+                                    PPIPEWIRE->updateBufferParams(PSTREAM);
+                                }});
+}
+
+void CPipewireConnection::resumeStream(SPWStream* pStream) {
+    if (!pStream->paused.active)
+        return;
+
+    Debug::log(TRACE, "[pw] Stream {} resumed", (void*)pStream);
+
+    pStream->paused.active = false;
+
+    if (!pStream->paused.trimmed)
+        return;
+
+    pStream->paused.trimmed    = false;
+    pStream->sizing.wanted     = pStream->paused.buffersBefore;
+    pStream->sizing.lastChange = std::chrono::steady_clock::now();
+    updateBufferParams(pStream);
+}
+
 void CPipewireConnection::updateStreamParam(SPWStream* pStream) {
-    Debug::log(TRACE, "[pw] update stream params");
+    CPipewireLock lock;
 
-    uint8_t                 paramsBuf[2][1024];
-    spa_pod_dynamic_builder dynBuilder[2];
-    spa_pod_dynamic_builder_init(&dynBuilder[0], paramsBuf[0], sizeof(paramsBuf[0]), 2048);
-    spa_pod_dynamic_builder_init(&dynBuilder[1], paramsBuf[1], sizeof(paramsBuf[1]), 2048);
-    const spa_pod*   params[2];
+    Debug::log(TRACE, "[pw] update stream params");
 
-    spa_pod_builder* builder[2] = {&dynBuilder[0].b, &dynBuilder[1].b};
-    uint32_t         n_params   = buildFormatsFor(builder, params, pStream);
+    const spa_pod* params[2];
+    uint32_t       n_params = buildFormatsFor(params, pStream);
 
     pw_stream_update_params(pStream->stream, params, n_params);
-    spa_pod_dynamic_builder_clean(&dynBuilder[0]);
-    spa_pod_dynamic_builder_clean(&dynBuilder[1]);
 }
@@ -2,6 +2,8 @@
 
 #include "wlr-screencopy-unstable-v1.hpp"
 #include "hyprland-toplevel-export-v1.hpp"
+#include "ext-image-copy-capture-v1.hpp"
+#include "ext-image-capture-source-v1.hpp"
 #include <hyprutils/memory/UniquePtr.hpp>
 #include <hyprutils/memory/WeakPtr.hpp>
 #include <sdbus-c++/sdbus-c++.h>
@@ -9,7 +11,13 @@
 #include <gbm.h>
 #include "../shared/Session.hpp"
 #include "../dbusDefines.hpp"
+#include "../helpers/SPSCQueue.hpp"
+#include "../helpers/FrameStats.hpp"
+#include "../helpers/SyncTimeline.hpp"
+#include "../helpers/TileDamage.hpp"
 #include <chrono>
+#include <mutex>
+#include <optional>
 
 enum cursorModes {
     HIDDEN   = 1,
@@ -23,6 +31,14 @@ enum sourceTypes {
     VIRTUAL = 4,
 };
 
+enum eStartStatus {
+    START_NONE = 0,
+    START_PROBING,    // waiting for the buffer constraints of the first frame
+    START_CONNECTING, // waiting for pipewire to give us a node id
+    START_DONE,
+    START_FAILED,
+};
+
 enum frameStatus {
     FRAME_NONE = 0,
     FRAME_QUEUED,
@@ -35,6 +51,9 @@ struct pw_context;
 struct pw_core;
 struct pw_stream;
 struct pw_buffer;
+struct spa_source;
+struct SDMABUFDevice;
+class CVideoEncoder;
 
 struct SBuffer {
     bool           isDMABUF = false;
@@ -43,27 +62,57 @@ struct SBuffer {
 
     int            fd[4];
     uint32_t       size[4], stride[4], offset[4];
+    uint32_t       mapOffset = 0;
 
     gbm_bo*        bo = nullptr;
 
     SP<CCWlBuffer> wlBuffer = nullptr;
     pw_buffer*     pwBuffer = nullptr;
+
+    // the top-left viewW x viewH of the buffer, for frames smaller than it. See CPipewireConnection::captureTarget
+    SP<CCWlBuffer> view  = nullptr;
+    uint32_t       viewW = 0, viewH = 0;
+
+    // what changed since a capture last wrote into it, as a bounding box. ext-image-copy-capture wants it with every capture, see CExtCaptureBackend
+    struct {
+        bool    full = true;                    // never captured into, or the capture failed
+        int32_t x1 = 0, y1 = 0, x2 = 0, y2 = 0; // empty if x1 >= x2
+    } damage;
+
+    // shm only, mapped on first use. See CPipewireConnection::mapSHM
+    void* shmData = nullptr;
+
+    // explicit sync with the consumer, when negotiated. Every frame takes the next two points for acquire and release.
+    // Without a timeline the datas for it are still there, empty, and the consumer syncs implicitly.
+    std::unique_ptr<ISyncTimeline> timeline;
+    uint64_t                       timelinePoint = 0;
+
+    // CPipewireConnection::SPWStream::queueSeq when it was last queued, and when that was
+    uint64_t                              queueSeq = 0;
+    std::chrono::steady_clock::time_point queuedAt;
 };
 
 class CPipewireConnection;
+class ICaptureBackend;
+class CCaptureScheduler;
+class COutputCapture;
 
 class CScreencopyPortal {
   public:
     CScreencopyPortal(SP<CCZwlrScreencopyManagerV1>);
 
     void   appendToplevelExport(SP<CCHyprlandToplevelExportManagerV1>);
+    void   appendImageCopyCapture(SP<CCExtImageCopyCaptureManagerV1>, SP<CCExtOutputImageCaptureSourceManagerV1>);
 
     dbUasv onCreateSession(sdbus::ObjectPath requestHandle, sdbus::ObjectPath sessionHandle, std::string appID, std::unordered_map<std::string, sdbus::Variant> opts);
-    dbUasv onSelectSources(sdbus::ObjectPath requestHandle, sdbus::ObjectPath sessionHandle, std::string appID, std::unordered_map<std::string, sdbus::Variant> opts);
-    dbUasv onStart(sdbus::ObjectPath requestHandle, sdbus::ObjectPath sessionHandle, std::string appID, std::string parentWindow,
+    void   onSelectSources(dbUasvResult result, sdbus::ObjectPath requestHandle, sdbus::ObjectPath sessionHandle, std::string appID,
+                           std::unordered_map<std::string, sdbus::Variant> opts);
+    void   onStart(dbUasvResult result, sdbus::ObjectPath requestHandle, sdbus::ObjectPath sessionHandle, std::string appID, std::string parentWindow,
                    std::unordered_map<std::string, sdbus::Variant> opts);
 
     struct SSession {
+        ~SSession();
+
         std::string                               appid;
         sdbus::ObjectPath                         requestHandle, sessionHandle;
         uint32_t                                  cursorMode  = HIDDEN;
@@ -73,30 +122,60 @@ class CScreencopyPortal {
         std::unique_ptr<SDBusSession>             session;
         SSelectionData                            selection;
         Hyprutils::Memory::CWeakPointer<SSession> self;
+        std::optional<dbUasvResult>               startResult;
+
+        // frame objects live on their own queue, so they don't wait behind toplevel chatter on the default one
+        wl_event_queue* eventQueue = nullptr;
+
+        CFrameStats     stats;
 
-        void                                      startCopy();
-        void                                      initCallbacks();
+        // created on the first frame, see CScreencopyPortal::createBackend
+        std::unique_ptr<ICaptureBackend> backend;
+
+        // false if no frame could be requested
+        bool startCopy();
+
+        // called by the backend
+        void addDamage(uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+        void onBufferDone();
+        // unchanged: the backend knows nothing in the frame changed, so it's not sent
+        void onFrameReady(bool unchanged = false);
+        void onFrameFailed(bool fatal);
+        void onCursorChanged();
+
+        // METADATA cursor mode, kept up to date by the backend
+        struct {
+            bool                 visible = false;
+            int32_t              x = 0, y = 0, hotspotX = 0, hotspotY = 0;
+            uint32_t             w = 0, h = 0, fmt = 0;
+            std::vector<uint8_t> bitmap;
+            uint64_t             serial      = 0; // bumped whenever the bitmap changes
+            bool                 dirty       = false;
+            bool                 flushQueued = false;
+        } cursor;
 
         struct {
-            bool                                  active              = false;
-            SP<CCZwlrScreencopyFrameV1>           frameCallback       = nullptr;
-            SP<CCHyprlandToplevelExportFrameV1>   windowFrameCallback = nullptr;
-            frameStatus                           status              = FRAME_NONE;
-            uint64_t                              tvSec               = 0;
-            uint32_t                              tvNsec              = 0;
-            uint64_t                              tvTimestampNs       = 0;
-            uint32_t                              nodeID              = 0;
-            uint32_t                              framerate           = 60;
-            wl_output_transform                   transform           = WL_OUTPUT_TRANSFORM_NORMAL;
-            std::chrono::system_clock::time_point begunFrame          = std::chrono::system_clock::now();
-            uint32_t                              copyRetries         = 0;
+            bool                                  active        = false;
+            eStartStatus                          startStatus   = START_NONE;
+            frameStatus                           status        = FRAME_NONE;
+            uint64_t                              tvSec         = 0;
+            uint32_t                              tvNsec        = 0;
+            uint64_t                              tvTimestampNs = 0;
+            uint32_t                              nodeID        = 0;
+            uint32_t                              framerate     = 60;
+            wl_output_transform                   transform     = WL_OUTPUT_TRANSFORM_NORMAL;
+            std::chrono::system_clock::time_point begunFrame    = std::chrono::system_clock::now();
+            uint32_t                              copyRetries   = 0;
 
             struct {
                 uint32_t w = 0, h = 0, size = 0, stride = 0, fmt = 0;
             } frameInfoSHM;
 
             struct {
-                uint32_t w = 0, h = 0, fmt = 0;
+                uint32_t                             w = 0, h = 0, fmt = 0;
+                // ext capture sessions only: modifiers the source takes for fmt, and the device it wants buffers from
+                std::optional<std::vector<uint64_t>> modifiers;
+                std::optional<dev_t>                 device;
             } frameInfoDMA;
 
             struct {
@@ -110,10 +189,16 @@ class CScreencopyPortal {
     };
 
     void                                 startFrameCopy(SSession* pSession);
+    void                                 continueSharing(SSession* pSession);
+    void                                 finishStart(SSession* pSession, bool success);
     void                                 queueNextShareFrame(SSession* pSession);
     bool                                 hasToplevelCapabilities();
 
+    // dispatches pending frame events of all sessions and shared output captures, returns the amount of dispatched events or -1 on error
+    int                                  dispatchCaptureQueues();
+
     std::unique_ptr<CPipewireConnection> m_pPipewire;
+    std::unique_ptr<CCaptureScheduler>   m_pScheduler;
 
   private:
     std::unique_ptr<sdbus::IObject>                          m_pObject;
@@ -122,12 +207,32 @@ class CScreencopyPortal {
 
     SSession*                                                getSession(sdbus::ObjectPath& path);
     void                                                     startSharing(SSession* pSession);
+    uint32_t                                                 applySelection(SSession* pSession, SSelectionData selection);
+    std::unique_ptr<ICaptureBackend>                         createBackend(SSession* pSession);
+    SP<COutputCapture>                                       outputCapture(const std::string& output, bool overlayCursor);
+    bool                                                     hasExtCapture();
+    // METADATA needs an ext cursor session, see createBackend
+    bool                                                     hasCursorMetadata();
+    void                                                     armStatsTimer();
+    void                                                     reportStats();
 
     struct {
-        SP<CCZwlrScreencopyManagerV1>         screencopy = nullptr;
-        SP<CCHyprlandToplevelExportManagerV1> toplevel   = nullptr;
+        bool                                  armed       = false;
+        uint64_t                              lastCPUNs   = 0;
+        uint64_t                              lastWakeups = 0;
+        std::chrono::steady_clock::time_point lastReport;
+    } m_sStats;
+
+    struct {
+        SP<CCZwlrScreencopyManagerV1>              screencopy          = nullptr;
+        SP<CCHyprlandToplevelExportManagerV1>      toplevel            = nullptr;
+        SP<CCExtImageCopyCaptureManagerV1>         imageCopyCapture    = nullptr;
+        SP<CCExtOutputImageCaptureSourceManagerV1> outputSourceManager = nullptr;
     } m_sState;
 
+    // full output captures shared by region shares, see screencopy:share_region_captures
+    std::vector<WP<COutputCapture>> m_vOutputCaptures;
+
     const sdbus::InterfaceName INTERFACE_NAME = sdbus::InterfaceName{"org.freedesktop.impl.portal.ScreenCast"};
     const sdbus::ObjectPath    OBJECT_PATH    = sdbus::ObjectPath{"/org/freedesktop/portal/desktop"};
 
@@ -147,6 +252,16 @@ class CPipewireConnection {
     void enqueue(CScreencopyPortal::SSession* pSession);
     void dequeue(CScreencopyPortal::SSession* pSession);
 
+    // sends a buffer with only the cursor meta, for cursor movement over static content
+    void enqueueCursor(CScreencopyPortal::SSession* pSession);
+
+    // pipewire thread: hands the buffers enqueued on the main thread over to pipewire
+    void queueReadyBuffers();
+
+    // maps an shm buffer for reading and writing, it stays mapped until pipewire removes it
+    bool mapSHM(SBuffer* pBuffer);
+
+    // Unless noted otherwise, only touched with the pipewire lock held. The session it belongs to is the main thread's.
     struct SPWStream {
         CScreencopyPortal::SSession*          pSession    = nullptr;
         pw_stream*                            stream      = nullptr;
@@ -154,23 +269,146 @@ class CPipewireConnection {
         spa_hook                              streamListener;
         SBuffer*                              currentPWBuffer = nullptr;
         spa_video_info_raw                    pwVideoInfo;
-        uint32_t                              seq   = 0;
-        bool                                  isDMA = false;
+        uint32_t                              seq       = 0;
+        bool                                  isDMA     = false;
+        uint64_t                              formatSeq = 0; // formats pipewire set so far, see applyStreamFormat
+
+        // serial of the cursor bitmap pipewire has already seen, 0 for none
+        uint64_t                              cursorSerial = 0;
+
+        // dma buffers are allocated at this size. With headroom, it's larger than the window
+        // and the frame is cropped out of it, so resizing doesn't renegotiate.
+        bool                                  headroom = false;
+        struct {
+            uint32_t w = 0, h = 0;
+        } dmaSize;
+
+        // debounced param updates, see scheduleParamUpdate
+        struct {
+            bool                                  needed = false;
+            bool                                  armed  = false;
+            uint32_t                              fmt = 0, w = 0, h = 0; // what the frames want
+            std::chrono::steady_clock::time_point first, last;
+        } reneg;
 
         std::vector<std::unique_ptr<SBuffer>> buffers;
+
+        // where its dma buffers are allocated, see CPortalManager::allocationDevice
+        SDMABUFDevice*                        device = nullptr;
+
+        // what the EnumFormat params were built from, see buildFormatsFor. The modifiers follow from the device, its feedback and the source's constraints.
+        struct SFormatKey {
+            uint32_t                             dmaFmt = 0, dmaW = 0, dmaH = 0; // dmaFmt is DRM_FORMAT_INVALID without dma
+            uint32_t                             shmFmt = 0, shmW = 0, shmH = 0;
+            uint32_t                             framerate = 0;
+            SDMABUFDevice*                       device    = nullptr;
+            uint32_t                             feedback  = 0; // see CPortalManager::m_sWaylandConnection.dma.generation
+            std::optional<std::vector<uint64_t>> sourceModifiers; // see SSession::sharingData.frameInfoDMA
+            std::optional<dev_t>                 sourceDevice;
+
+            bool                                 operator==(const SFormatKey&) const = default;
+        };
+
+        struct {
+            SFormatKey                        key;
+            std::vector<std::vector<uint8_t>> pods; // serialized, one per param
+        } formatCache;
+
+        // same for the Buffers and Meta params, see updateBufferParams
+        struct SBufferKey {
+            bool     dma = false, sync = false, headroom = false, cursor = false;
+            uint32_t size = 0, stride = 0, buffers = 0;
+
+            bool     operator==(const SBufferKey&) const = default;
+        };
+
+        struct {
+            SBufferKey                        key;
+            std::vector<std::vector<uint8_t>> pods;
+        } bufferCache;
+
+        // adaptive buffer count, see sizeBufferPool
+        struct {
+            uint32_t                              wanted  = XDPH_PWR_BUFFERS;
+            std::chrono::steady_clock::duration   maxHold = {}; // longest a buffer was gone from queueing until it could be captured into again, this window
+            uint32_t                              starved = 0;  // frames skipped for lack of a free buffer
+            std::chrono::steady_clock::time_point lastChange, windowStart;
+        } sizing;
+
+        // paused by the consumer, see pauseStream
+        struct {
+            bool     active        = false;
+            bool     trimmed       = false;
+            uint64_t seq           = 0; // pauses so far, so a trim timer can tell it's stale
+            uint32_t buffersBefore = 0; // sizing.wanted before trimming
+        } paused;
+
+        // hashes of the last shm frame, see updateTileDamage
+        CTileDamage tileDamage;
+
+#ifdef XDPH_ENCODER
+        // a VP8 copy of the stream on a node of its own, with screencopy:encoder. See feedEncoder
+        std::unique_ptr<CVideoEncoder> encoder;
+        // held without the pipewire lock while the encoder reads a frame back. Buffers aren't freed meanwhile, see pwStreamRemoveBuffer
+        std::mutex encoderRead;
+#endif
+
+        // filled frames, produced by the main thread and consumed by the pipewire thread, without the lock
+        CSPSCQueue<SBuffer*, 32> readyBuffers;
+        // what's in readyBuffers was removed off the pipewire thread, it drops them next time around. See dropReadyBuffers
+        bool readyStale = false;
+
+        // with latest_frame_only: ready frames replaced by a newer one before pipewire got them, reused by dequeue
+        std::vector<SBuffer*> spareBuffers;
+        // dequeued, but their release point has no fence yet, see dequeue
+        CReleasePending<SBuffer> releasePending;
+        uint64_t                 queueSeq = 0; // buffers queued so far
+
+        // our node's clock, filled by the pipewire thread before every cycle we drive
+        struct {
+            spa_io_clock* clock    = nullptr;
+            uint64_t      lastPts  = 0;
+            double        rateDiff = 1.0;
+        } driver;
+
+        struct {
+            int             fd       = -1;
+            size_t          slotSize = 0;
+            size_t          slots    = 0;
+            SP<CCWlShmPool> pool;
+        } shmPool;
     };
 
     std::unique_ptr<SBuffer> createBuffer(SPWStream* pStream, bool dmabuf);
+    SP<CCWlBuffer>           captureTarget(SBuffer* pBuffer, uint32_t w, uint32_t h);
     SPWStream*               streamFromSession(CScreencopyPortal::SSession* pSession);
     void                     removeSessionFrameCallbacks(CScreencopyPortal::SSession* pSession);
-    uint32_t                 buildFormatsFor(spa_pod_builder* b[2], const spa_pod* params[2], SPWStream* stream);
+    uint32_t                 buildFormatsFor(const spa_pod* params[2], SPWStream* stream);
     void                     updateStreamParam(SPWStream* pStream);
+    void                     updateBufferParams(SPWStream* pStream);
+    void                     pauseStream(SPWStream* pStream);
+    void                     resumeStream(SPWStream* pStream);
+
+    // updates the params once the frames stopped changing for a bit, coalescing bursts of changes into one
+    void                     scheduleParamUpdate(SPWStream* pStream, uint32_t fmt, uint32_t w, uint32_t h);
+    void                     cancelParamUpdate(SPWStream* pStream);
+    void                     flushParamUpdate(CScreencopyPortal::SSession* pSession);
+
+    // with screencopy:tile_damage, replaces the session's damage with what actually changed in the current shm buffer.
+    // False if the frame is identical to the last one.
+    bool                     updateTileDamage(SPWStream* pStream);
+#ifdef XDPH_ENCODER
+    void                     feedEncoder(SPWStream* pStream, SBuffer* pBuffer);
+#endif
 
   private:
     std::vector<std::unique_ptr<SPWStream>> m_vStreams;
 
     bool                                    buildModListFor(SPWStream* stream, uint32_t drmFmt, uint64_t** mods, uint32_t* modCount);
+    void                                    queueReady(SPWStream* pStream, SBuffer* pBuffer);
+    void                                    sizeBufferPool(SPWStream* pStream);
 
-    pw_context*                             m_pContext = nullptr;
-    pw_core*                                m_pCore    = nullptr;
+    pw_context*                             m_pContext    = nullptr;
+    pw_core*                                m_pCore       = nullptr;
+    spa_source*                             m_pQueueEvent = nullptr;
 };
\ No newline at end of file
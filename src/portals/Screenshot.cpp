@@ -5,6 +5,7 @@
 
 #include <regex>
 #include <filesystem>
+#include <thread>
 
 std::string lastScreenshot;
 
@@ -96,19 +97,34 @@ CScreenshotPortal::CScreenshotPortal() {
 
     m_pObject
         ->addVTable(
-            sdbus::registerMethod("Screenshot").implementedAs([this](sdbus::ObjectPath o, std::string s1, std::string s2, std::unordered_map<std::string, sdbus::Variant> m) {
-                return onScreenshot(o, s1, s2, m);
-            }),
-            sdbus::registerMethod("PickColor").implementedAs([this](sdbus::ObjectPath o, std::string s1, std::string s2, std::unordered_map<std::string, sdbus::Variant> m) {
-                return onPickColor(o, s1, s2, m);
-            }),
+            sdbus::registerMethod("Screenshot")
+                .implementedAs([this](dbUasvResult&& result, sdbus::ObjectPath o, std::string s1, std::string s2, std::unordered_map<std::string, sdbus::Variant> m) {
+                    onScreenshot(std::move(result), o, s1, s2, m);
+                }),
+            sdbus::registerMethod("PickColor")
+                .implementedAs([this](dbUasvResult&& result, sdbus::ObjectPath o, std::string s1, std::string s2, std::unordered_map<std::string, sdbus::Variant> m) {
+                    onPickColor(std::move(result), o, s1, s2, m);
+                }),
             sdbus::registerProperty("version").withGetter([]() { return uint32_t{2}; }))
         .forInterface(INTERFACE_NAME);
 
     Debug::log(LOG, "[screenshot] init successful");
 }
 
-dbUasv CScreenshotPortal::onScreenshot(sdbus::ObjectPath requestHandle, std::string appID, std::string parentWindow, std::unordered_map<std::string, sdbus::Variant> options) {
+// grim, slurp and hyprpicker can take a while (or wait for the user), so they run in the background and we reply on the main thread once done.
+template <typename F>
+static void replyAsync(dbUasvResult&& result, F&& work) {
+    const auto PRESULT = std::make_shared<dbUasvResult>(std::move(result));
+
+    std::thread([PRESULT, work = std::forward<F>(work)]() mutable {
+        const dbUasv RESULT = work();
+
+        g_pPortalManager->dispatchOnMainThread([PRESULT, RESULT]() { PRESULT->returnResults(std::get<0>(RESULT), std::get<1>(RESULT)); });
+    }).detach();
+}
+
+void CScreenshotPortal::onScreenshot(dbUasvResult result, sdbus::ObjectPath requestHandle, std::string appID, std::string parentWindow,
+                                     std::unordered_map<std::string, sdbus::Variant> options) {
 
     Debug::log(LOG, "[screenshot] New screenshot request:");
     Debug::log(LOG, "[screenshot]  | {}", requestHandle.c_str());
@@ -138,17 +154,17 @@ dbUasv CScreenshotPortal::onScreenshot(sdbus::ObjectPath requestHandle, std::str
         std::filesystem::remove(lastScreenshot);
     lastScreenshot = FILE_PATH;
 
-    if (isInteractive)
-        execAndGet(SNAP_INTERACTIVE_CMD.c_str());
-    else
-        execAndGet(SNAP_CMD.c_str());
+    replyAsync(std::move(result), [CMD = isInteractive ? SNAP_INTERACTIVE_CMD : SNAP_CMD, FILE_PATH, results]() -> dbUasv {
+        execAndGet(CMD.c_str());
 
-    uint32_t responseCode = std::filesystem::exists(FILE_PATH) ? 0 : 1;
+        uint32_t responseCode = std::filesystem::exists(FILE_PATH) ? 0 : 1;
 
-    return {responseCode, results};
+        return {responseCode, results};
+    });
 }
 
-dbUasv CScreenshotPortal::onPickColor(sdbus::ObjectPath requestHandle, std::string appID, std::string parentWindow, std::unordered_map<std::string, sdbus::Variant> options) {
+void CScreenshotPortal::onPickColor(dbUasvResult result, sdbus::ObjectPath requestHandle, std::string appID, std::string parentWindow,
+                                    std::unordered_map<std::string, sdbus::Variant> options) {
 
     Debug::log(LOG, "[screenshot] New PickColor request:");
     Debug::log(LOG, "[screenshot]  | {}", requestHandle.c_str());
@@ -159,12 +175,15 @@ dbUasv CScreenshotPortal::onPickColor(sdbus::ObjectPath requestHandle, std::stri
 
     if (!slurpInstalled && !hyprPickerInstalled) {
         Debug::log(ERR, "Neither slurp nor hyprpicker found. We can't pick colors.");
-        return {1, {}};
+        result.returnResults(1, {});
+        return;
     }
 
     // use hyprpicker if installed, slurp as fallback
-    if (hyprPickerInstalled)
-        return pickHyprPicker(requestHandle, appID, parentWindow, options);
-    else
-        return pickSlurp(requestHandle, appID, parentWindow, options);
+    replyAsync(std::move(result), [hyprPickerInstalled, requestHandle, appID, parentWindow, options]() -> dbUasv {
+        if (hyprPickerInstalled)
+            return pickHyprPicker(requestHandle, appID, parentWindow, options);
+        else
+            return pickSlurp(requestHandle, appID, parentWindow, options);
+    });
 }
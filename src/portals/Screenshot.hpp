@@ -7,8 +7,8 @@ class CScreenshotPortal {
   public:
     CScreenshotPortal();
 
-    dbUasv onScreenshot(sdbus::ObjectPath requestHandle, std::string appID, std::string parentWindow, std::unordered_map<std::string, sdbus::Variant> options);
-    dbUasv onPickColor(sdbus::ObjectPath requestHandle, std::string appID, std::string parentWindow, std::unordered_map<std::string, sdbus::Variant> options);
+    void onScreenshot(dbUasvResult result, sdbus::ObjectPath requestHandle, std::string appID, std::string parentWindow, std::unordered_map<std::string, sdbus::Variant> options);
+    void onPickColor(dbUasvResult result, sdbus::ObjectPath requestHandle, std::string appID, std::string parentWindow, std::unordered_map<std::string, sdbus::Variant> options);
 
   private:
     std::unique_ptr<sdbus::IObject> m_pObject;
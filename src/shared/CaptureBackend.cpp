@@ -0,0 +1,968 @@
+#include "CaptureBackend.hpp"
+#include "../core/PortalManager.hpp"
+#include "../helpers/Log.hpp"
+#include "Formats.hpp"
+
+#include <libdrm/drm_fourcc.h>
+#include <pipewire/pipewire.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// frame events of a session are dispatched from its own queue, see CScreencopyPortal::dispatchCaptureQueues
+static void useSessionQueue(CScreencopyPortal::SSession* pSession, wl_proxy* proxy) {
+    if (pSession->eventQueue)
+        wl_proxy_set_queue(proxy, pSession->eventQueue);
+}
+
+// formats we can describe to pipewire with 4 bytes per pixel, which is what we size shm buffers for
+static bool isUsableFourcc(uint32_t format) {
+    const auto PFORMAT = formatFromDrm(format);
+    return PFORMAT && PFORMAT->bpp == 4 && PFORMAT->planes == 1;
+}
+
+static bool isUsableSHMFormat(wl_shm_format format) {
+    switch (format) {
+        case WL_SHM_FORMAT_ARGB8888:
+        case WL_SHM_FORMAT_XRGB8888: return true;
+        // the rest of wl_shm formats match their drm fourcc
+        default: return isUsableFourcc(format);
+    }
+}
+
+// --------------- wlr screencopy --------------- //
+
+CWlrCaptureBackend::CWlrCaptureBackend(CScreencopyPortal::SSession* pSession, SP<CCZwlrScreencopyManagerV1> mgr) : m_pSession(pSession), m_pManager(mgr) {
+    ;
+}
+
+bool CWlrCaptureBackend::startFrame() {
+    const auto     POUTPUT       = g_pPortalManager->getOutputFromName(m_pSession->selection.output);
+    const uint32_t OVERLAYCURSOR = m_pSession->cursorMode == EMBEDDED ? 1 : 0;
+    const auto&    SELECTION     = m_pSession->selection;
+
+    if (!POUTPUT) {
+        Debug::log(ERR, "[screencopy] Output {} not found??", SELECTION.output);
+        return false;
+    }
+
+    if (SELECTION.type == TYPE_GEOMETRY)
+        m_pFrame = makeShared<CCZwlrScreencopyFrameV1>(
+            m_pManager->sendCaptureOutputRegion(OVERLAYCURSOR, POUTPUT->output->resource(), SELECTION.x, SELECTION.y, SELECTION.w, SELECTION.h));
+    else
+        m_pFrame = makeShared<CCZwlrScreencopyFrameV1>(m_pManager->sendCaptureOutput(OVERLAYCURSOR, POUTPUT->output->resource()));
+
+    m_pSession->sharingData.transform = POUTPUT->transform;
+
+    useSessionQueue(m_pSession, m_pFrame->resource());
+
+    m_pFrame->setBuffer([this](CCZwlrScreencopyFrameV1* r, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+        Debug::log(TRACE, "[sc] wlrOnBuffer for {}", (void*)m_pSession);
+
+        auto& shm  = m_pSession->sharingData.frameInfoSHM;
+        shm.w      = width;
+        shm.h      = height;
+        shm.fmt    = drmFourccFromSHM((wl_shm_format)format);
+        shm.size   = stride * height;
+        shm.stride = stride;
+
+        // todo: done if ver < 3
+    });
+    m_pFrame->setLinuxDmabuf([this](CCZwlrScreencopyFrameV1* r, uint32_t format, uint32_t width, uint32_t height) {
+        Debug::log(TRACE, "[sc] wlrOnDmabuf for {}", (void*)m_pSession);
+
+        auto& dma = m_pSession->sharingData.frameInfoDMA;
+        dma.w     = width;
+        dma.h     = height;
+        dma.fmt   = format;
+    });
+    m_pFrame->setDamage([this](CCZwlrScreencopyFrameV1* r, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+        Debug::log(TRACE, "[sc] wlrOnDamage for {}", (void*)m_pSession);
+        m_pSession->addDamage(x, y, width, height);
+    });
+    m_pFrame->setBufferDone([this](CCZwlrScreencopyFrameV1* r) {
+        Debug::log(TRACE, "[sc] wlrOnBufferDone for {}", (void*)m_pSession);
+        m_pSession->onBufferDone();
+    });
+    m_pFrame->setReady([this](CCZwlrScreencopyFrameV1* r, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+        Debug::log(TRACE, "[sc] wlrOnReady for {}", (void*)m_pSession);
+
+        m_pSession->sharingData.tvSec  = ((((uint64_t)tv_sec_hi) << 32) + (uint64_t)tv_sec_lo);
+        m_pSession->sharingData.tvNsec = tv_nsec;
+        m_pSession->onFrameReady();
+
+        m_pFrame.reset();
+    });
+    m_pFrame->setFailed([this](CCZwlrScreencopyFrameV1* r) {
+        Debug::log(TRACE, "[sc] wlrOnFailed for {}", (void*)m_pSession);
+
+        const auto PSESSION = m_pSession;
+        m_pFrame.reset();
+        PSESSION->onFrameFailed(true);
+    });
+
+    return true;
+}
+
+void CWlrCaptureBackend::copyTo(SBuffer* buffer, SP<CCWlBuffer> target) {
+    m_pFrame->sendCopyWithDamage(target->resource());
+}
+
+void CWlrCaptureBackend::dropFrame() {
+    m_pFrame.reset();
+}
+
+bool CWlrCaptureBackend::framePending() {
+    return m_pFrame;
+}
+
+// --------------- shared output capture for regions --------------- //
+
+COutputCapture::COutputCapture(const std::string& output, bool overlayCursor, SP<CCZwlrScreencopyManagerV1> mgr) :
+    m_sOutput(output), m_bOverlayCursor(overlayCursor), m_pManager(mgr) {
+    Debug::log(LOG, "[screencopy] sharing captures of {} between its regions", m_sOutput);
+
+    m_pEventQueue = wl_display_create_queue(g_pPortalManager->m_sWaylandConnection.display);
+    if (!m_pEventQueue)
+        Debug::log(WARN, "[screencopy] no event queue for the shared capture of {}, using the default one", m_sOutput);
+}
+
+COutputCapture::~COutputCapture() {
+    m_pFrame.reset();
+    release();
+
+    if (m_pEventQueue)
+        wl_event_queue_destroy(m_pEventQueue);
+}
+
+void COutputCapture::request(CRegionCaptureBackend* pRegion) {
+    // the frame in flight wasn't copied yet, the region can take part in it
+    if (m_pFrame && !m_bCopying) {
+        m_vCapturing.push_back(pRegion);
+        return;
+    }
+
+    m_vWaiting.push_back(pRegion);
+
+    if (!m_pFrame)
+        start();
+}
+
+void COutputCapture::cancel(CRegionCaptureBackend* pRegion) {
+    std::erase(m_vCapturing, pRegion);
+    std::erase(m_vWaiting, pRegion);
+}
+
+void COutputCapture::release() {
+    m_sBuffer.buffer.reset();
+
+    if (m_sBuffer.data)
+        munmap(m_sBuffer.data, m_sBuffer.size);
+    if (m_sBuffer.fd >= 0)
+        close(m_sBuffer.fd);
+
+    m_sBuffer = {};
+}
+
+bool COutputCapture::allocate(uint32_t fmt, uint32_t w, uint32_t h, uint32_t stride) {
+    if (m_sBuffer.buffer && m_sBuffer.fmt == fmt && m_sBuffer.w == w && m_sBuffer.h == h && m_sBuffer.stride == stride)
+        return true;
+
+    release();
+
+    if (fmt == DRM_FORMAT_INVALID || w == 0 || h == 0) {
+        Debug::log(ERR, "[screencopy] output {} offered no usable shm buffer", m_sOutput);
+        return false;
+    }
+
+    const uint32_t SIZE = stride * h;
+
+    m_sBuffer.fd = anonymous_shm_open();
+    if (m_sBuffer.fd < 0 || ftruncate(m_sBuffer.fd, SIZE) < 0) {
+        Debug::log(ERR, "[screencopy] couldn't allocate a buffer for output {}", m_sOutput);
+        release();
+        return false;
+    }
+
+    m_sBuffer.data = mmap(nullptr, SIZE, PROT_READ, MAP_SHARED, m_sBuffer.fd, 0);
+    if (m_sBuffer.data == MAP_FAILED) {
+        Debug::log(ERR, "[screencopy] couldn't map the buffer for output {}", m_sOutput);
+        m_sBuffer.data = nullptr;
+        release();
+        return false;
+    }
+
+    m_sBuffer.w      = w;
+    m_sBuffer.h      = h;
+    m_sBuffer.stride = stride;
+    m_sBuffer.fmt    = fmt;
+    m_sBuffer.size   = SIZE;
+
+    const auto POOL  = makeShared<CCWlShmPool>(g_pPortalManager->m_sWaylandConnection.shm->sendCreatePool(m_sBuffer.fd, SIZE));
+    m_sBuffer.buffer = makeShared<CCWlBuffer>(POOL->sendCreateBuffer(0, w, h, stride, wlSHMFromDrmFourcc(fmt)));
+
+    Debug::log(LOG, "[screencopy] shared capture buffer for {}: {}x{}", m_sOutput, w, h);
+
+    return true;
+}
+
+// regions may go away while we call them, so each is only called while it's still capturing
+void COutputCapture::fail() {
+    for (const auto& region : std::vector{m_vCapturing}) {
+        if (std::erase(m_vCapturing, region))
+            region->onSharedFailed();
+    }
+}
+
+void COutputCapture::start() {
+    const auto POUTPUT = g_pPortalManager->getOutputFromName(m_sOutput);
+
+    m_vCapturing = std::exchange(m_vWaiting, {});
+
+    if (!POUTPUT) {
+        Debug::log(ERR, "[screencopy] Output {} not found??", m_sOutput);
+        fail();
+        return;
+    }
+
+    m_bCopying = false;
+    m_vDamage.clear();
+
+    m_pFrame = makeShared<CCZwlrScreencopyFrameV1>(m_pManager->sendCaptureOutput(m_bOverlayCursor ? 1 : 0, POUTPUT->output->resource()));
+    if (m_pEventQueue)
+        wl_proxy_set_queue(m_pFrame->resource(), m_pEventQueue);
+
+    m_pFrame->setBuffer([this](CCZwlrScreencopyFrameV1* r, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+        m_sConstraints = {width, height, stride, drmFourccFromSHM((wl_shm_format)format)};
+    });
+    m_pFrame->setDamage([this](CCZwlrScreencopyFrameV1* r, uint32_t x, uint32_t y, uint32_t width, uint32_t height) { m_vDamage.push_back({x, y, width, height}); });
+    m_pFrame->setBufferDone([this](CCZwlrScreencopyFrameV1* r) {
+        // a region may end its session from in here, and with it our last reference. The frame has to outlive its own callback too.
+        const auto SELF  = m_pSelf.lock();
+        const auto FRAME = m_pFrame;
+
+        if (!isUsableFourcc(m_sConstraints.fmt) || !allocate(m_sConstraints.fmt, m_sConstraints.w, m_sConstraints.h, m_sConstraints.stride)) {
+            m_pFrame.reset();
+            fail();
+            return;
+        }
+
+        // every region dequeues its pipewire buffer now, or drops out
+        for (const auto& region : std::vector{m_vCapturing}) {
+            if (std::find(m_vCapturing.begin(), m_vCapturing.end(), region) != m_vCapturing.end())
+                region->onSharedBufferDone(m_sBuffer.fmt, m_sBuffer.w, m_sBuffer.h);
+        }
+
+        if (m_vCapturing.empty()) {
+            m_pFrame.reset();
+            if (!m_vWaiting.empty())
+                start();
+            return;
+        }
+
+        m_bCopying = true;
+        m_pFrame->sendCopyWithDamage(m_sBuffer.buffer->resource());
+    });
+    m_pFrame->setReady([this](CCZwlrScreencopyFrameV1* r, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+        const auto     SELF  = m_pSelf.lock();
+        const auto     FRAME = m_pFrame;
+        const uint64_t TVSEC = ((((uint64_t)tv_sec_hi) << 32) + (uint64_t)tv_sec_lo);
+
+        m_iFrame++;
+        m_pFrame.reset();
+
+        // no damage sent at all, so all of it
+        if (m_vDamage.empty())
+            m_vDamage.push_back({0, 0, m_sBuffer.w, m_sBuffer.h});
+
+        for (const auto& region : std::vector{m_vCapturing}) {
+            if (std::erase(m_vCapturing, region))
+                region->onSharedFrame((const uint8_t*)m_sBuffer.data, m_sBuffer.stride, m_iFrame, m_vDamage, TVSEC, tv_nsec);
+        }
+
+        if (!m_pFrame && !m_vWaiting.empty())
+            start();
+    });
+    m_pFrame->setFailed([this](CCZwlrScreencopyFrameV1* r) {
+        const auto SELF  = m_pSelf.lock();
+        const auto FRAME = m_pFrame;
+
+        Debug::log(TRACE, "[sc] shared capture of {} failed", m_sOutput);
+
+        m_pFrame.reset();
+        fail();
+
+        if (!m_pFrame && !m_vWaiting.empty())
+            start();
+    });
+}
+
+// wlr_box_transform: a box in a width x height space, transformed
+static COutputCapture::SRect transformBox(const COutputCapture::SRect& box, wl_output_transform transform, uint32_t width, uint32_t height) {
+    COutputCapture::SRect result = box;
+
+    if (transform % 2 == 1)
+        std::swap(result.w, result.h);
+
+    switch (transform) {
+        case WL_OUTPUT_TRANSFORM_NORMAL: break;
+        case WL_OUTPUT_TRANSFORM_90: result.x = height - box.y - box.h, result.y = box.x; break;
+        case WL_OUTPUT_TRANSFORM_180: result.x = width - box.x - box.w, result.y = height - box.y - box.h; break;
+        case WL_OUTPUT_TRANSFORM_270: result.x = box.y, result.y = width - box.x - box.w; break;
+        case WL_OUTPUT_TRANSFORM_FLIPPED: result.x = width - box.x - box.w, result.y = box.y; break;
+        case WL_OUTPUT_TRANSFORM_FLIPPED_90: result.x = box.y, result.y = box.x; break;
+        case WL_OUTPUT_TRANSFORM_FLIPPED_180: result.x = box.x, result.y = height - box.y - box.h; break;
+        case WL_OUTPUT_TRANSFORM_FLIPPED_270: result.x = height - box.y - box.h, result.y = width - box.x - box.w; break;
+        default: break;
+    }
+
+    return result;
+}
+
+CRegionCaptureBackend::CRegionCaptureBackend(CScreencopyPortal::SSession* pSession, SP<COutputCapture> capture) : m_pSession(pSession), m_pCapture(capture) {
+    ;
+}
+
+CRegionCaptureBackend::~CRegionCaptureBackend() {
+    m_pCapture->cancel(this);
+}
+
+bool CRegionCaptureBackend::startFrame() {
+    const auto POUTPUT = g_pPortalManager->getOutputFromName(m_pSession->selection.output);
+
+    if (!POUTPUT) {
+        Debug::log(ERR, "[screencopy] Output {} not found??", m_pSession->selection.output);
+        return false;
+    }
+
+    m_pSession->sharingData.transform = POUTPUT->transform;
+
+    m_bPending = true;
+    m_pTarget  = nullptr;
+    m_pCapture->request(this);
+
+    return true;
+}
+
+void CRegionCaptureBackend::copyTo(SBuffer* buffer, SP<CCWlBuffer> target) {
+    // the compositor only ever writes to the shared buffer, the region is copied out once the frame is ready
+    m_pTarget = buffer;
+}
+
+void CRegionCaptureBackend::dropFrame() {
+    m_bPending = false;
+    m_pTarget  = nullptr;
+    m_pCapture->cancel(this);
+}
+
+bool CRegionCaptureBackend::framePending() {
+    return m_bPending;
+}
+
+void CRegionCaptureBackend::onSharedBufferDone(uint32_t fmt, uint32_t w, uint32_t h) {
+    const auto  POUTPUT = g_pPortalManager->getOutputFromName(m_pSession->selection.output);
+    const auto  PFORMAT = formatFromDrm(fmt);
+    const auto& SEL     = m_pSession->selection;
+
+    if (!POUTPUT || !PFORMAT) {
+        dropFrame();
+        m_pSession->onFrameFailed(false);
+        return;
+    }
+
+    // the region is in logical coordinates of the transformed output, the frame in pixels before the transform.
+    // Scaled and transformed the same way the compositor does it for a region capture.
+    const bool     ROTATED = POUTPUT->transform % 2 == 1;
+    const uint32_t TW      = ROTATED ? h : w;
+    const uint32_t TH      = ROTATED ? w : h;
+    const double   SCALEX  = POUTPUT->logicalWidth ? (double)TW / POUTPUT->logicalWidth : 1.0;
+    const double   SCALEY  = POUTPUT->logicalHeight ? (double)TH / POUTPUT->logicalHeight : 1.0;
+
+    const uint32_t X1 = std::clamp<int64_t>(std::lround(SEL.x * SCALEX), 0, TW);
+    const uint32_t Y1 = std::clamp<int64_t>(std::lround(SEL.y * SCALEY), 0, TH);
+    const uint32_t X2 = std::clamp<int64_t>(std::lround((SEL.x + SEL.w) * SCALEX), X1, TW);
+    const uint32_t Y2 = std::clamp<int64_t>(std::lround((SEL.y + SEL.h) * SCALEY), Y1, TH);
+
+    if (X2 == X1 || Y2 == Y1) {
+        Debug::log(ERR, "[screencopy] region {}x{} at {},{} is outside of {}", SEL.w, SEL.h, SEL.x, SEL.y, SEL.output);
+        dropFrame();
+        m_pSession->onFrameFailed(true);
+        return;
+    }
+
+    // the inverse of the output transform takes it back to the buffer
+    auto inverse = POUTPUT->transform;
+    if ((inverse & WL_OUTPUT_TRANSFORM_90) && !(inverse & WL_OUTPUT_TRANSFORM_FLIPPED))
+        inverse = (wl_output_transform)(inverse ^ WL_OUTPUT_TRANSFORM_180);
+
+    const auto BOX = transformBox({X1, Y1, X2 - X1, Y2 - Y1}, inverse, TW, TH);
+
+    m_sCrop = {BOX.x, BOX.y, BOX.w, BOX.h, PFORMAT->bpp};
+
+    auto& shm  = m_pSession->sharingData.frameInfoSHM;
+    shm.w      = m_sCrop.w;
+    shm.h      = m_sCrop.h;
+    shm.fmt    = fmt;
+    shm.stride = m_sCrop.w * m_sCrop.bpp;
+    shm.size   = shm.stride * m_sCrop.h;
+
+    // we copy on the cpu, so only shm
+    m_pSession->sharingData.frameInfoDMA = {};
+
+    m_pSession->onBufferDone();
+}
+
+void CRegionCaptureBackend::onSharedFrame(const uint8_t* data, uint32_t stride, uint64_t frame, const std::vector<COutputCapture::SRect>& damage, uint64_t tvSec,
+                                          uint32_t tvNsec) {
+    if (!m_bPending)
+        return;
+
+    const auto PPIPEWIRE = g_pPortalManager->m_sPortals.screencopy->m_pPipewire.get();
+    const auto PTARGET   = m_pTarget;
+
+    m_bPending = false;
+    m_pTarget  = nullptr;
+
+    m_pSession->sharingData.tvSec  = tvSec;
+    m_pSession->sharingData.tvNsec = tvNsec;
+
+    // damage is relative to the previous shared frame, if this region didn't send that one we don't know what changed
+    if (m_iLastFrame == 0 || m_iLastFrame + 1 != frame)
+        m_pSession->addDamage(0, 0, m_sCrop.w, m_sCrop.h);
+    else {
+        for (const auto& d : damage) {
+            const uint32_t X1 = std::max(d.x, m_sCrop.x), Y1 = std::max(d.y, m_sCrop.y);
+            const uint32_t X2 = std::min(d.x + d.w, m_sCrop.x + m_sCrop.w), Y2 = std::min(d.y + d.h, m_sCrop.y + m_sCrop.h);
+
+            if (X1 < X2 && Y1 < Y2)
+                m_pSession->addDamage(X1 - m_sCrop.x, Y1 - m_sCrop.y, X2 - X1, Y2 - Y1);
+        }
+    }
+
+    // the output changed somewhere else. Nothing to copy or send.
+    if (m_pSession->sharingData.damageCount == 0) {
+        m_iLastFrame = frame;
+        m_pSession->onFrameReady(true);
+        return;
+    }
+
+    const size_t ROWBYTES = (size_t)m_sCrop.w * m_sCrop.bpp;
+
+    // pipewire may have taken the buffer away since copyTo
+    CPipewireLock lock;
+
+    const auto    PSTREAM = PPIPEWIRE->streamFromSession(m_pSession);
+
+    if (!PTARGET || !PSTREAM || PSTREAM->currentPWBuffer != PTARGET || PTARGET->isDMABUF || PTARGET->stride[0] < ROWBYTES ||
+        (size_t)PTARGET->stride[0] * m_sCrop.h > PTARGET->size[0] || !PPIPEWIRE->mapSHM(PTARGET)) {
+        Debug::log(ERR, "[screencopy] no buffer to copy region {}x{} into", m_sCrop.w, m_sCrop.h);
+        m_pSession->onFrameFailed(false);
+        return;
+    }
+
+    // the whole region, the buffer may hold a frame older than the last one
+    uint8_t* dst = (uint8_t*)PTARGET->shmData;
+    for (uint32_t y = 0; y < m_sCrop.h; ++y) {
+        memcpy(dst + (size_t)y * PTARGET->stride[0], data + (size_t)(m_sCrop.y + y) * stride + (size_t)m_sCrop.x * m_sCrop.bpp, ROWBYTES);
+    }
+
+    m_iLastFrame = frame;
+    m_pSession->onFrameReady();
+}
+
+void CRegionCaptureBackend::onSharedFailed() {
+    m_bPending = false;
+    m_pTarget  = nullptr;
+    m_pSession->onFrameFailed(true);
+}
+
+// --------------- hyprland toplevel export --------------- //
+
+CToplevelExportCaptureBackend::CToplevelExportCaptureBackend(CScreencopyPortal::SSession* pSession, SP<CCHyprlandToplevelExportManagerV1> mgr) :
+    m_pSession(pSession), m_pManager(mgr) {
+    ;
+}
+
+bool CToplevelExportCaptureBackend::startFrame() {
+    const uint32_t OVERLAYCURSOR = m_pSession->cursorMode == EMBEDDED ? 1 : 0;
+
+    if (!m_pSession->selection.windowHandle) {
+        Debug::log(ERR, "[screencopy] selected invalid window?");
+        return false;
+    }
+
+    m_pFrame = makeShared<CCHyprlandToplevelExportFrameV1>(m_pManager->sendCaptureToplevelWithWlrToplevelHandle(OVERLAYCURSOR, m_pSession->selection.windowHandle->resource()));
+
+    m_pSession->sharingData.transform = WL_OUTPUT_TRANSFORM_NORMAL;
+
+    useSessionQueue(m_pSession, m_pFrame->resource());
+
+    m_pFrame->setBuffer([this](CCHyprlandToplevelExportFrameV1* r, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+        Debug::log(TRACE, "[sc] hlOnBuffer for {}", (void*)m_pSession);
+
+        auto& shm  = m_pSession->sharingData.frameInfoSHM;
+        shm.w      = width;
+        shm.h      = height;
+        shm.fmt    = drmFourccFromSHM((wl_shm_format)format);
+        shm.size   = stride * height;
+        shm.stride = stride;
+
+        // todo: done if ver < 3
+    });
+    m_pFrame->setLinuxDmabuf([this](CCHyprlandToplevelExportFrameV1* r, uint32_t format, uint32_t width, uint32_t height) {
+        Debug::log(TRACE, "[sc] hlOnDmabuf for {}", (void*)m_pSession);
+
+        auto& dma = m_pSession->sharingData.frameInfoDMA;
+        dma.w     = width;
+        dma.h     = height;
+        dma.fmt   = format;
+    });
+    m_pFrame->setDamage([this](CCHyprlandToplevelExportFrameV1* r, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+        Debug::log(TRACE, "[sc] hlOnDamage for {}", (void*)m_pSession);
+        m_pSession->addDamage(x, y, width, height);
+    });
+    m_pFrame->setBufferDone([this](CCHyprlandToplevelExportFrameV1* r) {
+        Debug::log(TRACE, "[sc] hlOnBufferDone for {}", (void*)m_pSession);
+        m_pSession->onBufferDone();
+    });
+    m_pFrame->setReady([this](CCHyprlandToplevelExportFrameV1* r, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+        Debug::log(TRACE, "[sc] hlOnReady for {}", (void*)m_pSession);
+
+        m_pSession->sharingData.tvSec  = ((((uint64_t)tv_sec_hi) << 32) + (uint64_t)tv_sec_lo);
+        m_pSession->sharingData.tvNsec = tv_nsec;
+        m_pSession->onFrameReady();
+
+        m_pFrame.reset();
+    });
+    m_pFrame->setFailed([this](CCHyprlandToplevelExportFrameV1* r) {
+        Debug::log(TRACE, "[sc] hlOnFailed for {}", (void*)m_pSession);
+
+        const auto PSESSION = m_pSession;
+        m_pFrame.reset();
+        PSESSION->onFrameFailed(true);
+    });
+
+    return true;
+}
+
+void CToplevelExportCaptureBackend::copyTo(SBuffer* buffer, SP<CCWlBuffer> target) {
+    m_pFrame->sendCopy(target->resource(), false);
+}
+
+void CToplevelExportCaptureBackend::dropFrame() {
+    m_pFrame.reset();
+}
+
+bool CToplevelExportCaptureBackend::framePending() {
+    return m_pFrame;
+}
+
+bool CToplevelExportCaptureBackend::reportsDamage() {
+    // copies don't wait for damage, so each frame comes fully damaged
+    return false;
+}
+
+// --------------- ext cursor capture --------------- //
+
+CExtCursorCapture::CExtCursorCapture(CScreencopyPortal::SSession* pSession, SP<CCExtImageCopyCaptureManagerV1> mgr, SP<CCExtImageCaptureSourceV1> source,
+                                     SP<CCWlPointer> pointer) : m_pSession(pSession) {
+    m_pCursorSession = makeShared<CCExtImageCopyCaptureCursorSessionV1>(mgr->sendCreatePointerCursorSession(source->resource(), pointer->resource()));
+
+    useSessionQueue(m_pSession, m_pCursorSession->resource());
+
+    m_pCursorSession->setEnter([this](CCExtImageCopyCaptureCursorSessionV1* r) {
+        m_pSession->cursor.visible = true;
+        m_pSession->onCursorChanged();
+    });
+    m_pCursorSession->setLeave([this](CCExtImageCopyCaptureCursorSessionV1* r) {
+        m_pSession->cursor.visible = false;
+        m_pSession->onCursorChanged();
+    });
+    m_pCursorSession->setPosition([this](CCExtImageCopyCaptureCursorSessionV1* r, int32_t x, int32_t y) {
+        m_pSession->cursor.x = x;
+        m_pSession->cursor.y = y;
+        m_pSession->onCursorChanged();
+    });
+    m_pCursorSession->setHotspot([this](CCExtImageCopyCaptureCursorSessionV1* r, int32_t x, int32_t y) {
+        m_pSession->cursor.hotspotX = x;
+        m_pSession->cursor.hotspotY = y;
+        m_pSession->onCursorChanged();
+    });
+
+    m_pCaptureSession = makeShared<CCExtImageCopyCaptureSessionV1>(m_pCursorSession->sendGetCaptureSession());
+
+    useSessionQueue(m_pSession, m_pCaptureSession->resource());
+
+    m_pCaptureSession->setBufferSize([this](CCExtImageCopyCaptureSessionV1* r, uint32_t width, uint32_t height) {
+        m_sConstraints.w   = width;
+        m_sConstraints.h   = height;
+        m_sConstraints.fmt = DRM_FORMAT_INVALID;
+    });
+    m_pCaptureSession->setShmFormat([this](CCExtImageCopyCaptureSessionV1* r, auto format) {
+        if (m_sConstraints.fmt != DRM_FORMAT_INVALID || !isUsableSHMFormat((wl_shm_format)format))
+            return;
+
+        m_sConstraints.fmt = drmFourccFromSHM((wl_shm_format)format);
+    });
+    m_pCaptureSession->setDone([this](CCExtImageCopyCaptureSessionV1* r) {
+        Debug::log(TRACE, "[sc] cursor constraints for {}: {}x{} fmt {}", (void*)m_pSession, m_sConstraints.w, m_sConstraints.h, m_sConstraints.fmt);
+
+        if (m_sConstraints.w != m_sBitmap.w || m_sConstraints.h != m_sBitmap.h || m_sConstraints.fmt != m_sBitmap.fmt) {
+            // a pending frame still has the old buffer attached
+            m_pFrame.reset();
+
+            if (!allocate())
+                return;
+        }
+
+        capture();
+    });
+    m_pCaptureSession->setStopped([this](CCExtImageCopyCaptureSessionV1* r) {
+        Debug::log(LOG, "[screencopy] cursor capture session for {} stopped", (void*)m_pSession);
+
+        m_bStopped = true;
+        m_pFrame.reset();
+        m_pSession->cursor.visible = false;
+        m_pSession->onCursorChanged();
+    });
+}
+
+CExtCursorCapture::~CExtCursorCapture() {
+    m_pFrame.reset();
+    release();
+}
+
+void CExtCursorCapture::release() {
+    m_sBitmap.buffer.reset();
+
+    if (m_sBitmap.data)
+        munmap(m_sBitmap.data, m_sBitmap.size);
+    if (m_sBitmap.fd >= 0)
+        close(m_sBitmap.fd);
+
+    m_sBitmap = {};
+}
+
+bool CExtCursorCapture::allocate() {
+    release();
+
+    if (m_sConstraints.fmt == DRM_FORMAT_INVALID || m_sConstraints.w == 0 || m_sConstraints.h == 0) {
+        Debug::log(ERR, "[screencopy] cursor capture session offered no usable shm buffer");
+        return false;
+    }
+
+    const uint32_t STRIDE = m_sConstraints.w * 4;
+    const uint32_t SIZE   = STRIDE * m_sConstraints.h;
+
+    m_sBitmap.fd = anonymous_shm_open();
+    if (m_sBitmap.fd < 0 || ftruncate(m_sBitmap.fd, SIZE) < 0) {
+        Debug::log(ERR, "[screencopy] couldn't allocate a cursor buffer");
+        release();
+        return false;
+    }
+
+    m_sBitmap.data = mmap(nullptr, SIZE, PROT_READ, MAP_SHARED, m_sBitmap.fd, 0);
+    if (m_sBitmap.data == MAP_FAILED) {
+        Debug::log(ERR, "[screencopy] couldn't map the cursor buffer");
+        m_sBitmap.data = nullptr;
+        release();
+        return false;
+    }
+
+    m_sBitmap.w    = m_sConstraints.w;
+    m_sBitmap.h    = m_sConstraints.h;
+    m_sBitmap.fmt  = m_sConstraints.fmt;
+    m_sBitmap.size = SIZE;
+
+    // the pool can go right away, the buffer keeps the memory alive
+    const auto POOL  = makeShared<CCWlShmPool>(g_pPortalManager->m_sWaylandConnection.shm->sendCreatePool(m_sBitmap.fd, SIZE));
+    m_sBitmap.buffer = makeShared<CCWlBuffer>(POOL->sendCreateBuffer(0, m_sBitmap.w, m_sBitmap.h, STRIDE, wlSHMFromDrmFourcc(m_sBitmap.fmt)));
+
+    return true;
+}
+
+void CExtCursorCapture::capture() {
+    if (m_bStopped || m_pFrame || !m_sBitmap.buffer)
+        return;
+
+    m_pFrame  = makeShared<CCExtImageCopyCaptureFrameV1>(m_pCaptureSession->sendCreateFrame());
+    m_bCopied = false;
+
+    useSessionQueue(m_pSession, m_pFrame->resource());
+
+    m_sBitmap.damaged = false;
+
+    m_pFrame->setDamage([this](CCExtImageCopyCaptureFrameV1* r, int32_t x, int32_t y, int32_t width, int32_t height) { m_sBitmap.damaged = true; });
+    m_pFrame->setReady([this](CCExtImageCopyCaptureFrameV1* r) {
+        if (m_sBitmap.damaged) {
+            auto& cursor = m_pSession->cursor;
+            cursor.w     = m_sBitmap.w;
+            cursor.h     = m_sBitmap.h;
+            cursor.fmt   = m_sBitmap.fmt;
+            cursor.bitmap.assign((uint8_t*)m_sBitmap.data, (uint8_t*)m_sBitmap.data + m_sBitmap.size);
+            cursor.serial++;
+
+            Debug::log(TRACE, "[sc] new cursor bitmap for {}: {}x{}", (void*)m_pSession, cursor.w, cursor.h);
+
+            m_pSession->onCursorChanged();
+        }
+
+        // resetting the frame destroys this closure
+        const auto PCAPTURE = this;
+        m_pFrame.reset();
+
+        // the next one completes once the cursor image changes
+        PCAPTURE->capture();
+    });
+    m_pFrame->setFailed([this](CCExtImageCopyCaptureFrameV1* r, auto reason) {
+        Debug::log(TRACE, "[sc] cursor frame failed for {}, reason {}", (void*)m_pSession, (uint32_t)reason);
+
+        // buffer constraints will be followed by done, which captures again
+        m_pFrame.reset();
+    });
+
+    m_pFrame->sendAttachBuffer(m_sBitmap.buffer->resource());
+
+    if (m_sBitmap.fresh) {
+        m_pFrame->sendDamageBuffer(0, 0, m_sBitmap.w, m_sBitmap.h);
+        m_sBitmap.fresh = false;
+    }
+
+    m_pFrame->sendCapture();
+}
+
+// --------------- ext image copy capture --------------- //
+
+CExtCaptureBackend::CExtCaptureBackend(CScreencopyPortal::SSession* pSession, SP<CCExtImageCopyCaptureManagerV1> mgr,
+                                       SP<CCExtOutputImageCaptureSourceManagerV1> outputSourceMgr) :
+    m_pSession(pSession), m_pManager(mgr), m_pOutputSourceManager(outputSourceMgr) {
+    ;
+}
+
+// grows the box a buffer's next capture has to redraw by a frame's damage
+static void addBufferDamage(SBuffer* buffer, int32_t x, int32_t y, int32_t width, int32_t height) {
+    auto& damage = buffer->damage;
+
+    if (damage.full || width <= 0 || height <= 0)
+        return;
+
+    if (damage.x1 >= damage.x2) {
+        damage.x1 = x;
+        damage.y1 = y;
+        damage.x2 = x + width;
+        damage.y2 = y + height;
+        return;
+    }
+
+    damage.x1 = std::min(damage.x1, x);
+    damage.y1 = std::min(damage.y1, y);
+    damage.x2 = std::max(damage.x2, x + width);
+    damage.y2 = std::max(damage.y2, y + height);
+}
+
+void CExtCaptureBackend::beginConstraints() {
+    if (m_sConstraints.incoming)
+        return;
+
+    // a new set replaces the old one entirely
+    m_sConstraints.incoming                        = true;
+    m_sConstraints.known                           = false;
+    m_pSession->sharingData.frameInfoSHM.fmt       = DRM_FORMAT_INVALID;
+    m_pSession->sharingData.frameInfoDMA.fmt       = DRM_FORMAT_INVALID;
+    m_pSession->sharingData.frameInfoDMA.modifiers = std::nullopt;
+    m_pSession->sharingData.frameInfoDMA.device    = std::nullopt;
+}
+
+bool CExtCaptureBackend::createSession() {
+    const auto POUTPUT = g_pPortalManager->getOutputFromName(m_pSession->selection.output);
+
+    if (!POUTPUT) {
+        Debug::log(ERR, "[screencopy] Output {} not found??", m_pSession->selection.output);
+        return false;
+    }
+
+    const uint32_t OPTIONS = m_pSession->cursorMode == EMBEDDED ? EXT_IMAGE_COPY_CAPTURE_MANAGER_V1_OPTIONS_PAINT_CURSORS : 0;
+
+    m_pSource         = makeShared<CCExtImageCaptureSourceV1>(m_pOutputSourceManager->sendCreateSource(POUTPUT->output->resource()));
+    m_pCaptureSession = makeShared<CCExtImageCopyCaptureSessionV1>(m_pManager->sendCreateSession(m_pSource->resource(), (extImageCopyCaptureManagerV1Options)OPTIONS));
+
+    useSessionQueue(m_pSession, m_pCaptureSession->resource());
+
+    if (m_pSession->cursorMode == METADATA)
+        m_pCursor = std::make_unique<CExtCursorCapture>(m_pSession, m_pManager, m_pSource, g_pPortalManager->m_sWaylandConnection.pointer);
+
+    m_pCaptureSession->setBufferSize([this](CCExtImageCopyCaptureSessionV1* r, uint32_t width, uint32_t height) {
+        Debug::log(TRACE, "[sc] extOnBufferSize for {}: {}x{}", (void*)m_pSession, width, height);
+
+        beginConstraints();
+
+        m_pSession->sharingData.frameInfoSHM.w = width;
+        m_pSession->sharingData.frameInfoSHM.h = height;
+        m_pSession->sharingData.frameInfoDMA.w = width;
+        m_pSession->sharingData.frameInfoDMA.h = height;
+    });
+    m_pCaptureSession->setShmFormat([this](CCExtImageCopyCaptureSessionV1* r, auto format) {
+        Debug::log(TRACE, "[sc] extOnShmFormat for {}: {}", (void*)m_pSession, (uint32_t)format);
+
+        beginConstraints();
+
+        // formats come in order of preference, take the first one we can handle
+        if (m_pSession->sharingData.frameInfoSHM.fmt != DRM_FORMAT_INVALID || !isUsableSHMFormat((wl_shm_format)format))
+            return;
+
+        m_pSession->sharingData.frameInfoSHM.fmt = drmFourccFromSHM((wl_shm_format)format);
+    });
+    m_pCaptureSession->setDmabufDevice([this](CCExtImageCopyCaptureSessionV1* r, wl_array* device) {
+        Debug::log(TRACE, "[sc] extOnDmabufDevice for {}", (void*)m_pSession);
+
+        beginConstraints();
+
+        dev_t dev = 0;
+        if (device->size != sizeof(dev)) {
+            Debug::log(ERR, "[screencopy] ext capture session sent a dmabuf device of {} bytes", device->size);
+            return;
+        }
+
+        memcpy(&dev, device->data, sizeof(dev));
+        m_pSession->sharingData.frameInfoDMA.device = dev;
+    });
+    m_pCaptureSession->setDmabufFormat([this](CCExtImageCopyCaptureSessionV1* r, uint32_t format, wl_array* modifiers) {
+        Debug::log(TRACE, "[sc] extOnDmabufFormat for {}: {}", (void*)m_pSession, format);
+
+        beginConstraints();
+
+        if (m_pSession->sharingData.frameInfoDMA.fmt != DRM_FORMAT_INVALID || !isUsableFourcc(format))
+            return;
+
+        m_pSession->sharingData.frameInfoDMA.fmt = format;
+
+        // only these import on the source's side, build_modifierlist keeps the ones we can allocate as well
+        const auto PMODS = (const uint64_t*)modifiers->data;
+        m_pSession->sharingData.frameInfoDMA.modifiers.emplace(PMODS, PMODS + modifiers->size / sizeof(uint64_t));
+    });
+    m_pCaptureSession->setDone([this](CCExtImageCopyCaptureSessionV1* r) {
+        Debug::log(TRACE, "[sc] extOnDone for {}", (void*)m_pSession);
+
+        auto& shm = m_pSession->sharingData.frameInfoSHM;
+
+        // ext leaves the stride to us
+        shm.stride = shm.w * 4;
+        shm.size   = shm.stride * shm.h;
+
+        if (shm.fmt == DRM_FORMAT_INVALID)
+            Debug::log(ERR, "[screencopy] ext capture session offered no usable shm format");
+
+        m_sConstraints.incoming = false;
+        m_sConstraints.known    = true;
+
+        if (m_sConstraints.frameWaits && m_pFrame) {
+            m_sConstraints.frameWaits = false;
+            m_pSession->onBufferDone();
+        }
+    });
+    m_pCaptureSession->setStopped([this](CCExtImageCopyCaptureSessionV1* r) {
+        Debug::log(LOG, "[screencopy] ext capture session for {} stopped", m_pSession->selection.output);
+
+        m_bStopped = true;
+        m_pFrame.reset();
+        m_pSession->onFrameFailed(true);
+    });
+
+    return true;
+}
+
+bool CExtCaptureBackend::startFrame() {
+    if (m_bStopped)
+        return false;
+
+    if (!m_pCaptureSession && !createSession())
+        return false;
+
+    m_pFrame = makeShared<CCExtImageCopyCaptureFrameV1>(m_pCaptureSession->sendCreateFrame());
+
+    useSessionQueue(m_pSession, m_pFrame->resource());
+
+    m_pFrame->setTransform([this](CCExtImageCopyCaptureFrameV1* r, auto transform) { m_pSession->sharingData.transform = (wl_output_transform)transform; });
+    m_pFrame->setDamage([this](CCExtImageCopyCaptureFrameV1* r, int32_t x, int32_t y, int32_t width, int32_t height) {
+        Debug::log(TRACE, "[sc] extOnDamage for {}", (void*)m_pSession);
+        m_pSession->addDamage(x, y, width, height);
+
+        // every buffer but the one this frame goes into now lags behind by this much
+        CPipewireLock lock;
+
+        const auto    PSTREAM = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(m_pSession);
+        if (!PSTREAM)
+            return;
+
+        for (auto& b : PSTREAM->buffers) {
+            if (b.get() != PSTREAM->currentPWBuffer)
+                addBufferDamage(b.get(), x, y, width, height);
+        }
+    });
+    m_pFrame->setPresentationTime([this](CCExtImageCopyCaptureFrameV1* r, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+        m_pSession->sharingData.tvSec  = ((((uint64_t)tv_sec_hi) << 32) + (uint64_t)tv_sec_lo);
+        m_pSession->sharingData.tvNsec = tv_nsec;
+    });
+    m_pFrame->setReady([this](CCExtImageCopyCaptureFrameV1* r) {
+        Debug::log(TRACE, "[sc] extOnReady for {}", (void*)m_pSession);
+
+        m_pSession->onFrameReady();
+
+        m_pFrame.reset();
+    });
+    m_pFrame->setFailed([this](CCExtImageCopyCaptureFrameV1* r, auto reason) {
+        Debug::log(TRACE, "[sc] extOnFailed for {}, reason {}", (void*)m_pSession, (uint32_t)reason);
+
+        // constraints changed under us, a new set is on its way. Anything else is fatal.
+        const bool FATAL    = (uint32_t)reason != EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS;
+        const auto PSESSION = m_pSession;
+
+        // copyTo cleared the buffer's damage, but who knows what the compositor wrote into it
+        if (m_bCopied) {
+            CPipewireLock lock;
+
+            const auto    PSTREAM = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(m_pSession);
+            if (PSTREAM && PSTREAM->currentPWBuffer)
+                PSTREAM->currentPWBuffer->damage.full = true;
+        }
+
+        m_pFrame.reset();
+        PSESSION->onFrameFailed(FATAL);
+    });
+
+    // constraints are only sent once per session, and again when they change
+    if (!m_sConstraints.known) {
+        m_sConstraints.frameWaits = true;
+        return true;
+    }
+
+    m_pSession->onBufferDone();
+    return true;
+}
+
+void CExtCaptureBackend::copyTo(SBuffer* buffer, SP<CCWlBuffer> target) {
+    m_pFrame->sendAttachBuffer(target->resource());
+
+    // the compositor only redraws what we say changed in the buffer since it last went through a capture
+    auto& damage = buffer->damage;
+    if (damage.full)
+        m_pFrame->sendDamageBuffer(0, 0, buffer->w, buffer->h);
+    else if (damage.x1 < damage.x2)
+        m_pFrame->sendDamageBuffer(damage.x1, damage.y1, damage.x2 - damage.x1, damage.y2 - damage.y1);
+
+    damage    = {.full = false};
+    m_bCopied = true;
+
+    m_pFrame->sendCapture();
+}
+
+void CExtCaptureBackend::dropFrame() {
+    m_pFrame.reset();
+    m_sConstraints.frameWaits = false;
+}
+
+bool CExtCaptureBackend::framePending() {
+    return m_pFrame;
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include "../portals/Screencopy.hpp"
+#include "wlr-screencopy-unstable-v1.hpp"
+#include "hyprland-toplevel-export-v1.hpp"
+#include "ext-image-copy-capture-v1.hpp"
+#include "ext-image-capture-source-v1.hpp"
+
+// Captures frames for a single screencopy session.
+// Buffer constraints, damage and frame metadata are written to the session's sharingData, and
+// progress is reported through SSession::onBufferDone, onFrameReady and onFrameFailed.
+class ICaptureBackend {
+  public:
+    virtual ~ICaptureBackend() = default;
+
+    // requests a new frame, false if none could be requested
+    virtual bool startFrame() = 0;
+
+    // copies the pending frame into target, a wl_buffer of the buffer. Only valid after onBufferDone.
+    virtual void copyTo(SBuffer* buffer, SP<CCWlBuffer> target) = 0;
+
+    // drops the pending frame, if any
+    virtual void dropFrame() = 0;
+
+    virtual bool framePending() = 0;
+
+    // whether the damage reported for a frame means anything, or it's always the whole frame
+    virtual bool reportsDamage() {
+        return true;
+    }
+};
+
+// zwlr_screencopy_manager_v1: one frame object per frame, constraints resent every time
+class CWlrCaptureBackend : public ICaptureBackend {
+  public:
+    CWlrCaptureBackend(CScreencopyPortal::SSession* pSession, SP<CCZwlrScreencopyManagerV1> mgr);
+
+    virtual bool startFrame();
+    virtual void copyTo(SBuffer* buffer, SP<CCWlBuffer> target);
+    virtual void dropFrame();
+    virtual bool framePending();
+
+  private:
+    CScreencopyPortal::SSession*  m_pSession = nullptr;
+    SP<CCZwlrScreencopyManagerV1> m_pManager;
+    SP<CCZwlrScreencopyFrameV1>   m_pFrame;
+};
+
+// hyprland_toplevel_export_manager_v1: like wlr screencopy, but for windows
+class CToplevelExportCaptureBackend : public ICaptureBackend {
+  public:
+    CToplevelExportCaptureBackend(CScreencopyPortal::SSession* pSession, SP<CCHyprlandToplevelExportManagerV1> mgr);
+
+    virtual bool startFrame();
+    virtual void copyTo(SBuffer* buffer, SP<CCWlBuffer> target);
+    virtual void dropFrame();
+    virtual bool framePending();
+    virtual bool reportsDamage();
+
+  private:
+    CScreencopyPortal::SSession*          m_pSession = nullptr;
+    SP<CCHyprlandToplevelExportManagerV1> m_pManager;
+    SP<CCHyprlandToplevelExportFrameV1>   m_pFrame;
+};
+
+class CRegionCaptureBackend;
+
+// One wlr capture of a whole output, shared by all region shares on it with the same cursor mode.
+// The frame is captured once into an shm buffer of ours, and every region copies its part out of it.
+class COutputCapture {
+  public:
+    struct SRect {
+        uint32_t x = 0, y = 0, w = 0, h = 0;
+    };
+
+    COutputCapture(const std::string& output, bool overlayCursor, SP<CCZwlrScreencopyManagerV1> mgr);
+    ~COutputCapture();
+
+    // the region wants a frame. It joins the one being captured if that wasn't copied yet, otherwise it gets the next one.
+    void               request(CRegionCaptureBackend* pRegion);
+    void               cancel(CRegionCaptureBackend* pRegion);
+
+    std::string        m_sOutput;
+    bool               m_bOverlayCursor = false;
+    WP<COutputCapture> m_pSelf;
+
+    // not any one session's, so its frames get a queue of their own. See CScreencopyPortal::dispatchCaptureQueues
+    wl_event_queue*    m_pEventQueue = nullptr;
+
+  private:
+    void                                start();
+    void                                fail();
+    bool                                allocate(uint32_t fmt, uint32_t w, uint32_t h, uint32_t stride);
+    void                                release();
+
+    SP<CCZwlrScreencopyManagerV1>       m_pManager;
+    SP<CCZwlrScreencopyFrameV1>         m_pFrame;
+    bool                                m_bCopying = false;
+    uint64_t                            m_iFrame   = 0; // frames captured so far
+
+    std::vector<CRegionCaptureBackend*> m_vCapturing; // get the frame in flight
+    std::vector<CRegionCaptureBackend*> m_vWaiting;   // get the next one
+
+    struct {
+        uint32_t w = 0, h = 0, stride = 0, fmt = 0;
+    } m_sConstraints;
+
+    struct {
+        SP<CCWlBuffer> buffer;
+        int            fd   = -1;
+        void*          data = nullptr;
+        uint32_t       w = 0, h = 0, stride = 0, fmt = 0, size = 0;
+    } m_sBuffer;
+
+    // damage of the frame in flight, in buffer pixels
+    std::vector<SRect> m_vDamage;
+};
+
+// A TYPE_GEOMETRY share cropped out of a COutputCapture with the cpu, instead of a capture of its own.
+// Only used with screencopy:share_region_captures, see CScreencopyPortal::createBackend. Frames are always shm.
+class CRegionCaptureBackend : public ICaptureBackend {
+  public:
+    CRegionCaptureBackend(CScreencopyPortal::SSession* pSession, SP<COutputCapture> capture);
+    virtual ~CRegionCaptureBackend();
+
+    virtual bool startFrame();
+    virtual void copyTo(SBuffer* buffer, SP<CCWlBuffer> target);
+    virtual void dropFrame();
+    virtual bool framePending();
+
+    // from the COutputCapture
+    void onSharedBufferDone(uint32_t fmt, uint32_t w, uint32_t h);
+    void onSharedFrame(const uint8_t* data, uint32_t stride, uint64_t frame, const std::vector<COutputCapture::SRect>& damage, uint64_t tvSec, uint32_t tvNsec);
+    void onSharedFailed();
+
+  private:
+    CScreencopyPortal::SSession* m_pSession = nullptr;
+    SP<COutputCapture>           m_pCapture;
+    bool                         m_bPending = false;
+    SBuffer*                     m_pTarget  = nullptr;
+
+    // the shared frame this region last got. Damage is only known relative to the frame before.
+    uint64_t m_iLastFrame = 0;
+
+    // the region in buffer pixels of the shared frame, and their bytes per pixel
+    struct {
+        uint32_t x = 0, y = 0, w = 0, h = 0, bpp = 0;
+    } m_sCrop;
+};
+
+// ext_image_copy_capture_cursor_session_v1: tracks the pointer over a source and captures its bitmap,
+// written to the session's cursor state for METADATA cursor mode
+class CExtCursorCapture {
+  public:
+    CExtCursorCapture(CScreencopyPortal::SSession* pSession, SP<CCExtImageCopyCaptureManagerV1> mgr, SP<CCExtImageCaptureSourceV1> source, SP<CCWlPointer> pointer);
+    ~CExtCursorCapture();
+
+  private:
+    bool                                     allocate();
+    void                                     release();
+    void                                     capture();
+
+    CScreencopyPortal::SSession*             m_pSession = nullptr;
+    SP<CCExtImageCopyCaptureCursorSessionV1> m_pCursorSession;
+    SP<CCExtImageCopyCaptureSessionV1>       m_pCaptureSession;
+    SP<CCExtImageCopyCaptureFrameV1>         m_pFrame;
+    bool                                     m_bStopped = false;
+
+    struct {
+        uint32_t w = 0, h = 0, fmt = 0;
+    } m_sConstraints;
+
+    // the bitmap is captured into a single shm buffer, mapped for reading
+    struct {
+        SP<CCWlBuffer> buffer;
+        int            fd      = -1;
+        void*          data    = nullptr;
+        uint32_t       w       = 0, h = 0, fmt = 0, size = 0;
+        bool           fresh   = true; // never captured into, needs full damage
+        bool           damaged = false;
+    } m_sBitmap;
+};
+
+// ext_image_copy_capture_manager_v1: a persistent capture session, constraints are only resent when they change
+class CExtCaptureBackend : public ICaptureBackend {
+  public:
+    CExtCaptureBackend(CScreencopyPortal::SSession* pSession, SP<CCExtImageCopyCaptureManagerV1> mgr, SP<CCExtOutputImageCaptureSourceManagerV1> outputSourceMgr);
+
+    virtual bool startFrame();
+    virtual void copyTo(SBuffer* buffer, SP<CCWlBuffer> target);
+    virtual void dropFrame();
+    virtual bool framePending();
+
+  private:
+    bool                                       createSession();
+    void                                       beginConstraints();
+
+    CScreencopyPortal::SSession*               m_pSession = nullptr;
+    SP<CCExtImageCopyCaptureManagerV1>         m_pManager;
+    SP<CCExtOutputImageCaptureSourceManagerV1> m_pOutputSourceManager;
+
+    SP<CCExtImageCaptureSourceV1>              m_pSource;
+    SP<CCExtImageCopyCaptureSessionV1>         m_pCaptureSession;
+    SP<CCExtImageCopyCaptureFrameV1>           m_pFrame;
+    std::unique_ptr<CExtCursorCapture>         m_pCursor;
+    bool                                       m_bStopped = false;
+    bool                                       m_bCopied  = false; // the pending frame has a buffer attached
+
+    struct {
+        bool known      = false; // got a done for the current set
+        bool incoming   = false; // a new set started, done not received yet
+        bool frameWaits = false; // the pending frame waits for done
+    } m_sConstraints;
+};
@@ -0,0 +1,160 @@
+#include "CaptureScheduler.hpp"
+#include "../core/PortalManager.hpp"
+#include "../helpers/Log.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+// sessions on one output whose deadlines are this close share a wakeup
+constexpr static float COALESCE_MS = 4;
+// a capture running longer than this is assumed lost, and stops counting against the limit
+constexpr static float CAPTURE_TIMEOUT_MS = 1000;
+
+static float msBetween(std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(b - a).count() / 1000.F;
+}
+
+static size_t maxConcurrent() {
+    static auto* const* PMAXCONCURRENT = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:max_concurrent_captures")->getDataStaticPtr();
+
+    return std::max(**PMAXCONCURRENT, (Hyprlang::INT)0);
+}
+
+static int priorityOf(const std::string& appid) {
+    static auto* const* PPRIORITYAPPS = (Hyprlang::STRING* const)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:priority_apps")->getDataStaticPtr();
+
+    std::stringstream   list{std::string{*PPRIORITYAPPS}};
+    std::string         app;
+    while (std::getline(list, app, ',')) {
+        std::erase_if(app, ::isspace);
+        if (!app.empty() && app == appid)
+            return 1;
+    }
+
+    return 0;
+}
+
+CCaptureScheduler::SEntry* CCaptureScheduler::entryFor(CScreencopyPortal::SSession* pSession) {
+    for (auto& e : m_vEntries) {
+        if (e->session.get() == pSession)
+            return e.get();
+    }
+
+    const auto PENTRY = m_vEntries.emplace_back(std::make_unique<SEntry>()).get();
+    PENTRY->session   = pSession->self;
+    PENTRY->priority  = priorityOf(pSession->appid);
+    if (pSession->selection.type == TYPE_OUTPUT || pSession->selection.type == TYPE_GEOMETRY)
+        PENTRY->output = pSession->selection.output;
+
+    Debug::log(LOG, "[scheduler] tracking session {} with priority {}", pSession->appid, PENTRY->priority);
+
+    return PENTRY;
+}
+
+void CCaptureScheduler::schedule(CScreencopyPortal::SSession* pSession, float ms) {
+    const auto NOW    = std::chrono::steady_clock::now();
+    const auto PENTRY = entryFor(pSession);
+
+    PENTRY->state    = CAPTURE_PENDING;
+    PENTRY->deadline = NOW + std::chrono::microseconds((int64_t)(ms * 1000));
+
+    // ride along with a session on the same output that wakes up around the same time
+    if (!PENTRY->output.empty()) {
+        for (auto& e : m_vEntries) {
+            if (e.get() == PENTRY || e->state != CAPTURE_PENDING || e->output != PENTRY->output)
+                continue;
+
+            if (std::abs(msBetween(e->deadline, PENTRY->deadline)) <= COALESCE_MS) {
+                PENTRY->deadline = e->deadline;
+                break;
+            }
+        }
+    }
+
+    arm();
+}
+
+void CCaptureScheduler::remove(CScreencopyPortal::SSession* pSession) {
+    // from the session's destructor, its weak pointers are already gone
+    const auto REMOVED = std::erase_if(m_vEntries, [pSession](const auto& e) { return !e->session || e->session.get() == pSession; });
+
+    if (REMOVED == 0)
+        return;
+
+    Debug::log(TRACE, "[scheduler] stopped tracking {} sessions", REMOVED);
+
+    // a slot may have freed up for a capture that's waiting
+    arm();
+}
+
+size_t CCaptureScheduler::running(std::chrono::steady_clock::time_point now) {
+    return std::count_if(m_vEntries.begin(), m_vEntries.end(),
+                         [now](const auto& e) { return e->state == CAPTURE_RUNNING && msBetween(e->started, now) < CAPTURE_TIMEOUT_MS; });
+}
+
+void CCaptureScheduler::arm() {
+    const auto NOW  = std::chrono::steady_clock::now();
+    SEntry*    next = nullptr;
+
+    for (auto& e : m_vEntries) {
+        if (e->state == CAPTURE_PENDING && (!next || e->deadline < next->deadline))
+            next = e.get();
+    }
+
+    if (!next)
+        return;
+
+    auto target = next->deadline;
+
+    // full and already late. The next finished capture re-arms us, this is only in case one got lost.
+    if (maxConcurrent() > 0 && running(NOW) >= maxConcurrent() && target <= NOW)
+        target = NOW + std::chrono::milliseconds((int64_t)CAPTURE_TIMEOUT_MS);
+
+    // an earlier wakeup is already on its way
+    if (m_bArmed && m_tArmedFor <= target + std::chrono::microseconds((int64_t)(COALESCE_MS * 1000)))
+        return;
+
+    m_bArmed    = true;
+    m_tArmedFor = target;
+
+    g_pPortalManager->addTimer({std::max(msBetween(NOW, target), 0.F), [this, FOR = target]() {
+                                    if (FOR == m_tArmedFor)
+                                        m_bArmed = false;
+                                    dispatch();
+                                }});
+}
+
+void CCaptureScheduler::dispatch() {
+    const auto NOW = std::chrono::steady_clock::now();
+
+    std::erase_if(m_vEntries, [](const auto& e) { return !e->session; });
+
+    std::vector<SEntry*> due;
+    for (auto& e : m_vEntries) {
+        if (e->state == CAPTURE_PENDING && msBetween(NOW, e->deadline) <= COALESCE_MS)
+            due.push_back(e.get());
+    }
+
+    // priority first, then earliest deadline
+    std::sort(due.begin(), due.end(), [](SEntry* a, SEntry* b) { return a->priority != b->priority ? a->priority > b->priority : a->deadline < b->deadline; });
+
+    size_t runningNow = running(NOW);
+
+    for (const auto& e : due) {
+        if (maxConcurrent() > 0 && runningNow >= maxConcurrent()) {
+            Debug::log(TRACE, "[scheduler] {} captures running, {} waiting", runningNow, due.size());
+            break;
+        }
+
+        // the session may schedule itself again from within startCopy, don't overwrite that
+        e->state   = CAPTURE_RUNNING;
+        e->started = NOW;
+
+        if (e->session->startCopy())
+            runningNow++;
+        else if (e->state == CAPTURE_RUNNING)
+            e->state = CAPTURE_IDLE;
+    }
+
+    arm();
+}
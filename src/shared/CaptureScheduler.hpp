@@ -0,0 +1,44 @@
+#pragma once
+
+#include "../portals/Screencopy.hpp"
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+enum eCaptureState {
+    CAPTURE_IDLE = 0,
+    CAPTURE_PENDING,
+    CAPTURE_RUNNING,
+};
+
+// Starts the captures of all screencopy sessions from a single timer.
+// Sessions on the same output with close deadlines are captured on the same wakeup. With screencopy:max_concurrent_captures,
+// due captures beyond the limit wait for a running one to finish, picked by priority (screencopy:priority_apps) and then
+// earliest deadline.
+class CCaptureScheduler {
+  public:
+    // the session wants its next frame in ms. Also means its last capture is done.
+    void schedule(CScreencopyPortal::SSession* pSession, float ms);
+    // the session stops capturing, paused or gone. Whatever it has running no longer counts against the limit.
+    void remove(CScreencopyPortal::SSession* pSession);
+
+  private:
+    struct SEntry {
+        Hyprutils::Memory::CWeakPointer<CScreencopyPortal::SSession> session;
+        std::string                                                  output; // empty for windows, never coalesced
+        int                                                          priority = 0;
+        eCaptureState                                                state    = CAPTURE_IDLE;
+        std::chrono::steady_clock::time_point                        deadline, started;
+    };
+
+    SEntry*                               entryFor(CScreencopyPortal::SSession* pSession);
+    void                                  dispatch();
+    void                                  arm();
+    size_t                                running(std::chrono::steady_clock::time_point now);
+
+    std::vector<std::unique_ptr<SEntry>>  m_vEntries;
+
+    bool                                  m_bArmed = false;
+    std::chrono::steady_clock::time_point m_tArmedFor;
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <libdrm/drm_fourcc.h>
+extern "C" {
+#include <spa/param/video/raw.h>
+}
+
+// A pixel format we can capture and hand to pipewire.
+struct SFormatInfo {
+    uint32_t         drm      = DRM_FORMAT_INVALID;
+    spa_video_format pw       = SPA_VIDEO_FORMAT_UNKNOWN;
+    spa_video_format pwOpaque = SPA_VIDEO_FORMAT_UNKNOWN; // same layout with the alpha channel ignored, only for formats with alpha
+    uint32_t         bpp      = 0;                        // bytes per pixel of the first plane
+    bool             alpha    = false;
+    uint32_t         planes   = 1;
+};
+
+inline constexpr std::array<SFormatInfo, 18> FORMATS = {{
+    {DRM_FORMAT_ARGB8888, SPA_VIDEO_FORMAT_BGRA, SPA_VIDEO_FORMAT_BGRx, 4, true, 1},
+    {DRM_FORMAT_XRGB8888, SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_UNKNOWN, 4, false, 1},
+    {DRM_FORMAT_RGBA8888, SPA_VIDEO_FORMAT_ABGR, SPA_VIDEO_FORMAT_xBGR, 4, true, 1},
+    {DRM_FORMAT_RGBX8888, SPA_VIDEO_FORMAT_xBGR, SPA_VIDEO_FORMAT_UNKNOWN, 4, false, 1},
+    {DRM_FORMAT_ABGR8888, SPA_VIDEO_FORMAT_RGBA, SPA_VIDEO_FORMAT_RGBx, 4, true, 1},
+    {DRM_FORMAT_XBGR8888, SPA_VIDEO_FORMAT_RGBx, SPA_VIDEO_FORMAT_UNKNOWN, 4, false, 1},
+    {DRM_FORMAT_BGRA8888, SPA_VIDEO_FORMAT_ARGB, SPA_VIDEO_FORMAT_xRGB, 4, true, 1},
+    {DRM_FORMAT_BGRX8888, SPA_VIDEO_FORMAT_xRGB, SPA_VIDEO_FORMAT_UNKNOWN, 4, false, 1},
+    {DRM_FORMAT_NV12, SPA_VIDEO_FORMAT_NV12, SPA_VIDEO_FORMAT_UNKNOWN, 1, false, 2},
+    {DRM_FORMAT_XRGB2101010, SPA_VIDEO_FORMAT_xRGB_210LE, SPA_VIDEO_FORMAT_UNKNOWN, 4, false, 1},
+    {DRM_FORMAT_XBGR2101010, SPA_VIDEO_FORMAT_xBGR_210LE, SPA_VIDEO_FORMAT_UNKNOWN, 4, false, 1},
+    {DRM_FORMAT_RGBX1010102, SPA_VIDEO_FORMAT_RGBx_102LE, SPA_VIDEO_FORMAT_UNKNOWN, 4, false, 1},
+    {DRM_FORMAT_BGRX1010102, SPA_VIDEO_FORMAT_BGRx_102LE, SPA_VIDEO_FORMAT_UNKNOWN, 4, false, 1},
+    {DRM_FORMAT_ARGB2101010, SPA_VIDEO_FORMAT_ARGB_210LE, SPA_VIDEO_FORMAT_xRGB_210LE, 4, true, 1},
+    {DRM_FORMAT_ABGR2101010, SPA_VIDEO_FORMAT_ABGR_210LE, SPA_VIDEO_FORMAT_xBGR_210LE, 4, true, 1},
+    {DRM_FORMAT_RGBA1010102, SPA_VIDEO_FORMAT_RGBA_102LE, SPA_VIDEO_FORMAT_RGBx_102LE, 4, true, 1},
+    {DRM_FORMAT_BGRA1010102, SPA_VIDEO_FORMAT_BGRA_102LE, SPA_VIDEO_FORMAT_BGRx_102LE, 4, true, 1},
+    {DRM_FORMAT_BGR888, SPA_VIDEO_FORMAT_BGR, SPA_VIDEO_FORMAT_UNKNOWN, 3, false, 1},
+}};
+
+// nullptr for formats we don't know
+constexpr const SFormatInfo* formatFromDrm(uint32_t drm) {
+    for (const auto& f : FORMATS) {
+        if (f.drm == drm)
+            return &f;
+    }
+    return nullptr;
+}
+
+constexpr const SFormatInfo* formatFromPW(spa_video_format pw) {
+    for (const auto& f : FORMATS) {
+        if (f.pw == pw)
+            return &f;
+    }
+    return nullptr;
+}
+
+// for code specialized on a format, fails to compile for unknown ones
+template <uint32_t DRM>
+constexpr const SFormatInfo& formatInfo() {
+    constexpr auto PFORMAT = formatFromDrm(DRM);
+    static_assert(PFORMAT, "unknown format");
+    return *PFORMAT;
+}
+
+// both directions have to be unambiguous
+constexpr bool formatsUnique() {
+    for (size_t i = 0; i < FORMATS.size(); ++i) {
+        for (size_t j = i + 1; j < FORMATS.size(); ++j) {
+            if (FORMATS[i].drm == FORMATS[j].drm || FORMATS[i].pw == FORMATS[j].pw)
+                return false;
+        }
+    }
+    return true;
+}
+
+static_assert(formatsUnique(), "duplicate format in FORMATS");
+static_assert(formatInfo<DRM_FORMAT_ARGB8888>().pw == SPA_VIDEO_FORMAT_BGRA);
+
+// How much memory bandwidth a modifier costs, cheapest first
+enum eModifierClass : uint8_t {
+    MODIFIER_COMPRESSED = 0,
+    MODIFIER_TILED,
+    MODIFIER_IMPLICIT, // the driver picks, usually tiled but can't be asked for through the modifier api
+    MODIFIER_LINEAR,
+};
+
+constexpr eModifierClass modifierClass(uint64_t mod) {
+    if (mod == DRM_FORMAT_MOD_INVALID)
+        return MODIFIER_IMPLICIT;
+    if (mod == DRM_FORMAT_MOD_LINEAR)
+        return MODIFIER_LINEAR;
+
+    switch (mod >> 56) {
+        case DRM_FORMAT_MOD_VENDOR_INTEL:
+            if (mod == I915_FORMAT_MOD_Y_TILED_CCS || mod == I915_FORMAT_MOD_Yf_TILED_CCS || mod == I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS ||
+                mod == I915_FORMAT_MOD_Y_TILED_GEN12_MC_CCS || mod == I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS_CC || mod == I915_FORMAT_MOD_4_TILED_DG2_RC_CCS ||
+                mod == I915_FORMAT_MOD_4_TILED_DG2_MC_CCS || mod == I915_FORMAT_MOD_4_TILED_DG2_RC_CCS_CC)
+                return MODIFIER_COMPRESSED;
+            break;
+        case DRM_FORMAT_MOD_VENDOR_AMD:
+            if (AMD_FMT_MOD_GET(DCC, mod))
+                return MODIFIER_COMPRESSED;
+            break;
+        case DRM_FORMAT_MOD_VENDOR_ARM:
+            // the type sits right below the vendor, AFBC is 0 and AFRC 2
+            if (((mod >> 52) & 0xf) == DRM_FORMAT_MOD_ARM_TYPE_AFBC || ((mod >> 52) & 0xf) == DRM_FORMAT_MOD_ARM_TYPE_AFRC)
+                return MODIFIER_COMPRESSED;
+            break;
+        case DRM_FORMAT_MOD_VENDOR_NVIDIA:
+            // block linear with a compression type
+            if ((mod & 0x10) && ((mod >> 23) & 0x7))
+                return MODIFIER_COMPRESSED;
+            break;
+        default: break;
+    }
+
+    return MODIFIER_TILED;
+}
+
+static_assert(modifierClass(DRM_FORMAT_MOD_LINEAR) == MODIFIER_LINEAR);
+static_assert(modifierClass(I915_FORMAT_MOD_X_TILED) == MODIFIER_TILED);
+static_assert(modifierClass(I915_FORMAT_MOD_Y_TILED_CCS) == MODIFIER_COMPRESSED);
+static_assert(modifierClass(DRM_FORMAT_MOD_ARM_AFBC(AFBC_FORMAT_MOD_BLOCK_SIZE_16x16)) == MODIFIER_COMPRESSED);
@@ -1,4 +1,5 @@
 #include "ScreencopyShared.hpp"
+#include "Formats.hpp"
 #include "../helpers/MiscFunctions.hpp"
 #include <wayland-client.h>
 #include "../helpers/Log.hpp"
@@ -8,6 +9,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <thread>
 
 #include <hyprutils/os/Process.hpp>
 using namespace Hyprutils::OS;
@@ -39,33 +41,8 @@ std::string buildWindowList() {
     return result;
 }
 
-SSelectionData promptForScreencopySelection() {
-    SSelectionData      data;
-
-    const char*         WAYLAND_DISPLAY             = getenv("WAYLAND_DISPLAY");
-    const char*         XCURSOR_SIZE                = getenv("XCURSOR_SIZE");
-    const char*         HYPRLAND_INSTANCE_SIGNATURE = getenv("HYPRLAND_INSTANCE_SIGNATURE");
-
-    static auto* const* PALLOWTOKENBYDEFAULT =
-        (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:allow_token_by_default")->getDataStaticPtr();
-    static auto* const*      PCUSTOMPICKER = (Hyprlang::STRING* const)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:custom_picker_binary")->getDataStaticPtr();
-
-    std::vector<std::string> args;
-    if (**PALLOWTOKENBYDEFAULT)
-        args.emplace_back("--allow-token");
-
-    CProcess proc(std::string{*PCUSTOMPICKER}.empty() ? "hyprland-share-picker" : *PCUSTOMPICKER, args);
-    proc.addEnv("WAYLAND_DISPLAY", WAYLAND_DISPLAY ? WAYLAND_DISPLAY : "");
-    proc.addEnv("QT_QPA_PLATFORM", "wayland");
-    proc.addEnv("XCURSOR_SIZE", XCURSOR_SIZE ? XCURSOR_SIZE : "24");
-    proc.addEnv("HYPRLAND_INSTANCE_SIGNATURE", HYPRLAND_INSTANCE_SIGNATURE ? HYPRLAND_INSTANCE_SIGNATURE : "0");
-    proc.addEnv("XDPH_WINDOW_SHARING_LIST", buildWindowList()); // buildWindowList will sanitize any shell stuff in case the picker (qt) does something funky? It shouldn't.
-
-    if (!proc.runSync())
-        return data;
-
-    const auto RETVAL    = proc.stdOut();
-    const auto RETVALERR = proc.stdErr();
+static SSelectionData parseScreencopySelection(const std::string& RETVAL, const std::string& RETVALERR) {
+    SSelectionData data;
 
     if (!RETVAL.contains("[SELECTION]")) {
         // failed
@@ -127,26 +104,40 @@ SSelectionData promptForScreencopySelection() {
     return data;
 }
 
+void promptForScreencopySelection(std::function<void(SSelectionData)> callback) {
+    const char*         WAYLAND_DISPLAY             = getenv("WAYLAND_DISPLAY");
+    const char*         XCURSOR_SIZE                = getenv("XCURSOR_SIZE");
+    const char*         HYPRLAND_INSTANCE_SIGNATURE = getenv("HYPRLAND_INSTANCE_SIGNATURE");
+
+    static auto* const* PALLOWTOKENBYDEFAULT =
+        (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:allow_token_by_default")->getDataStaticPtr();
+    static auto* const*      PCUSTOMPICKER = (Hyprlang::STRING* const)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:custom_picker_binary")->getDataStaticPtr();
+
+    std::vector<std::string> args;
+    if (**PALLOWTOKENBYDEFAULT)
+        args.emplace_back("--allow-token");
+
+    // everything touching our state is done here, on the main thread. Only the picker itself runs in the background.
+    auto proc = std::make_shared<CProcess>(std::string{*PCUSTOMPICKER}.empty() ? "hyprland-share-picker" : *PCUSTOMPICKER, args);
+    proc->addEnv("WAYLAND_DISPLAY", WAYLAND_DISPLAY ? WAYLAND_DISPLAY : "");
+    proc->addEnv("QT_QPA_PLATFORM", "wayland");
+    proc->addEnv("XCURSOR_SIZE", XCURSOR_SIZE ? XCURSOR_SIZE : "24");
+    proc->addEnv("HYPRLAND_INSTANCE_SIGNATURE", HYPRLAND_INSTANCE_SIGNATURE ? HYPRLAND_INSTANCE_SIGNATURE : "0");
+    proc->addEnv("XDPH_WINDOW_SHARING_LIST", buildWindowList()); // buildWindowList will sanitize any shell stuff in case the picker (qt) does something funky? It shouldn't.
+
+    std::thread([proc, callback]() {
+        const bool SUCCESS = proc->runSync();
+
+        g_pPortalManager->dispatchOnMainThread([proc, callback, SUCCESS]() { callback(SUCCESS ? parseScreencopySelection(proc->stdOut(), proc->stdErr()) : SSelectionData{}); });
+    }).detach();
+}
+
 wl_shm_format wlSHMFromDrmFourcc(uint32_t format) {
     switch (format) {
         case DRM_FORMAT_ARGB8888: return WL_SHM_FORMAT_ARGB8888;
         case DRM_FORMAT_XRGB8888: return WL_SHM_FORMAT_XRGB8888;
-        case DRM_FORMAT_RGBA8888:
-        case DRM_FORMAT_RGBX8888:
-        case DRM_FORMAT_ABGR8888:
-        case DRM_FORMAT_XBGR8888:
-        case DRM_FORMAT_BGRA8888:
-        case DRM_FORMAT_BGRX8888:
-        case DRM_FORMAT_NV12:
-        case DRM_FORMAT_XRGB2101010:
-        case DRM_FORMAT_XBGR2101010:
-        case DRM_FORMAT_RGBX1010102:
-        case DRM_FORMAT_BGRX1010102:
-        case DRM_FORMAT_ARGB2101010:
-        case DRM_FORMAT_ABGR2101010:
-        case DRM_FORMAT_RGBA1010102:
-        case DRM_FORMAT_BGRA1010102: return (wl_shm_format)format;
-        default: Debug::log(ERR, "[screencopy] Unknown format {}", format); abort();
+        // the rest of wl_shm formats match their drm fourcc
+        default: return (wl_shm_format)format;
     }
 }
 
@@ -154,48 +145,26 @@ uint32_t drmFourccFromSHM(wl_shm_format format) {
     switch (format) {
         case WL_SHM_FORMAT_ARGB8888: return DRM_FORMAT_ARGB8888;
         case WL_SHM_FORMAT_XRGB8888: return DRM_FORMAT_XRGB8888;
-        case WL_SHM_FORMAT_RGBA8888:
-        case WL_SHM_FORMAT_RGBX8888:
-        case WL_SHM_FORMAT_ABGR8888:
-        case WL_SHM_FORMAT_XBGR8888:
-        case WL_SHM_FORMAT_BGRA8888:
-        case WL_SHM_FORMAT_BGRX8888:
-        case WL_SHM_FORMAT_NV12:
-        case WL_SHM_FORMAT_XRGB2101010:
-        case WL_SHM_FORMAT_XBGR2101010:
-        case WL_SHM_FORMAT_RGBX1010102:
-        case WL_SHM_FORMAT_BGRX1010102:
-        case WL_SHM_FORMAT_ARGB2101010:
-        case WL_SHM_FORMAT_ABGR2101010:
-        case WL_SHM_FORMAT_RGBA1010102:
-        case WL_SHM_FORMAT_BGRA1010102:
-        case WL_SHM_FORMAT_BGR888: return (uint32_t)format;
-        default: Debug::log(ERR, "[screencopy] Unknown format {}", (int)format); abort();
+        default: break;
+    }
+
+    if (!formatFromDrm(format)) {
+        Debug::log(TRACE, "[screencopy] Unknown shm format {}, ignoring it", (uint32_t)format);
+        return DRM_FORMAT_INVALID;
     }
+
+    return (uint32_t)format;
 }
 
 spa_video_format pwFromDrmFourcc(uint32_t format) {
-    switch (format) {
-        case DRM_FORMAT_ARGB8888: return SPA_VIDEO_FORMAT_BGRA;
-        case DRM_FORMAT_XRGB8888: return SPA_VIDEO_FORMAT_BGRx;
-        case DRM_FORMAT_RGBA8888: return SPA_VIDEO_FORMAT_ABGR;
-        case DRM_FORMAT_RGBX8888: return SPA_VIDEO_FORMAT_xBGR;
-        case DRM_FORMAT_ABGR8888: return SPA_VIDEO_FORMAT_RGBA;
-        case DRM_FORMAT_XBGR8888: return SPA_VIDEO_FORMAT_RGBx;
-        case DRM_FORMAT_BGRA8888: return SPA_VIDEO_FORMAT_ARGB;
-        case DRM_FORMAT_BGRX8888: return SPA_VIDEO_FORMAT_xRGB;
-        case DRM_FORMAT_NV12: return SPA_VIDEO_FORMAT_NV12;
-        case DRM_FORMAT_XRGB2101010: return SPA_VIDEO_FORMAT_xRGB_210LE;
-        case DRM_FORMAT_XBGR2101010: return SPA_VIDEO_FORMAT_xBGR_210LE;
-        case DRM_FORMAT_RGBX1010102: return SPA_VIDEO_FORMAT_RGBx_102LE;
-        case DRM_FORMAT_BGRX1010102: return SPA_VIDEO_FORMAT_BGRx_102LE;
-        case DRM_FORMAT_ARGB2101010: return SPA_VIDEO_FORMAT_ARGB_210LE;
-        case DRM_FORMAT_ABGR2101010: return SPA_VIDEO_FORMAT_ABGR_210LE;
-        case DRM_FORMAT_RGBA1010102: return SPA_VIDEO_FORMAT_RGBA_102LE;
-        case DRM_FORMAT_BGRA1010102: return SPA_VIDEO_FORMAT_BGRA_102LE;
-        case DRM_FORMAT_BGR888: return SPA_VIDEO_FORMAT_BGR;
-        default: Debug::log(ERR, "[screencopy] Unknown format {}", (int)format); abort();
+    const auto PFORMAT = formatFromDrm(format);
+
+    if (!PFORMAT) {
+        Debug::log(TRACE, "[screencopy] Unknown format {}, pipewire can't carry it", format);
+        return SPA_VIDEO_FORMAT_UNKNOWN;
     }
+
+    return PFORMAT->pw;
 }
 
 std::string getRandName(std::string prefix) {
@@ -206,26 +175,17 @@ std::string getRandName(std::string prefix) {
 }
 
 spa_video_format pwStripAlpha(spa_video_format format) {
-    switch (format) {
-        case SPA_VIDEO_FORMAT_BGRA: return SPA_VIDEO_FORMAT_BGRx;
-        case SPA_VIDEO_FORMAT_ABGR: return SPA_VIDEO_FORMAT_xBGR;
-        case SPA_VIDEO_FORMAT_RGBA: return SPA_VIDEO_FORMAT_RGBx;
-        case SPA_VIDEO_FORMAT_ARGB: return SPA_VIDEO_FORMAT_xRGB;
-        case SPA_VIDEO_FORMAT_ARGB_210LE: return SPA_VIDEO_FORMAT_xRGB_210LE;
-        case SPA_VIDEO_FORMAT_ABGR_210LE: return SPA_VIDEO_FORMAT_xBGR_210LE;
-        case SPA_VIDEO_FORMAT_RGBA_102LE: return SPA_VIDEO_FORMAT_RGBx_102LE;
-        case SPA_VIDEO_FORMAT_BGRA_102LE: return SPA_VIDEO_FORMAT_BGRx_102LE;
-        default: return SPA_VIDEO_FORMAT_UNKNOWN;
-    }
+    const auto PFORMAT = formatFromPW(format);
+    return PFORMAT ? PFORMAT->pwOpaque : SPA_VIDEO_FORMAT_UNKNOWN;
 }
 
-spa_pod* build_buffer(spa_pod_builder* b, uint32_t blocks, uint32_t size, uint32_t stride, uint32_t datatype) {
+spa_pod* build_buffer(spa_pod_builder* b, uint32_t blocks, uint32_t size, uint32_t stride, uint32_t datatype, uint32_t metatypes, uint32_t buffers) {
     assert(blocks > 0);
     assert(datatype > 0);
     spa_pod_frame f[1];
 
     spa_pod_builder_push_object(b, &f[0], SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers);
-    spa_pod_builder_add(b, SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(XDPH_PWR_BUFFERS, XDPH_PWR_BUFFERS_MIN, 32), 0);
+    spa_pod_builder_add(b, SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(buffers, XDPH_PWR_BUFFERS_MIN, XDPH_PWR_BUFFERS_MAX), 0);
     spa_pod_builder_add(b, SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(blocks), 0);
     if (size > 0) {
         spa_pod_builder_add(b, SPA_PARAM_BUFFERS_size, SPA_POD_Int(size), 0);
@@ -235,6 +195,11 @@ spa_pod* build_buffer(spa_pod_builder* b, uint32_t blocks, uint32_t size, uint32
     }
     spa_pod_builder_add(b, SPA_PARAM_BUFFERS_align, SPA_POD_Int(XDPH_PWR_ALIGN), 0);
     spa_pod_builder_add(b, SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(datatype), 0);
+    if (metatypes > 0) {
+        // only matches consumers that support all of them
+        spa_pod_builder_prop(b, SPA_PARAM_BUFFERS_metaType, SPA_POD_PROP_FLAG_MANDATORY);
+        spa_pod_builder_int(b, metatypes);
+    }
     return (spa_pod*)spa_pod_builder_pop(b, &f[0]);
 }
 
@@ -314,6 +279,15 @@ void randname(char* buf) {
 }
 
 int anonymous_shm_open() {
+    // sealed against shrinking, so nobody can truncate the memory from under the other side's mappings
+    if (int fd = memfd_create("xdph-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING); fd >= 0) {
+        if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0)
+            Debug::log(WARN, "[screencopy] couldn't seal shm memfd: {}", strerror(errno));
+        return fd;
+    }
+
+    Debug::log(TRACE, "[screencopy] memfd_create failed, falling back to shm_open");
+
     char name[]  = "/xdph-shm-XXXXXX";
     int  retries = 100;
 
@@ -331,15 +305,3 @@ int anonymous_shm_open() {
 
     return -1;
 }
-
-SP<CCWlBuffer> import_wl_shm_buffer(int fd, wl_shm_format fmt, int width, int height, int stride) {
-    int size = stride * height;
-
-    if (fd < 0)
-        return nullptr;
-
-    auto pool = makeShared<CCWlShmPool>(g_pPortalManager->m_sWaylandConnection.shm->sendCreatePool(fd, size));
-    auto buf  = makeShared<CCWlBuffer>(pool->sendCreateBuffer(0, width, height, stride, fmt));
-
-    return buf;
-}
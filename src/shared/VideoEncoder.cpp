@@ -0,0 +1,521 @@
+#ifdef XDPH_ENCODER
+
+#include "VideoEncoder.hpp"
+#include "Formats.hpp"
+#include "../core/PortalManager.hpp"
+#include "../helpers/Log.hpp"
+
+#include <pipewire/pipewire.h>
+#include <spa/param/video/format-utils.h>
+#include <spa/param/buffers.h>
+#include <spa/buffer/meta.h>
+#include <vpx/vp8cx.h>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <memory>
+
+// x and y of a macroblock, damage is rounded up to these
+constexpr static uint32_t MB_SIZE          = 16;
+// in seconds, so consumers that lost track don't wait forever for a keyframe
+constexpr static uint32_t KEYFRAME_MAX_SEC = 5;
+constexpr static uint32_t MAX_THREADS      = 4;
+
+static void onStreamStateChanged(void* data, pw_stream_state old, pw_stream_state state, const char* error) {
+    ((CVideoEncoder*)data)->onStateChanged(state);
+}
+
+static void onStreamParamChanged(void* data, uint32_t id, const spa_pod* param) {
+    ((CVideoEncoder*)data)->onParamChanged(id, param);
+}
+
+static const pw_stream_events streamEvents = {
+    .version       = PW_VERSION_STREAM_EVENTS,
+    .state_changed = onStreamStateChanged,
+    .param_changed = onStreamParamChanged,
+};
+
+// byte offsets of r, g and b in a pixel of the 8 bit rgb formats, -1 for other formats
+constexpr static std::array<int, 3> rgbOffsets(uint32_t fmt) {
+    switch (fmt) {
+        case DRM_FORMAT_ARGB8888:
+        case DRM_FORMAT_XRGB8888: return {2, 1, 0};
+        case DRM_FORMAT_ABGR8888:
+        case DRM_FORMAT_XBGR8888:
+        case DRM_FORMAT_BGR888: return {0, 1, 2};
+        case DRM_FORMAT_RGBA8888:
+        case DRM_FORMAT_RGBX8888: return {3, 2, 1};
+        case DRM_FORMAT_BGRA8888:
+        case DRM_FORMAT_BGRX8888: return {1, 2, 3};
+        default: return {-1, -1, -1};
+    }
+}
+
+// BT.601 limited range, chroma averaged over 2x2 pixels. Only rows [y1, y2) of the w x h frame, all of them even.
+// One per format, so the pixel size and channel offsets are constants in the inner loop.
+template <uint32_t DRM>
+static void toI420(const uint8_t* src, uint32_t stride, uint32_t w, uint32_t h, uint32_t y1, uint32_t y2, uint8_t* dst) {
+    constexpr uint32_t BPP     = formatInfo<DRM>().bpp;
+    constexpr auto     OFFSETS = rgbOffsets(DRM);
+    static_assert(OFFSETS[0] >= 0, "not an 8 bit rgb format");
+
+    uint8_t* yPlane = dst;
+    uint8_t* uPlane = dst + w * h;
+    uint8_t* vPlane = uPlane + (w / 2) * (h / 2);
+
+    for (uint32_t y = y1; y < y2; y += 2) {
+        for (uint32_t x = 0; x < w; x += 2) {
+            int sumR = 0, sumG = 0, sumB = 0;
+
+            for (uint32_t dy = 0; dy < 2; ++dy) {
+                for (uint32_t dx = 0; dx < 2; ++dx) {
+                    const uint8_t* PX = src + (size_t)(y + dy) * stride + (size_t)(x + dx) * BPP;
+                    const int      R = PX[OFFSETS[0]], G = PX[OFFSETS[1]], B = PX[OFFSETS[2]];
+
+                    yPlane[(size_t)(y + dy) * w + x + dx] = ((66 * R + 129 * G + 25 * B + 128) >> 8) + 16;
+
+                    sumR += R;
+                    sumG += G;
+                    sumB += B;
+                }
+            }
+
+            const int R   = (sumR + 2) >> 2, G = (sumG + 2) >> 2, B = (sumB + 2) >> 2;
+            const int IDX = (y / 2) * (w / 2) + x / 2;
+
+            uPlane[IDX] = ((-38 * R - 74 * G + 112 * B + 128) >> 8) + 128;
+            vPlane[IDX] = ((112 * R - 94 * G - 18 * B + 128) >> 8) + 128;
+        }
+    }
+}
+
+using FConvert = void (*)(const uint8_t* src, uint32_t stride, uint32_t w, uint32_t h, uint32_t y1, uint32_t y2, uint8_t* dst);
+
+// nullptr for formats we can't encode
+static FConvert converterFor(uint32_t fmt) {
+    switch (fmt) {
+        case DRM_FORMAT_ARGB8888: return toI420<DRM_FORMAT_ARGB8888>;
+        case DRM_FORMAT_XRGB8888: return toI420<DRM_FORMAT_XRGB8888>;
+        case DRM_FORMAT_ABGR8888: return toI420<DRM_FORMAT_ABGR8888>;
+        case DRM_FORMAT_XBGR8888: return toI420<DRM_FORMAT_XBGR8888>;
+        case DRM_FORMAT_BGR888: return toI420<DRM_FORMAT_BGR888>;
+        case DRM_FORMAT_RGBA8888: return toI420<DRM_FORMAT_RGBA8888>;
+        case DRM_FORMAT_RGBX8888: return toI420<DRM_FORMAT_RGBX8888>;
+        case DRM_FORMAT_BGRA8888: return toI420<DRM_FORMAT_BGRA8888>;
+        case DRM_FORMAT_BGRX8888: return toI420<DRM_FORMAT_BGRX8888>;
+        default: return nullptr;
+    }
+}
+
+// the rows damage touches, as sorted [begin, end) spans widened to whole pixel pairs for the chroma planes
+static std::vector<std::pair<uint32_t, uint32_t>> damagedRows(const std::vector<CVideoEncoder::SRect>& damage, uint32_t h) {
+    std::vector<std::pair<uint32_t, uint32_t>> spans;
+    for (const auto& r : damage) {
+        const uint32_t Y1 = std::min(r.y & ~1u, h), Y2 = std::min((r.y + r.h + 1) & ~1u, h);
+        if (Y1 < Y2)
+            spans.emplace_back(Y1, Y2);
+    }
+
+    std::sort(spans.begin(), spans.end());
+
+    std::vector<std::pair<uint32_t, uint32_t>> merged;
+    for (const auto& span : spans) {
+        if (!merged.empty() && span.first <= merged.back().second)
+            merged.back().second = std::max(merged.back().second, span.second);
+        else
+            merged.push_back(span);
+    }
+
+    return merged;
+}
+
+CVideoEncoder::CVideoEncoder(pw_core* core, const std::string& rawName) : m_sName(rawName + "-vp8") {
+    m_pStream = pw_stream_new(core, m_sName.c_str(),
+                              pw_properties_new(PW_KEY_MEDIA_CLASS, "Video/Source", PW_KEY_NODE_DESCRIPTION, "xdph VP8 stream", "xdph.raw-node", rawName.c_str(), nullptr));
+
+    if (!m_pStream) {
+        Debug::log(ERR, "[encoder] pipewire refused the stream for {}", rawName);
+        return;
+    }
+
+    pw_stream_add_listener(m_pStream, &m_streamListener, &streamEvents, this);
+
+    // the format comes with the first frame, see wanted
+    pw_stream_connect(m_pStream, PW_DIRECTION_OUTPUT, PW_ID_ANY, (pw_stream_flags)(PW_STREAM_FLAG_DRIVER | PW_STREAM_FLAG_MAP_BUFFERS), nullptr, 0);
+
+    m_pPacketEvent = pw_loop_add_event(
+        g_pPortalManager->m_sPipewire.loop, [](void* data, uint64_t count) { ((CVideoEncoder*)data)->queuePackets(); }, this);
+
+    m_tEncode = std::thread([this]() { encodeThread(); });
+
+    Debug::log(LOG, "[encoder] offering {} as {}", rawName, m_sName);
+}
+
+CVideoEncoder::~CVideoEncoder() {
+    {
+        std::lock_guard<std::mutex> lg(m_mFrameLock);
+        m_bExit = true;
+    }
+    m_cvFrame.notify_one();
+
+    if (m_tEncode.joinable())
+        m_tEncode.join();
+
+    CPipewireLock lock;
+
+    if (m_pPacketEvent)
+        pw_loop_destroy_source(g_pPortalManager->m_sPipewire.loop, m_pPacketEvent);
+
+    if (m_pStream)
+        pw_stream_destroy(m_pStream);
+
+    while (const auto PPACKET = m_qPackets.pop()) {
+        delete *PPACKET;
+    }
+}
+
+bool CVideoEncoder::wanted(uint32_t w, uint32_t h, uint32_t framerate) {
+    if (!m_pStream)
+        return false;
+
+    // odd sizes lose their last row or column, I420 can't carry them
+    w &= ~1u;
+    h &= ~1u;
+
+    if (w != m_iFormatW || h != m_iFormatH || framerate != m_iFormatRate) {
+        m_iFormatW    = w;
+        m_iFormatH    = h;
+        m_iFormatRate = framerate;
+
+        uint8_t         buffer[1024];
+        spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+
+        const spa_pod*  params[1];
+        params[0] = (const spa_pod*)spa_pod_builder_add_object(&b, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat, SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+                                                               SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_vp8), SPA_FORMAT_VIDEO_size,
+                                                               SPA_POD_Rectangle(&SPA_RECTANGLE(w, h)), SPA_FORMAT_VIDEO_framerate, SPA_POD_Fraction(&SPA_FRACTION(0, 1)),
+                                                               SPA_FORMAT_VIDEO_maxFramerate, SPA_POD_Fraction(&SPA_FRACTION(framerate, 1)));
+
+        pw_stream_update_params(m_pStream, params, 1);
+
+        Debug::log(LOG, "[encoder] {} is now {}x{}@{}", m_sName, w, h, framerate);
+    }
+
+    return m_bStreaming && w >= 2 && h >= 2;
+}
+
+bool CVideoEncoder::needsFullFrame(uint32_t w, uint32_t h, uint32_t fmt, const std::vector<SRect>& damage) const {
+    // rows outside the damage are never read from the slot again, but it has to have the frame's layout
+    return m_bDropped || damage.empty() || m_sPending.w != w || m_sPending.h != h || m_sPending.fmt != fmt;
+}
+
+std::pair<uint32_t, uint32_t> CVideoEncoder::rowsToRead(uint32_t w, uint32_t h, uint32_t fmt, const std::vector<SRect>& damage) {
+    w &= ~1u;
+    h &= ~1u;
+
+    std::lock_guard<std::mutex> lg(m_mFrameLock);
+
+    if (needsFullFrame(w, h, fmt, damage))
+        return {0, h};
+
+    const auto SPANS = damagedRows(damage, h);
+    if (SPANS.empty())
+        return {0, 0};
+
+    return {SPANS.front().first, SPANS.back().second};
+}
+
+void CVideoEncoder::submit(const SFrameData& frame, uint32_t w, uint32_t h, uint32_t fmt, const std::vector<SRect>& damage, uint64_t ptsNs, uint32_t framerate,
+                           uint32_t bitrateKbps) {
+    const auto PFORMAT = formatFromDrm(fmt);
+
+    if (!PFORMAT || !converterFor(fmt)) {
+        Debug::log(TRACE, "[encoder] can't encode format {:x}", fmt);
+        return;
+    }
+
+    w &= ~1u;
+    h &= ~1u;
+
+    const uint32_t ROWBYTES = w * PFORMAT->bpp;
+
+    {
+        std::lock_guard<std::mutex> lg(m_mFrameLock);
+
+        const bool FULL  = needsFullFrame(w, h, fmt, damage);
+        const auto SPANS = FULL ? std::vector<std::pair<uint32_t, uint32_t>>{{0, h}} : damagedRows(damage, h);
+
+        // the frame changed layout since rowsToRead, what we got isn't enough. The next one is copied whole.
+        if (!SPANS.empty() && (SPANS.front().first < frame.firstRow || SPANS.back().second > frame.lastRow)) {
+            Debug::log(TRACE, "[encoder] frame is missing rows, dropping it");
+            m_bDropped = true;
+            return;
+        }
+
+        // an older one the encoder didn't get to is simply replaced, only rows this one changed are copied over it
+        m_sPending.raw.resize((size_t)ROWBYTES * h);
+        for (const auto& [Y1, Y2] : SPANS) {
+            for (uint32_t y = Y1; y < Y2; ++y) {
+                memcpy(m_sPending.raw.data() + (size_t)y * ROWBYTES, frame.data + (size_t)(y - frame.firstRow) * frame.stride, ROWBYTES);
+            }
+        }
+
+        m_sPending.w           = w;
+        m_sPending.h           = h;
+        m_sPending.fmt         = fmt;
+        m_sPending.stride      = ROWBYTES;
+        m_sPending.ptsNs       = ptsNs;
+        m_sPending.framerate   = std::max(framerate, 1u);
+        m_sPending.bitrateKbps = bitrateKbps;
+
+        // what changed in a replaced frame has to be encoded all the same. Empty damage is the whole frame.
+        if (FULL)
+            m_sPending.damage.clear();
+        else if (!m_bPending)
+            m_sPending.damage = damage;
+        else if (!m_sPending.damage.empty())
+            m_sPending.damage.insert(m_sPending.damage.end(), damage.begin(), damage.end());
+
+        m_bPending = true;
+        m_bDropped = false;
+    }
+
+    m_cvFrame.notify_one();
+}
+
+void CVideoEncoder::dropFrame() {
+    m_bDropped = true;
+}
+
+void CVideoEncoder::encodeThread() {
+    SFrame frame;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lk(m_mFrameLock);
+            m_cvFrame.wait(lk, [this]() { return m_bPending || m_bExit; });
+
+            if (m_bExit)
+                break;
+
+            // the old frame's memory is reused for the next pending one
+            std::swap(frame, m_sPending);
+            m_bPending = false;
+        }
+
+        encode(frame);
+    }
+
+    if (m_bCodecReady)
+        vpx_codec_destroy(&m_codec);
+}
+
+bool CVideoEncoder::configure(const SFrame& frame) {
+    if (m_bCodecReady && m_cfg.g_w == frame.w && m_cfg.g_h == frame.h) {
+        if (m_cfg.rc_target_bitrate != frame.bitrateKbps) {
+            m_cfg.rc_target_bitrate = frame.bitrateKbps;
+            vpx_codec_enc_config_set(&m_codec, &m_cfg);
+        }
+        return true;
+    }
+
+    if (m_bCodecReady) {
+        vpx_codec_destroy(&m_codec);
+        m_bCodecReady = false;
+    }
+
+    if (vpx_codec_enc_config_default(vpx_codec_vp8_cx(), &m_cfg, 0)) {
+        Debug::log(ERR, "[encoder] no default vp8 config");
+        return false;
+    }
+
+    m_cfg.g_w               = frame.w;
+    m_cfg.g_h               = frame.h;
+    m_cfg.g_timebase        = {1, 1000000};
+    m_cfg.g_threads         = std::clamp(std::thread::hardware_concurrency() / 2, 1u, MAX_THREADS);
+    m_cfg.g_lag_in_frames   = 0;
+    m_cfg.g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT;
+    m_cfg.rc_end_usage      = VPX_CBR;
+    m_cfg.rc_target_bitrate = frame.bitrateKbps;
+    m_cfg.kf_mode           = VPX_KF_AUTO;
+    m_cfg.kf_max_dist       = frame.framerate * KEYFRAME_MAX_SEC;
+
+    if (vpx_codec_enc_init(&m_codec, vpx_codec_vp8_cx(), &m_cfg, 0)) {
+        Debug::log(ERR, "[encoder] couldn't set up vp8 for {}x{}: {}", frame.w, frame.h, vpx_codec_error_detail(&m_codec) ? vpx_codec_error_detail(&m_codec) : "unknown");
+        return false;
+    }
+
+    // as fast as realtime vp8 gets, tuned for text and flat areas
+    vpx_codec_control(&m_codec, VP8E_SET_CPUUSED, 8);
+    vpx_codec_control(&m_codec, VP8E_SET_SCREEN_CONTENT_MODE, 1);
+
+    m_bCodecReady = true;
+    m_bNeedKey    = true;
+
+    Debug::log(LOG, "[encoder] vp8 at {}x{}, {}kbps, {} threads", frame.w, frame.h, frame.bitrateKbps, m_cfg.g_threads);
+
+    return true;
+}
+
+// brings m_vI420 up to date with the damaged rows of frame
+void CVideoEncoder::convert(const SFrame& frame) {
+    const auto CONVERT = converterFor(frame.fmt);
+    const bool FULL    = frame.damage.empty() || frame.w != m_iI420W || frame.h != m_iI420H;
+
+    m_vI420.resize((size_t)frame.w * frame.h * 3 / 2);
+    m_iI420W = frame.w;
+    m_iI420H = frame.h;
+
+    for (const auto& [Y1, Y2] : FULL ? std::vector<std::pair<uint32_t, uint32_t>>{{0, frame.h}} : damagedRows(frame.damage, frame.h)) {
+        CONVERT(frame.raw.data(), frame.stride, frame.w, frame.h, Y1, Y2, m_vI420.data());
+    }
+}
+
+void CVideoEncoder::encode(SFrame& frame) {
+    convert(frame);
+
+    if (!configure(frame))
+        return;
+
+    vpx_img_wrap(&m_image, VPX_IMG_FMT_I420, frame.w, frame.h, 1, m_vI420.data());
+
+    const bool     KEY  = m_bNeedKey.exchange(false);
+    const uint32_t COLS = (frame.w + MB_SIZE - 1) / MB_SIZE;
+    const uint32_t ROWS = (frame.h + MB_SIZE - 1) / MB_SIZE;
+
+    // macroblocks outside the damage are skipped and kept from the last frame. Keyframes, and frames without damage info, are coded whole.
+    vpx_active_map_t activeMap = {nullptr, ROWS, COLS};
+    if (!KEY && !frame.damage.empty()) {
+        m_vActiveMap.assign((size_t)ROWS * COLS, 0);
+
+        for (const auto& r : frame.damage) {
+            const uint32_t X2 = std::min((r.x + r.w + MB_SIZE - 1) / MB_SIZE, COLS);
+            const uint32_t Y2 = std::min((r.y + r.h + MB_SIZE - 1) / MB_SIZE, ROWS);
+            const uint32_t X1 = std::min(r.x / MB_SIZE, X2);
+
+            for (uint32_t y = r.y / MB_SIZE; y < Y2; ++y) {
+                std::fill(m_vActiveMap.begin() + (size_t)y * COLS + X1, m_vActiveMap.begin() + (size_t)y * COLS + X2, 1);
+            }
+        }
+
+        activeMap.active_map = m_vActiveMap.data();
+    }
+
+    vpx_codec_control(&m_codec, VP8E_SET_ACTIVEMAP, &activeMap);
+
+    const vpx_codec_pts_t PTS      = frame.ptsNs / 1000;
+    const unsigned long   DURATION = 1000000 / frame.framerate;
+
+    if (vpx_codec_encode(&m_codec, &m_image, PTS, DURATION, KEY ? VPX_EFLAG_FORCE_KF : 0, VPX_DL_REALTIME)) {
+        Debug::log(ERR, "[encoder] encoding failed: {}", vpx_codec_error(&m_codec));
+        m_bNeedKey = true;
+        return;
+    }
+
+    bool                      queued = false;
+    vpx_codec_iter_t          iter   = nullptr;
+    const vpx_codec_cx_pkt_t* pkt    = nullptr;
+    while ((pkt = vpx_codec_get_cx_data(&m_codec, &iter))) {
+        if (pkt->kind != VPX_CODEC_CX_FRAME_PKT)
+            continue;
+
+        const auto PPACKET = new SPacket{
+            .data  = std::vector<uint8_t>((const uint8_t*)pkt->data.frame.buf, (const uint8_t*)pkt->data.frame.buf + pkt->data.frame.sz),
+            .ptsNs = frame.ptsNs,
+            .key   = (pkt->data.frame.flags & VPX_FRAME_IS_KEY) != 0,
+        };
+
+        if (!m_qPackets.push(PPACKET)) {
+            Debug::log(TRACE, "[encoder] packet queue full, dropping a packet");
+            delete PPACKET;
+            m_bNeedKey = true;
+            continue;
+        }
+
+        queued = true;
+    }
+
+    if (queued)
+        pw_loop_signal_event(g_pPortalManager->m_sPipewire.loop, m_pPacketEvent);
+}
+
+void CVideoEncoder::onStateChanged(int state) {
+    Debug::log(LOG, "[encoder] {} is {}", m_sName, pw_stream_state_as_string((pw_stream_state)state));
+
+    m_bStreaming = state == PW_STREAM_STATE_STREAMING;
+
+    // whoever is listening now starts decoding from scratch
+    if (m_bStreaming)
+        m_bNeedKey = true;
+}
+
+void CVideoEncoder::onParamChanged(uint32_t id, const void* param) {
+    if (id != SPA_PARAM_Format || !param)
+        return;
+
+    // an I420 frame is a safe upper bound for a packet of it
+    const uint32_t  PACKETSIZE = std::max(m_iFormatW * m_iFormatH * 3 / 2, 4096u);
+
+    uint8_t         buffer[1024];
+    spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+
+    const spa_pod*  params[2];
+    params[0] = (const spa_pod*)spa_pod_builder_add_object(&b, SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers, SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(4, 2, 8),
+                                                           SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(1), SPA_PARAM_BUFFERS_size, SPA_POD_Int(PACKETSIZE), SPA_PARAM_BUFFERS_dataType,
+                                                           SPA_POD_CHOICE_FLAGS_Int((1 << SPA_DATA_MemPtr) | (1 << SPA_DATA_MemFd)));
+    params[1] = (const spa_pod*)spa_pod_builder_add_object(&b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header), SPA_PARAM_META_size,
+                                                           SPA_POD_Int(sizeof(struct spa_meta_header)));
+
+    pw_stream_update_params(m_pStream, params, 2);
+}
+
+void CVideoEncoder::queuePackets() {
+    bool queued = false;
+
+    while (const auto PPACKET = m_qPackets.pop()) {
+        std::unique_ptr<SPacket> packet{*PPACKET};
+
+        if (!m_bStreaming)
+            continue;
+
+        pw_buffer* buffer = pw_stream_dequeue_buffer(m_pStream);
+        if (!buffer) {
+            // the consumer is behind, it can't decode the frames after a lost one
+            Debug::log(TRACE, "[encoder] no buffer for a packet, dropping it");
+            m_bNeedKey = true;
+            continue;
+        }
+
+        spa_data* data = &buffer->buffer->datas[0];
+
+        if (!data->data || data->maxsize < packet->data.size()) {
+            Debug::log(TRACE, "[encoder] packet of {} bytes doesn't fit a {} byte buffer", packet->data.size(), data->maxsize);
+            data->chunk->size = 0;
+            pw_stream_queue_buffer(m_pStream, buffer);
+            m_bNeedKey = true;
+            continue;
+        }
+
+        memcpy(data->data, packet->data.data(), packet->data.size());
+        data->chunk->offset = 0;
+        data->chunk->size   = packet->data.size();
+        data->chunk->stride = 0;
+        data->chunk->flags  = SPA_CHUNK_FLAG_NONE;
+
+        spa_meta_header* header = (spa_meta_header*)spa_buffer_find_meta_data(buffer->buffer, SPA_META_Header, sizeof(*header));
+        if (header) {
+            header->pts        = packet->ptsNs;
+            header->flags      = packet->key ? 0 : SPA_META_HEADER_FLAG_DELTA_UNIT;
+            header->seq        = m_iSeq++;
+            header->dts_offset = 0;
+        }
+
+        pw_stream_queue_buffer(m_pStream, buffer);
+        queued = true;
+    }
+
+    if (queued)
+        pw_stream_trigger_process(m_pStream);
+}
+
+#endif
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "../helpers/SPSCQueue.hpp"
+#include <vpx/vpx_encoder.h>
+#include <spa/utils/hook.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct pw_core;
+struct pw_stream;
+struct spa_source;
+
+// Encodes the frames of a screencopy stream to VP8 with libvpx and offers them as a pipewire node of its own, next to the raw one.
+// Meant for consumers that would otherwise each encode the raw frames themselves. Only built with the encoder option (XDPH_ENCODER).
+// The main thread copies the damaged rows of a frame, they're converted to I420 and encoded on a thread of their own and queued by
+// the pipewire thread.
+class CVideoEncoder {
+  public:
+    struct SRect {
+        uint32_t x = 0, y = 0, w = 0, h = 0;
+    };
+
+    // rows [firstRow, lastRow) of a frame, data points at firstRow
+    struct SFrameData {
+        const uint8_t* data   = nullptr;
+        uint32_t       stride = 0, firstRow = 0, lastRow = 0;
+    };
+
+    // rawName is the node name of the raw stream, the encoded node is called rawName-vp8. Needs the pipewire lock.
+    CVideoEncoder(pw_core* core, const std::string& rawName);
+    ~CVideoEncoder();
+
+    CVideoEncoder(const CVideoEncoder&)            = delete;
+    CVideoEncoder& operator=(const CVideoEncoder&) = delete;
+
+    // keeps the node's format in sync with the frames. False while nothing consumes the node, frames aren't worth reading then.
+    // Main thread, with the pipewire lock.
+    bool wanted(uint32_t w, uint32_t h, uint32_t framerate);
+
+    // the rows [first, second) of the next frame submit needs, so only those have to be read back. Main thread.
+    std::pair<uint32_t, uint32_t> rowsToRead(uint32_t w, uint32_t h, uint32_t fmt, const std::vector<SRect>& damage);
+
+    // hands a frame to the encoder, replacing one that hasn't been picked up yet. Only what's in damage is copied and encoded,
+    // the rest of the frame is assumed unchanged. frame has to hold the rows rowsToRead asked for. Main thread.
+    void submit(const SFrameData& frame, uint32_t w, uint32_t h, uint32_t fmt, const std::vector<SRect>& damage, uint64_t ptsNs, uint32_t framerate, uint32_t bitrateKbps);
+
+    // a frame was captured but not submitted. Its damage is unknown, so the next one is encoded whole. Main thread.
+    void dropFrame();
+
+    // pipewire thread
+    void onStateChanged(int state);
+    void onParamChanged(uint32_t id, const void* param);
+    void queuePackets();
+
+  private:
+    struct SFrame {
+        std::vector<uint8_t> raw; // in fmt, w * bpp per row. Only the damaged rows are from this frame.
+        uint32_t             w = 0, h = 0, fmt = 0, stride = 0;
+        std::vector<SRect>   damage; // empty for all of it
+        uint64_t             ptsNs       = 0;
+        uint32_t             framerate   = 0;
+        uint32_t             bitrateKbps = 0;
+    };
+
+    struct SPacket {
+        std::vector<uint8_t> data;
+        uint64_t             ptsNs = 0;
+        bool                 key   = false;
+    };
+
+    void              encodeThread();
+    void              convert(const SFrame& frame);
+    void              encode(SFrame& frame);
+    bool              configure(const SFrame& frame);
+
+    // whether submitting a frame like this copies all of it. With m_mFrameLock.
+    bool              needsFullFrame(uint32_t w, uint32_t h, uint32_t fmt, const std::vector<SRect>& damage) const;
+
+    std::string       m_sName;
+    pw_stream*        m_pStream = nullptr;
+    spa_hook          m_streamListener;
+    spa_source*       m_pPacketEvent = nullptr;
+    std::atomic<bool> m_bStreaming   = false;
+    std::atomic<bool> m_bNeedKey     = true; // the consumer can't decode anything before the next keyframe
+
+    // what the node currently offers, with the pipewire lock
+    uint32_t m_iFormatW = 0, m_iFormatH = 0, m_iFormatRate = 0;
+
+    // pipewire thread only
+    uint64_t m_iSeq = 0;
+
+    // main thread only, see dropFrame
+    bool m_bDropped = false;
+
+    // the frame waiting for the encode thread
+    std::mutex              m_mFrameLock;
+    std::condition_variable m_cvFrame;
+    SFrame                  m_sPending;
+    bool                    m_bPending = false;
+    bool                    m_bExit    = false;
+    std::thread             m_tEncode;
+
+    // encode thread only
+    vpx_codec_ctx_t      m_codec;
+    bool                 m_bCodecReady = false;
+    vpx_codec_enc_cfg_t  m_cfg;
+    vpx_image_t          m_image;
+    std::vector<uint8_t> m_vActiveMap;
+    std::vector<uint8_t> m_vI420; // the last frame, only its damaged rows are converted again
+    uint32_t             m_iI420W = 0, m_iI420H = 0;
+
+    // encoded, waiting for the pipewire thread
+    CSPSCQueue<SPacket*, 16> m_qPackets;
+};
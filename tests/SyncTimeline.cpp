@@ -0,0 +1,165 @@
+// Checks the explicit sync points handed to consumers against a software timeline, see fillSyncMeta in Screencopy.cpp,
+// and that dequeue never hands out a buffer the consumer hasn't submitted its release for, see CReleasePending
+#include "../src/helpers/SyncTimeline.hpp"
+
+#include <cstdio>
+#include <memory>
+#include <set>
+#include <vector>
+
+// A timeline signalled on the cpu, in place of a drm syncobj. The dmabuf fd passed in stands for whether a write is pending on it.
+// Signalling a point at or below the current value is what a drm timeline can't take back, so it's counted as a failure.
+class CSoftwareSyncTimeline : public ISyncTimeline {
+  public:
+    virtual bool good() const {
+        return true;
+    }
+
+    virtual int fd() const {
+        return -1;
+    }
+
+    virtual bool importImplicit(int dmabufFD, uint64_t point) {
+        if (!dmabufFD)
+            return false;
+
+        m_sFenced.insert(point);
+        return true;
+    }
+
+    virtual bool available(uint64_t point) {
+        return point <= m_iValue || m_sFenced.contains(point);
+    }
+
+    virtual bool exportImplicit(int dmabufFD, uint64_t point) {
+        if (!available(point))
+            return false;
+
+        m_iWaitedOn = point;
+        return true;
+    }
+
+    virtual bool signal(uint64_t point) {
+        if (point <= m_iValue) {
+            m_iBackwards++;
+            return false;
+        }
+
+        m_iValue = point;
+        std::erase_if(m_sFenced, [point](uint64_t p) { return p <= point; });
+        return true;
+    }
+
+    uint64_t m_iValue     = 0;
+    uint32_t m_iBackwards = 0;
+    uint64_t m_iWaitedOn  = 0; // the last point a write was made to wait for
+
+  private:
+    std::set<uint64_t> m_sFenced;
+};
+
+static int failures = 0;
+
+#define CHECK(expr)                                                                                                                                                                \
+    if (!(expr)) {                                                                                                                                                                 \
+        std::printf("FAIL line %d: %s\n", __LINE__, #expr);                                                                                                                        \
+        failures++;                                                                                                                                                                \
+    }
+
+// the parts of ::SBuffer CReleasePending looks at
+struct SPendingBuffer {
+    std::unique_ptr<CSoftwareSyncTimeline> timeline      = std::make_unique<CSoftwareSyncTimeline>();
+    int                                    fd[1]         = {0};
+    uint64_t                               timelinePoint = 0;
+};
+
+static void checkReleasePending() {
+    CReleasePending<SPendingBuffer> pending;
+    SPendingBuffer                  fresh, a, b, implicit;
+
+    implicit.timeline.reset();
+
+    // nothing was captured into it yet, or it has no timeline at all
+    CHECK(pending.admit(&fresh));
+    CHECK(pending.admit(&implicit));
+    CHECK(pending.size() == 0);
+
+    // a frame went out on a and b, pipewire gave them back before the consumer submitted either release
+    for (auto* buf : {&a, &b}) {
+        const auto POINTS = buf->timeline->nextFrame(0, buf->timelinePoint);
+        CHECK(buf->timeline->m_iValue == POINTS.acquire);
+        buf->timelinePoint = POINTS.release;
+    }
+
+    CHECK(!pending.admit(&a));
+    CHECK(!pending.admit(&b));
+    CHECK(pending.size() == 2);
+
+    // dequeue has nothing to capture into, the frame is skipped. Nothing was made to wait either.
+    CHECK(pending.take() == nullptr);
+    CHECK(a.timeline->m_iWaitedOn == 0 && b.timeline->m_iWaitedOn == 0);
+
+    // b's consumer submitted its work, the release has a fence but isn't signalled. The next write waits for it.
+    b.timeline->importImplicit(1, b.timelinePoint);
+    CHECK(pending.take() == &b);
+    CHECK(b.timeline->m_iWaitedOn == b.timelinePoint);
+    CHECK(b.timeline->m_iValue < b.timelinePoint);
+    CHECK(pending.take() == nullptr);
+
+    // a's release got signalled outright
+    a.timeline->signal(a.timelinePoint);
+    CHECK(pending.take() == &a);
+    CHECK(pending.size() == 0);
+}
+
+int main() {
+    constexpr int BUFFERS = 3, FRAMES = 300;
+
+    struct SBuffer {
+        CSoftwareSyncTimeline timeline;
+        uint64_t              point = 0; // like SBuffer::timelinePoint, the last release point
+    };
+
+    std::vector<SBuffer> buffers(BUFFERS);
+
+    for (int frame = 0; frame < FRAMES; ++frame) {
+        auto&      buf = buffers[frame % BUFFERS];
+
+        // the consumer hasn't released the last frame on this buffer yet, and polling for it doesn't wait
+        const bool RELEASED = buf.point == 0 || buf.timeline.available(buf.point);
+        CHECK(buf.point == 0 || !RELEASED);
+
+        if (buf.point > 0)
+            buf.timeline.signal(buf.point);
+        CHECK(buf.point == 0 || buf.timeline.available(buf.point));
+
+        // every other frame the compositor's write is still in flight when it's queued
+        const bool WRITEPENDING = frame % 2;
+        const auto POINTS       = buf.timeline.nextFrame(WRITEPENDING, buf.point);
+
+        CHECK(POINTS.acquire > buf.point);
+        CHECK(POINTS.release > POINTS.acquire);
+        CHECK(buf.timeline.available(POINTS.acquire));
+        CHECK(!buf.timeline.available(POINTS.release));
+
+        // the compositor finishes writing, the consumer reads
+        if (WRITEPENDING)
+            buf.timeline.signal(POINTS.acquire);
+
+        CHECK(buf.timeline.m_iValue == POINTS.acquire);
+
+        buf.point = POINTS.release;
+    }
+
+    for (auto& buf : buffers) {
+        CHECK(buf.timeline.m_iBackwards == 0);
+        CHECK(buf.point == 2ull * (FRAMES / BUFFERS));
+    }
+
+    checkReleasePending();
+
+    if (failures)
+        std::printf("%d checks failed\n", failures);
+
+    return failures ? 1 : 0;
+}